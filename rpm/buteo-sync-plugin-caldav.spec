@@ -8,6 +8,7 @@ Source0:    %{name}-%{version}.tar.bz2
 BuildRequires:  pkgconfig(Qt5Core)
 BuildRequires:  pkgconfig(Qt5DBus)
 BuildRequires:  pkgconfig(Qt5Network)
+BuildRequires:  pkgconfig(Qt5Concurrent)
 BuildRequires:  pkgconfig(libsignon-qt5)
 BuildRequires:  pkgconfig(libsailfishkeyprovider)
 BuildRequires:  pkgconfig(libmkcal-qt5) >= 0.5.20
@@ -16,6 +17,7 @@ BuildRequires:  pkgconfig(buteosyncfw5) >= 0.10.0
 BuildRequires:  pkgconfig(accounts-qt5)
 BuildRequires:  pkgconfig(signon-oauth2plugin)
 BuildRequires:  pkgconfig(QmfClient)
+BuildRequires:  pkgconfig(connman-qt5)
 Requires: buteo-syncfw-qt5-msyncd
 
 %description
@@ -43,6 +45,10 @@ This package contains unit tests for the CalDAV Buteo sync plugin.
 /opt/tests/buteo/plugins/caldav/tst_incidencehandler
 /opt/tests/buteo/plugins/caldav/tst_propfind
 /opt/tests/buteo/plugins/caldav/tst_caldavclient
+/opt/tests/buteo/plugins/caldav/tst_requestscheduler
+/opt/tests/buteo/plugins/caldav/tst_httptrace
+/opt/tests/buteo/plugins/caldav/tst_syncmetrics
+/opt/tests/buteo/plugins/caldav/tst_tracer
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_insert_exdate.xml
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_insert_and_update.xml
 /opt/tests/buteo/plugins/caldav/data/notebooksyncagent_recurring.xml
@@ -29,6 +29,7 @@
 #include <QStringList>
 #include <QDebug>
 #include <QUrl>
+#include <QTimer>
 
 #include <Accounts/Manager>
 #include <Accounts/AuthData>
@@ -61,6 +62,7 @@ AuthHandler::AuthHandler(Accounts::Manager *manager, const quint32 accountId, co
     , mAccountManager(manager)
     , mAccount(manager->account(accountId))
     , m_accountService(accountService)
+    , mRefreshing(false)
 {
 }
 
@@ -136,11 +138,22 @@ void AuthHandler::sessionResponse(const SessionData &sessionData)
         mToken = response.AccessToken();
     } else {
         LOG_FATAL("Unsupported Mechanism requested!");
-        emit failed();
+        if (mRefreshing) {
+            mRefreshing = false;
+            emit refreshFailed();
+        } else {
+            emit failed();
+        }
         return;
     }
-    LOG_DEBUG("Authenticated!");
-    emit success();
+    if (mRefreshing) {
+        LOG_DEBUG("Token refreshed!");
+        mRefreshing = false;
+        emit tokenRefreshed();
+    } else {
+        LOG_DEBUG("Authenticated!");
+        emit success();
+    }
 }
 
 const QString AuthHandler::token()
@@ -210,6 +223,7 @@ void AuthHandler::authenticate()
         data.setRedirectUri(redirect_uri);
         data.setResponseType(QStringList() << response_type);
         data.setScope(scope);
+        data.setForceTokenRefresh(mRefreshing);
 
         mAccount->selectService(Accounts::Service());
 
@@ -220,11 +234,29 @@ void AuthHandler::authenticate()
     }
 }
 
+// Asks for a new access token, when the current one got rejected.
+void AuthHandler::refreshToken()
+{
+    FUNCTION_CALL_TRACE;
+
+    if (mMethod.compare("oauth2", Qt::CaseInsensitive) != 0) {
+        QTimer::singleShot(0, this, &AuthHandler::refreshFailed);
+        return;
+    }
+    mRefreshing = true;
+    authenticate();
+}
+
 void AuthHandler::error(const SignOn::Error & error)
 {
     FUNCTION_CALL_TRACE;
     LOG_DEBUG("Auth error:" << error.message());
-    emit failed();
+    if (mRefreshing) {
+        mRefreshing = false;
+        emit refreshFailed();
+    } else {
+        emit failed();
+    }
 }
 
 QString AuthHandler::storedKeyValue(const char *provider, const char *service, const char *keyName)
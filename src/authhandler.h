@@ -41,6 +41,7 @@ public:
     explicit AuthHandler(Accounts::Manager *manager, const quint32 accountId, const QString &accountService, QObject *parent = 0);
 
     void authenticate();
+    void refreshToken();
     const QString token();
     bool init();
     const QString username();
@@ -49,6 +50,8 @@ public:
 Q_SIGNALS:
     void success();
     void failed();
+    void tokenRefreshed();
+    void refreshFailed();
 
 private:
     void getToken();
@@ -77,6 +80,7 @@ private:
     QString mPassword;
     QString mMethod, mMechanism;
     QString m_accountService;
+    bool mRefreshing;
 };
 
 #endif // AUTHHANDLER_H
@@ -24,7 +24,12 @@
 
 #include "caldavclient.h"
 #include "propfind.h"
+#include "calendarhomecache.h"
 #include "notebooksyncagent.h"
+#include "requestscheduler.h"
+#include "httptrace.h"
+#include "syncmetrics.h"
+#include "tracer.h"
 
 #include <sailfishkeyprovider_iniparser.h>
 
@@ -35,11 +40,16 @@
 #include <QNetworkAccessManager>
 #include <QNetworkReply>
 #include <QDateTime>
+#include <QJsonArray>
+#include <QTimer>
 #include <QtGlobal>
 
 #include <Accounts/Manager>
 #include <Accounts/Account>
 
+#include <networkmanager.h>
+#include <networkservice.h>
+
 #include <PluginCbInterface.h>
 #include <LogMacros.h>
 #include <ProfileEngineDefs.h>
@@ -53,6 +63,26 @@ const QString cleanSyncMarkersFile = cleanSyncMarkersFileDir + QStringLiteral("/
 
 const char * const SYNC_PREV_PERIOD_KEY = "Sync Previous Months Span";
 const char * const SYNC_NEXT_PERIOD_KEY = "Sync Next Months Span";
+const char * const RECEIVE_BUFFER_SIZE_KEY = "Receive Buffer KiB";
+const char * const LOCAL_CHANGES_ONLY_KEY = "Sync Local Changes Only";
+const char * const HTTP_TRACE_SIZE_KEY = "HTTP Trace Entries";
+const char * const TRACE_EVENTS_KEY = "Trace Events";
+const char * const LOW_DATA_MODE_KEY = "Low Data Mode";
+const char * const LOW_DATA_MAX_RESOURCE_SIZE_KEY = "Low Data Max Resource KiB";
+
+// Delay after which results are reported even if the accounts
+// daemon did not acknowledge the account changes.
+const int ACCOUNT_SYNC_TIMEOUT = 10000;
+
+const QString PHASE_AUTHENTICATION = QStringLiteral("authentication");
+const QString PHASE_DISCOVERY = QStringLiteral("discovery");
+
+// Cellular connections are taken as metered, roaming or not.
+bool isMeteredConnection(const NetworkManager *manager)
+{
+    const NetworkService *service = manager ? manager->defaultRoute() : 0;
+    return service && service->type() == QStringLiteral("cellular");
+}
 
 }
 
@@ -73,8 +103,15 @@ CalDavClient::CalDavClient(const QString& aPluginName,
     , mCalendar(0)
     , mStorage(0)
     , mAccountId(0)
+    , mLocalChangesOnly(false)
+    , mAccountModified(false)
+    , mResultsPending(false)
 {
     FUNCTION_CALL_TRACE;
+
+    mAccountSyncTimer.setSingleShot(true);
+    mAccountSyncTimer.setInterval(ACCOUNT_SYNC_TIMEOUT);
+    connect(&mAccountSyncTimer, &QTimer::timeout, this, &CalDavClient::accountSynced);
 }
 
 CalDavClient::~CalDavClient()
@@ -88,6 +125,12 @@ bool CalDavClient::init()
 
     mNAManager = new QNetworkAccessManager(this);
 
+    // Shared with the other users of connman in the process, the
+    // default route may only be known after the sync started.
+    mConnectionManager = NetworkManager::sharedInstance();
+    connect(mConnectionManager.data(), &NetworkManager::defaultRouteChanged,
+            this, &CalDavClient::updateLowDataMode);
+
     if (initConfig()) {
         return true;
     } else {
@@ -110,6 +153,8 @@ bool CalDavClient::startSync()
     if (!mAuth)
         return false;
 
+    mMetrics = SyncMetrics(QString::number(mAccountId));
+    mMetrics.start(PHASE_AUTHENTICATION);
     mAuth->authenticate();
 
     LOG_DEBUG ("Init done. Continuing with sync");
@@ -264,7 +309,55 @@ void CalDavClient::connectivityStateChanged(Sync::ConnectivityType aType, bool a
     if (aType == Sync::CONNECTIVITY_INTERNET && !aState) {
         // we lost connectivity during sync.
         abortSync(Sync::SYNC_CONNECTION_ERROR);
+    } else if (aType == Sync::CONNECTIVITY_INTERNET) {
+        updateLowDataMode();
+    }
+}
+
+// Applies to the requests not sent yet.
+void CalDavClient::updateLowDataMode()
+{
+    const bool lowData = lowDataMode();
+    if (lowData != mSettings.lowDataMode()) {
+        LOG_INFO("Switching low data mode" << (lowData ? "on" : "off"));
+        mSettings.setLowDataMode(lowData);
+    }
+}
+
+// Either "on", "off", or "auto" to follow the default connection.
+bool CalDavClient::lowDataMode() const
+{
+    const Buteo::Profile* client = iProfile.clientProfile();
+    const QString policy = client ? client->key(LOW_DATA_MODE_KEY, QStringLiteral("auto"))
+        : QStringLiteral("auto");
+    if (policy == QStringLiteral("on")) {
+        return true;
+    } else if (policy == QStringLiteral("off")) {
+        return false;
+    }
+    return isMeteredConnection(mConnectionManager.data());
+}
+
+// The plugin is not told what triggered a sync. Syncs of sync on change
+// profiles are considered triggered by a local change, unless the
+// profile was never synced or its scheduled sync is due: scheduled and
+// manual syncs of other profiles list the remote calendars as usual.
+bool CalDavClient::localChangeTriggered() const
+{
+    if (!iProfile.isSOCProfile()) {
+        return false;
+    }
+    const QDateTime lastSync = iProfile.lastSuccessfulSyncTime();
+    if (!lastSync.isValid()) {
+        return false;
     }
+    const uint interval = iProfile.syncSchedule().interval();
+    if (iProfile.syncType() == Buteo::SyncProfile::SYNC_SCHEDULED && interval > 0
+        && lastSync.addSecs(qint64(interval) * 60) <= QDateTime::currentDateTime()) {
+        LOG_DEBUG("Scheduled sync due since" << lastSync.addSecs(qint64(interval) * 60));
+        return false;
+    }
+    return true;
 }
 
 Accounts::Account* CalDavClient::getAccountForCalendars(Accounts::Service *service) const
@@ -383,7 +476,6 @@ public:
         account->setValue("calendar_display_names", displayNames);
         account->setValue("calendar_colors", colors);
         account->selectService(Accounts::Service());
-        account->syncAndBlock();
     };
 private:
     QStringList paths;
@@ -405,7 +497,7 @@ QList<PropFind::CalendarInfo> CalDavClient::loadAccountCalendars() const
     return calendarSettings.enabledCalendars(calendarSettings.toCalendars());
 }
 
-QList<PropFind::CalendarInfo> CalDavClient::mergeAccountCalendars(const QList<PropFind::CalendarInfo> &calendars) const
+QList<PropFind::CalendarInfo> CalDavClient::mergeAccountCalendars(const QList<PropFind::CalendarInfo> &calendars)
 {
     Accounts::Service srv;
     Accounts::Account *account = getAccountForCalendars(&srv);
@@ -429,6 +521,7 @@ QList<PropFind::CalendarInfo> CalDavClient::mergeAccountCalendars(const QList<Pr
     if (modified) {
         LOG_DEBUG("Store modifications to calendar settings.");
         calendarSettings.store(account, srv);
+        mAccountModified = true;
     }
 
     return calendarSettings.enabledCalendars(calendars);
@@ -454,6 +547,7 @@ void CalDavClient::removeAccountCalendars(const QStringList &paths)
     }
     if (modified) {
         calendarSettings.store(account, srv);
+        mAccountModified = true;
     }
 }
 
@@ -498,6 +592,38 @@ bool CalDavClient::initConfig()
     connect(mAuth, SIGNAL(failed()), this, SLOT(authenticationError()));
 
     mSettings.setAccountId(accountId);
+    RequestScheduler *scheduler = RequestScheduler::instance(mNAManager);
+    connect(scheduler, &RequestScheduler::tokenExpired, this, [this] (const Settings *settings) {
+        if (settings == &mSettings) {
+            mAuth->refreshToken();
+        }
+    });
+    connect(mAuth, &AuthHandler::tokenRefreshed, this, &CalDavClient::tokenRefreshed);
+    connect(mAuth, &AuthHandler::refreshFailed, this, &CalDavClient::tokenRefreshFailed);
+
+    const Buteo::Profile* client = iProfile.clientProfile();
+    bool valid = (client != 0);
+    uint bufferSize = (valid) ? client->key(RECEIVE_BUFFER_SIZE_KEY).toUInt(&valid) : 0;
+    if (valid) {
+        mSettings.setReceiveBufferSize(qint64(bufferSize) * 1024);
+    }
+    mLocalChangesOnly = client && client->boolKey(LOCAL_CHANGES_ONLY_KEY, false)
+        && localChangeTriggered();
+    valid = (client != 0);
+    uint traceSize = (valid) ? client->key(HTTP_TRACE_SIZE_KEY).toUInt(&valid) : 0;
+    if (valid && traceSize > 0) {
+        HttpTrace::enable(mNAManager, int(traceSize));
+    }
+    Tracer::setEnabled(client && client->boolKey(TRACE_EVENTS_KEY, false));
+    valid = (client != 0);
+    uint maxResourceSize = (valid) ? client->key(LOW_DATA_MAX_RESOURCE_SIZE_KEY).toUInt(&valid) : 0;
+    if (valid) {
+        mSettings.setLowDataMaxResourceSize(qint64(maxResourceSize) * 1024);
+    }
+    mSettings.setLowDataMode(lowDataMode());
+    if (mSettings.lowDataMode()) {
+        LOG_INFO("Low data mode: checking collection tags, deferring large resources");
+    }
 
     mSyncDirection = iProfile.syncDirection();
     mConflictResPolicy = iProfile.conflictResolutionPolicy();
@@ -510,8 +636,41 @@ void CalDavClient::syncFinished(Buteo::SyncResults::MinorCode minorErrorCode,
 {
     FUNCTION_CALL_TRACE;
 
+    // One record per sync, with the totals summarised in the results.
+    SyncMetrics totals(mMetrics);
+    QJsonArray notebooks;
+    for (const NotebookSyncAgent *agent : const_cast<const QList<NotebookSyncAgent*>&>(mNotebookSyncAgents)) {
+        totals.merge(agent->metrics());
+        notebooks.append(agent->metrics().toJson());
+        LOG_INFO("Sync metrics for" << agent->path() << ":" << agent->metrics().summary());
+    }
+    QJsonObject record = totals.toJson();
+    record.insert(QStringLiteral("finished"), QDateTime::currentDateTimeUtc().toString(Qt::ISODate));
+    record.insert(QStringLiteral("minorCode"), int(minorErrorCode));
+    record.insert(QStringLiteral("notebooks"), notebooks);
+    record.insert(QStringLiteral("lowDataMode"), mSettings.lowDataMode());
+    SyncMetrics::save(mSettings.cacheDirectory() + QStringLiteral("/sync-metrics.json"), record);
+    const QString summary = mSettings.lowDataMode()
+        ? QStringLiteral("low data mode, %1").arg(totals.summary()) : totals.summary();
+    LOG_INFO("Sync metrics:" << summary);
+    const QString results = message.isEmpty() ? summary
+        : QStringLiteral("%1 (%2)").arg(message, summary);
+
     clearAgents();
 
+    if (mNAManager) {
+        RequestScheduler::instance(mNAManager)->forgetToken(&mSettings);
+        RequestScheduler::instance(mNAManager)->logStatistics();
+        HttpTrace *trace = HttpTrace::instance(mNAManager);
+        if (trace && trace->count() > 0) {
+            trace->save(mSettings.cacheDirectory() + QStringLiteral("/trace.har"));
+        }
+    }
+    if (Tracer::isEnabled()) {
+        Tracer::save(mSettings.cacheDirectory() + QStringLiteral("/trace-events.json"));
+        Tracer::clear();
+    }
+
     if (mCalendar) {
         mCalendar->close();
     }
@@ -524,7 +683,6 @@ void CalDavClient::syncFinished(Buteo::SyncResults::MinorCode minorErrorCode,
         LOG_DEBUG("CalDAV sync succeeded!" << message);
         mResults.setMajorCode(Buteo::SyncResults::SYNC_RESULT_SUCCESS);
         mResults.setMinorCode(Buteo::SyncResults::NO_ERROR);
-        emit success(getProfileName(), message);
     } else {
         LOG_WARNING("CalDAV sync failed:" << minorErrorCode << message);
         mResults.setMajorCode(minorErrorCode == Buteo::SyncResults::ABORTED
@@ -535,8 +693,49 @@ void CalDavClient::syncFinished(Buteo::SyncResults::MinorCode minorErrorCode,
         if (minorErrorCode == Buteo::SyncResults::AUTHENTICATION_FAILURE) {
             setCredentialsNeedUpdate(mSettings.accountId());
         }
+    }
 
-        emit error(getProfileName(), message, minorErrorCode);
+    // The account changes of the whole sync are written in one go,
+    // without blocking on the accounts database while requests are
+    // in flight. Results are reported once they are stored.
+    Accounts::Account *account = (mAccountModified && mManager)
+        ? mManager->account(mAccountId) : nullptr;
+    mAccountModified = false;
+    mAccountSyncTimer.stop();
+    if (account) {
+        mPendingMessage = results;
+        mResultsPending = true;
+        connect(account, &Accounts::Account::synced,
+                this, &CalDavClient::accountSynced, Qt::UniqueConnection);
+        mAccountSyncTimer.start();
+        account->sync();
+    } else {
+        emitResults(results);
+    }
+}
+
+void CalDavClient::accountSynced()
+{
+    if (!mResultsPending) {
+        return;
+    }
+    mResultsPending = false;
+    mAccountSyncTimer.stop();
+    Accounts::Account *account = mManager->account(mAccountId);
+    if (account) {
+        disconnect(account, &Accounts::Account::synced,
+                   this, &CalDavClient::accountSynced);
+    }
+    emitResults(mPendingMessage);
+    mPendingMessage.clear();
+}
+
+void CalDavClient::emitResults(const QString &message)
+{
+    if (mResults.minorCode() == Buteo::SyncResults::NO_ERROR) {
+        emit success(getProfileName(), message);
+    } else {
+        emit error(getProfileName(), message, mResults.minorCode());
     }
 }
 
@@ -546,6 +745,18 @@ void CalDavClient::authenticationError()
                  QLatin1String("Authentication failed"));
 }
 
+void CalDavClient::tokenRefreshed()
+{
+    mSettings.setAuthToken(mAuth->token());
+    RequestScheduler::instance(mNAManager)->tokenRefreshed(&mSettings, true);
+}
+
+void CalDavClient::tokenRefreshFailed()
+{
+    // The rejected requests fail with an authentication error.
+    RequestScheduler::instance(mNAManager)->tokenRefreshed(&mSettings, false);
+}
+
 Buteo::SyncProfile::SyncDirection CalDavClient::syncDirection()
 {
     FUNCTION_CALL_TRACE;
@@ -588,28 +799,69 @@ void CalDavClient::start()
         mSettings.setPassword(mAuth->password());
     }
     mSettings.setAuthToken(mAuth->token());
+    mMetrics.stop(PHASE_AUTHENTICATION);
 
-    // read the calendar user address set, to get their mailto href.
-    PropFind *userAddressSetRequest = new PropFind(mNAManager, &mSettings, this);
-    connect(userAddressSetRequest, &Request::finished, [this, userAddressSetRequest] {
-        const QString userPrincipal = userAddressSetRequest->userPrincipal();
-        userAddressSetRequest->deleteLater();
-        if (!userPrincipal.isEmpty()) {
-            // determine the mailto href for this user.
+    mMetrics.start(PHASE_DISCOVERY);
+    discover();
+}
+
+// Read in one request the user principal, their mailto href and the
+// calendar home, when the server exposes them on the DAV root.
+void CalDavClient::discover()
+{
+    PropFind *discoveryRequest = new PropFind(mNAManager, &mSettings, this);
+    connect(discoveryRequest, &Request::finished, [this, discoveryRequest] {
+        mMetrics.addRequest(PHASE_DISCOVERY, discoveryRequest->bytesSent(),
+                            discoveryRequest->bytesReceived());
+        discoveryRequest->deleteLater();
+        const QString userPrincipal = discoveryRequest->userPrincipal();
+        if (discoveryRequest->errorCode() != Buteo::SyncResults::NO_ERROR
+            || userPrincipal.isEmpty()) {
+            LOG_DEBUG("Combined discovery failed, falling back to step by step discovery.");
+            listUserPrincipal();
+        } else if (discoveryRequest->userHomeHref().isEmpty()) {
+            // The calendar properties are only given on the principal resource.
+            listUserAddressSet(userPrincipal);
+        } else {
             mSettings.setUserPrincipal(userPrincipal);
-            PropFind *userHrefsRequest = new PropFind(mNAManager, &mSettings, this);
-            connect(userHrefsRequest, &Request::finished, [this, userHrefsRequest] {
-                userHrefsRequest->deleteLater();
-                mSettings.setUserMailtoHref(userHrefsRequest->userMailtoHref());
-                listCalendars(userHrefsRequest->userHomeHref());
-            });
-            userHrefsRequest->listUserAddressSet(userPrincipal);
+            mSettings.setUserMailtoHref(discoveryRequest->userMailtoHref());
+            listCalendars(discoveryRequest->userHomeHref());
+        }
+    });
+    discoveryRequest->discover();
+}
+
+void CalDavClient::listUserPrincipal()
+{
+    PropFind *userPrincipalRequest = new PropFind(mNAManager, &mSettings, this);
+    connect(userPrincipalRequest, &Request::finished, [this, userPrincipalRequest] {
+        const QString userPrincipal = userPrincipalRequest->userPrincipal();
+        mMetrics.addRequest(PHASE_DISCOVERY, userPrincipalRequest->bytesSent(),
+                            userPrincipalRequest->bytesReceived());
+        userPrincipalRequest->deleteLater();
+        if (!userPrincipal.isEmpty()) {
+            listUserAddressSet(userPrincipal);
         } else {
             // just continue normal calendar sync.
             listCalendars();
         }
     });
-    userAddressSetRequest->listCurrentUserPrincipal();
+    userPrincipalRequest->listCurrentUserPrincipal();
+}
+
+// read the calendar user address set, to get their mailto href.
+void CalDavClient::listUserAddressSet(const QString &userPrincipal)
+{
+    mSettings.setUserPrincipal(userPrincipal);
+    PropFind *userHrefsRequest = new PropFind(mNAManager, &mSettings, this);
+    connect(userHrefsRequest, &Request::finished, [this, userHrefsRequest] {
+        mMetrics.addRequest(PHASE_DISCOVERY, userHrefsRequest->bytesSent(),
+                            userHrefsRequest->bytesReceived());
+        userHrefsRequest->deleteLater();
+        mSettings.setUserMailtoHref(userHrefsRequest->userMailtoHref());
+        listCalendars(userHrefsRequest->userHomeHref());
+    });
+    userHrefsRequest->listUserAddressSet(userPrincipal);
 }
 
 void CalDavClient::listCalendars(const QString &home)
@@ -636,19 +888,57 @@ void CalDavClient::listCalendars(const QString &home)
         int lastIndex = allCalendarInfo[0].remotePath.lastIndexOf('/', -2);
         remoteHome = allCalendarInfo[0].remotePath.left(lastIndex + 1);
     }
+
+    // Listing a home with many shared calendars is costly, check first
+    // with its tag if anything changed since last listing.
+    CalendarHomeCache cache(mSettings.cacheDirectory() + QStringLiteral("/calendar-home.json"));
+    if (!cache.load() || cache.home() != remoteHome) {
+        cache.clear();
+    }
+    if (cache.exists() && cache.tag().isEmpty()) {
+        // The server gives no tag for this home.
+        fetchCalendars(remoteHome, QString());
+        return;
+    }
+    PropFind *tagRequest = new PropFind(mNAManager, &mSettings, this);
+    connect(tagRequest, &Request::finished, this, [this, tagRequest, remoteHome, cache] {
+        mMetrics.addRequest(PHASE_DISCOVERY, tagRequest->bytesSent(),
+                            tagRequest->bytesReceived());
+        tagRequest->deleteLater();
+        const QString tag = tagRequest->errorCode() == Buteo::SyncResults::NO_ERROR
+            ? tagRequest->homeTag() : QString();
+        if (!tag.isEmpty() && cache.exists() && tag == cache.tag()) {
+            LOG_DEBUG("Calendar home" << remoteHome << "unchanged since last listing.");
+            mMetrics.stop(PHASE_DISCOVERY);
+            syncCalendars(mergeAccountCalendars(cache.calendars()));
+        } else {
+            fetchCalendars(remoteHome, tag);
+        }
+    });
+    tagRequest->listHomeTag(remoteHome);
+}
+
+void CalDavClient::fetchCalendars(const QString &home, const QString &tag)
+{
     PropFind *calendarRequest = new PropFind(mNAManager, &mSettings, this);
-    connect(calendarRequest, &Request::finished, this, [this, calendarRequest] {
+    connect(calendarRequest, &Request::finished, this, [this, calendarRequest, home, tag] {
+        mMetrics.addRequest(PHASE_DISCOVERY, calendarRequest->bytesSent(),
+                            calendarRequest->bytesReceived());
+        mMetrics.stop(PHASE_DISCOVERY);
         calendarRequest->deleteLater();
         if (calendarRequest->errorCode() == Buteo::SyncResults::NO_ERROR
             // Request silently ignores this QNetworkReply::NetworkError
             && calendarRequest->networkError() != QNetworkReply::ContentOperationNotPermittedError) {
+            CalendarHomeCache cache(mSettings.cacheDirectory() + QStringLiteral("/calendar-home.json"));
+            cache.set(home, tag, calendarRequest->calendars());
+            cache.save();
             syncCalendars(mergeAccountCalendars(calendarRequest->calendars()));
         } else {
             LOG_WARNING("Cannot list calendars, fallback to stored ones in account.");
             syncCalendars(loadAccountCalendars());
         }
     });
-    calendarRequest->listCalendars(remoteHome);
+    calendarRequest->listCalendars(home);
 }
 
 void CalDavClient::syncCalendars(const QList<PropFind::CalendarInfo> &allCalendarInfo)
@@ -694,13 +984,15 @@ void CalDavClient::syncCalendars(const QList<PropFind::CalendarInfo> &allCalenda
                          QLatin1String("unable to load calendar storage"));
             return;
         }
+        agent->setConflictResolutionPolicy(conflictResolutionPolicy());
         connect(agent, &NotebookSyncAgent::finished,
                 this, &CalDavClient::notebookSyncFinished);
         mNotebookSyncAgents.append(agent);
 
         agent->startSync(fromDateTime, toDateTime,
                          mSyncDirection != Buteo::SyncProfile::SYNC_DIRECTION_FROM_REMOTE,
-                         mSyncDirection != Buteo::SyncProfile::SYNC_DIRECTION_TO_REMOTE);
+                         mSyncDirection != Buteo::SyncProfile::SYNC_DIRECTION_TO_REMOTE,
+                         mLocalChangesOnly);
     }
     if (mNotebookSyncAgents.isEmpty()) {
         syncFinished(Buteo::SyncResults::INTERNAL_ERROR,
@@ -713,6 +1005,8 @@ void CalDavClient::clearAgents()
     FUNCTION_CALL_TRACE;
 
     for (int i=0; i<mNotebookSyncAgents.count(); i++) {
+        // Agents may still have a pending finished() signal.
+        mNotebookSyncAgents[i]->disconnect(this);
         mNotebookSyncAgents[i]->deleteLater();
     }
     mNotebookSyncAgents.clear();
@@ -785,7 +1079,7 @@ void CalDavClient::setCredentialsNeedUpdate(int accountId)
                 account->setValue(QStringLiteral("CredentialsNeedUpdate"), QVariant::fromValue<bool>(true));
                 account->setValue(QStringLiteral("CredentialsNeedUpdateFrom"), QVariant::fromValue<QString>(QString::fromLatin1("caldav-sync")));
                 account->selectService(Accounts::Service());
-                account->syncAndBlock();
+                mAccountModified = true;
                 break;
             }
         }
@@ -29,10 +29,13 @@
 #include "settings.h"
 #include "propfind.h"
 #include "notebooksyncagent.h"
+#include "syncmetrics.h"
 
 #include <QList>
 #include <QSet>
 #include <QScopedPointer>
+#include <QSharedPointer>
+#include <QTimer>
 
 #include <extendedstorage.h>
 
@@ -46,6 +49,7 @@
 #include <sailfishkeyprovider_processmutex.h>
 
 class QNetworkAccessManager;
+class NetworkManager;
 class Request;
 
 /*
@@ -140,12 +144,19 @@ public Q_SLOTS:
 private Q_SLOTS:
     void start();
     void authenticationError();
+    void tokenRefreshed();
+    void tokenRefreshFailed();
     void notebookSyncFinished();
+    void accountSynced();
+    void updateLowDataMode();
 
 private:
     bool initConfig();
     void closeConfig();
+    bool lowDataMode() const;
+    bool localChangeTriggered() const;
     void syncFinished(Buteo::SyncResults::MinorCode minorErrorCode, const QString &message = QString());
+    void emitResults(const QString &message);
     void clearAgents();
     bool deleteNotebook(int accountId, mKCal::ExtendedCalendar::Ptr calendar, mKCal::ExtendedStorage::Ptr storage, mKCal::Notebook::Ptr notebook);
     void deleteNotebooksForAccount(int accountId, mKCal::ExtendedCalendar::Ptr calendar, mKCal::ExtendedStorage::Ptr storage);
@@ -153,9 +164,13 @@ private:
     void getSyncDateRange(const QDateTime &sourceDate, QDateTime *fromDateTime, QDateTime *toDateTime);
     Accounts::Account* getAccountForCalendars(Accounts::Service *service) const;
     QList<PropFind::CalendarInfo> loadAccountCalendars() const;
-    QList<PropFind::CalendarInfo> mergeAccountCalendars(const QList<PropFind::CalendarInfo> &calendars) const;
+    QList<PropFind::CalendarInfo> mergeAccountCalendars(const QList<PropFind::CalendarInfo> &calendars);
     void removeAccountCalendars(const QStringList &paths);
+    void discover();
+    void listUserPrincipal();
+    void listUserAddressSet(const QString &userPrincipal);
     void listCalendars(const QString &home = QString());
+    void fetchCalendars(const QString &home, const QString &tag);
     void syncCalendars(const QList<PropFind::CalendarInfo> &allCalendarInfo);
 
     Buteo::SyncProfile::SyncDirection syncDirection();
@@ -166,6 +181,7 @@ private:
     mutable QScopedPointer<Sailfish::KeyProvider::ProcessMutex> mProcessMutex;
     QList<NotebookSyncAgent *>  mNotebookSyncAgents;
     QNetworkAccessManager*      mNAManager;
+    QSharedPointer<NetworkManager> mConnectionManager;
     Accounts::Manager*          mManager;
     AuthHandler*                mAuth;
     mKCal::ExtendedCalendar::Ptr mCalendar;
@@ -176,6 +192,12 @@ private:
     Buteo::SyncProfile::ConflictResolutionPolicy mConflictResPolicy;
     Settings                    mSettings;
     int                         mAccountId;
+    bool                        mLocalChangesOnly;
+    SyncMetrics                 mMetrics;
+    bool                        mAccountModified;
+    bool                        mResultsPending;
+    QString                     mPendingMessage;
+    QTimer                      mAccountSyncTimer;
 
     friend class tst_CalDavClient;
 };
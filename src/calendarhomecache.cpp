@@ -0,0 +1,140 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "calendarhomecache.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QSaveFile>
+
+#include <LogMacros.h>
+
+CalendarHomeCache::CalendarHomeCache(const QString &fileName)
+    : mFileName(fileName)
+    , mExists(false)
+{
+}
+
+bool CalendarHomeCache::load()
+{
+    clear();
+
+    QFile file(mFileName);
+    if (!file.exists()) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        LOG_WARNING("Cannot read calendar home cache" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    const QJsonObject cache = QJsonDocument::fromJson(file.readAll()).object();
+    if (cache.isEmpty()) {
+        LOG_WARNING("Ignoring malformed calendar home cache" << mFileName);
+        return false;
+    }
+    mHome = cache.value(QStringLiteral("home")).toString();
+    mTag = cache.value(QStringLiteral("tag")).toString();
+    for (const QJsonValue &value : cache.value(QStringLiteral("calendars")).toArray()) {
+        const QJsonObject calendar = value.toObject();
+        mCalendars.append(PropFind::CalendarInfo(calendar.value(QStringLiteral("path")).toString(),
+                                                 calendar.value(QStringLiteral("displayName")).toString(),
+                                                 calendar.value(QStringLiteral("color")).toString(),
+                                                 calendar.value(QStringLiteral("userPrincipal")).toString(),
+                                                 calendar.value(QStringLiteral("readOnly")).toBool()));
+    }
+    mExists = true;
+    LOG_DEBUG("Calendar home cache" << mFileName << "has" << mCalendars.count() << "calendars");
+
+    return true;
+}
+
+bool CalendarHomeCache::save() const
+{
+    QJsonArray calendars;
+    for (const PropFind::CalendarInfo &info : mCalendars) {
+        QJsonObject calendar;
+        calendar.insert(QStringLiteral("path"), info.remotePath);
+        calendar.insert(QStringLiteral("displayName"), info.displayName);
+        calendar.insert(QStringLiteral("color"), info.color);
+        calendar.insert(QStringLiteral("userPrincipal"), info.userPrincipal);
+        calendar.insert(QStringLiteral("readOnly"), info.readOnly);
+        calendars.append(calendar);
+    }
+    QJsonObject cache;
+    cache.insert(QStringLiteral("home"), mHome);
+    cache.insert(QStringLiteral("tag"), mTag);
+    cache.insert(QStringLiteral("calendars"), calendars);
+
+    QDir().mkpath(QFileInfo(mFileName).absolutePath());
+    QSaveFile file(mFileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot write calendar home cache" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    file.write(QJsonDocument(cache).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
+
+bool CalendarHomeCache::exists() const
+{
+    return mExists;
+}
+
+void CalendarHomeCache::set(const QString &home, const QString &tag,
+                            const QList<PropFind::CalendarInfo> &calendars)
+{
+    mHome = home;
+    mTag = tag;
+    mCalendars = calendars;
+    mExists = true;
+}
+
+void CalendarHomeCache::clear()
+{
+    mHome.clear();
+    mTag.clear();
+    mCalendars.clear();
+    mExists = false;
+}
+
+const QString& CalendarHomeCache::home() const
+{
+    return mHome;
+}
+
+const QString& CalendarHomeCache::tag() const
+{
+    return mTag;
+}
+
+const QList<PropFind::CalendarInfo>& CalendarHomeCache::calendars() const
+{
+    return mCalendars;
+}
+
+const QString& CalendarHomeCache::fileName() const
+{
+    return mFileName;
+}
@@ -0,0 +1,60 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef CALENDARHOMECACHE_H
+#define CALENDARHOMECACHE_H
+
+#include "propfind.h"
+
+#include <QString>
+#include <QList>
+
+// The calendars listed in the calendar home at last sync, with the
+// sync-token or ctag of the home at that time. While the tag does not
+// change, the calendars are taken from here instead of listing the
+// home again. An empty tag means that the server gives none.
+class CalendarHomeCache
+{
+public:
+    explicit CalendarHomeCache(const QString &fileName);
+
+    bool load();
+    bool save() const;
+    bool exists() const;
+
+    void set(const QString &home, const QString &tag,
+             const QList<PropFind::CalendarInfo> &calendars);
+    void clear();
+
+    const QString& home() const;
+    const QString& tag() const;
+    const QList<PropFind::CalendarInfo>& calendars() const;
+    const QString& fileName() const;
+
+private:
+    QString mFileName;
+    bool mExists;
+    QString mHome;
+    QString mTag;
+    QList<PropFind::CalendarInfo> mCalendars;
+};
+
+#endif // CALENDARHOMECACHE_H
@@ -39,34 +39,22 @@ Delete::Delete(QNetworkAccessManager *manager, Settings *settings, QObject *pare
     FUNCTION_CALL_TRACE;
 }
 
-void Delete::deleteEvent(const QString &href)
+void Delete::deleteEvent(const QString &href, const QString &eTag)
 {
     FUNCTION_CALL_TRACE;
 
     QNetworkRequest request;
     prepareRequest(&request, href);
-    QNetworkReply *reply = mNAManager->sendCustomRequest(request, REQUEST_TYPE.toLatin1());
-    reply->setProperty(PROP_INCIDENCE_URI, href);
-    debugRequest(request, QStringLiteral(""));
-    connect(reply, SIGNAL(finished()), this, SLOT(requestFinished()));
-    connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
-            this, SLOT(slotSslErrors(QList<QSslError>)));
+    if (!eTag.isEmpty()) {
+        request.setRawHeader("If-Match", eTag.toLatin1());
+    }
+    send(request, QByteArray(), href);
 }
 
-void Delete::requestFinished()
+void Delete::handleReply(QNetworkReply *reply)
 {
     FUNCTION_CALL_TRACE;
 
-    if (wasDeleted()) {
-        LOG_DEBUG(command() << "request was aborted");
-        return;
-    }
-
-    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (!reply) {
-        finishedWithInternalError(QString());
-        return;
-    }
     reply->deleteLater();
     debugReplyAndReadAll(reply);
 
@@ -75,6 +63,6 @@ void Delete::requestFinished()
         // Consider a success if the content does not exist on server.
         finishedWithSuccess(uri);
     } else {
-        finishedWithReplyResult(uri, reply->error());
+        finishedWithReplyResult(uri, reply);
     }
 }
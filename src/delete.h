@@ -40,10 +40,10 @@ class Delete : public Request
 public:
     explicit Delete(QNetworkAccessManager *manager, Settings *settings, QObject *parent = 0);
 
-    void deleteEvent(const QString &href);
+    void deleteEvent(const QString &href, const QString &eTag = QString());
 
-private Q_SLOTS:
-    void requestFinished();
+protected:
+    void handleReply(QNetworkReply *reply) override;
 
 };
 
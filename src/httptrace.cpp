@@ -0,0 +1,184 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "httptrace.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+#include <QNetworkRequest>
+#include <QSaveFile>
+
+#include <LogMacros.h>
+
+namespace {
+    const QByteArray REDACTED = QByteArrayLiteral("<redacted>");
+
+    bool isSensitive(const QByteArray &name)
+    {
+        const QByteArray header = name.toLower();
+        return header == "authorization" || header == "proxy-authorization"
+            || header == "cookie" || header == "set-cookie";
+    }
+
+    QJsonArray headersToJson(const QList<QPair<QByteArray, QByteArray> > &headers)
+    {
+        QJsonArray array;
+        for (const QPair<QByteArray, QByteArray> &header : headers) {
+            QJsonObject object;
+            object.insert(QStringLiteral("name"), QString::fromLatin1(header.first));
+            object.insert(QStringLiteral("value"), QString::fromLatin1(header.second));
+            array.append(object);
+        }
+        return array;
+    }
+}
+
+HttpTrace::HttpTrace(QNetworkAccessManager *manager, int capacity)
+    : QObject(manager)
+    , mCapacity(capacity)
+    , mNext(0)
+{
+    mEntries.reserve(capacity);
+}
+
+HttpTrace* HttpTrace::enable(QNetworkAccessManager *manager, int capacity)
+{
+    HttpTrace *trace = instance(manager);
+    if (!trace && capacity > 0) {
+        trace = new HttpTrace(manager, capacity);
+    }
+    return trace;
+}
+
+// Null when tracing was not enabled for this manager.
+HttpTrace* HttpTrace::instance(QNetworkAccessManager *manager)
+{
+    return manager->findChild<HttpTrace*>(QString(), Qt::FindDirectChildrenOnly);
+}
+
+void HttpTrace::record(const QByteArray &method, const QNetworkRequest &request, qint64 requestSize,
+                       const QNetworkReply &reply, qint64 responseSize, qint64 duration)
+{
+    Entry entry;
+    entry.started = QDateTime::currentDateTimeUtc().addMSecs(-duration);
+    entry.duration = duration;
+    entry.method = method;
+    entry.url = request.url().adjusted(QUrl::RemoveUserInfo);
+    for (const QByteArray &name : request.rawHeaderList()) {
+        entry.requestHeaders.append(qMakePair(name, isSensitive(name) ? REDACTED : request.rawHeader(name)));
+    }
+    entry.requestSize = requestSize;
+    entry.status = reply.attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    entry.reason = reply.attribute(QNetworkRequest::HttpReasonPhraseAttribute).toByteArray();
+    entry.error = reply.error();
+    for (const QNetworkReply::RawHeaderPair &header : reply.rawHeaderPairs()) {
+        entry.responseHeaders.append(qMakePair(header.first, isSensitive(header.first) ? REDACTED : header.second));
+    }
+    entry.responseSize = responseSize;
+
+    // Oldest entries are overwritten once the buffer is full.
+    if (mEntries.count() < mCapacity) {
+        mEntries.append(entry);
+    } else {
+        mEntries[mNext] = entry;
+    }
+    mNext = (mNext + 1) % mCapacity;
+}
+
+int HttpTrace::count() const
+{
+    return mEntries.count();
+}
+
+bool HttpTrace::save(const QString &fileName) const
+{
+    QJsonArray entries;
+    for (int i = 0; i < mEntries.count(); ++i) {
+        // From the oldest entry, at mNext once the buffer is full.
+        const Entry &entry = mEntries[(mNext + i) % mEntries.count()];
+
+        QJsonObject request;
+        request.insert(QStringLiteral("method"), QString::fromLatin1(entry.method));
+        request.insert(QStringLiteral("url"), entry.url.toString());
+        request.insert(QStringLiteral("httpVersion"), QStringLiteral("HTTP/1.1"));
+        request.insert(QStringLiteral("headers"), headersToJson(entry.requestHeaders));
+        request.insert(QStringLiteral("queryString"), QJsonArray());
+        request.insert(QStringLiteral("cookies"), QJsonArray());
+        request.insert(QStringLiteral("headersSize"), -1);
+        request.insert(QStringLiteral("bodySize"), double(entry.requestSize));
+
+        QJsonObject content;
+        content.insert(QStringLiteral("size"), double(entry.responseSize));
+        content.insert(QStringLiteral("mimeType"), QString());
+        QJsonObject response;
+        response.insert(QStringLiteral("status"), entry.status);
+        response.insert(QStringLiteral("statusText"), QString::fromLatin1(entry.reason));
+        response.insert(QStringLiteral("httpVersion"), QStringLiteral("HTTP/1.1"));
+        response.insert(QStringLiteral("headers"), headersToJson(entry.responseHeaders));
+        response.insert(QStringLiteral("cookies"), QJsonArray());
+        response.insert(QStringLiteral("content"), content);
+        response.insert(QStringLiteral("redirectURL"), QString());
+        response.insert(QStringLiteral("headersSize"), -1);
+        response.insert(QStringLiteral("bodySize"), double(entry.responseSize));
+        if (entry.error != QNetworkReply::NoError) {
+            response.insert(QStringLiteral("_error"), entry.error);
+        }
+
+        // Only the total time is known, reported as waiting.
+        QJsonObject timings;
+        timings.insert(QStringLiteral("send"), 0);
+        timings.insert(QStringLiteral("wait"), double(entry.duration));
+        timings.insert(QStringLiteral("receive"), 0);
+
+        QJsonObject object;
+        object.insert(QStringLiteral("startedDateTime"), entry.started.toString(Qt::ISODateWithMs));
+        object.insert(QStringLiteral("time"), double(entry.duration));
+        object.insert(QStringLiteral("request"), request);
+        object.insert(QStringLiteral("response"), response);
+        object.insert(QStringLiteral("cache"), QJsonObject());
+        object.insert(QStringLiteral("timings"), timings);
+        entries.append(object);
+    }
+
+    QJsonObject creator;
+    creator.insert(QStringLiteral("name"), QStringLiteral("buteo-sync-plugin-caldav"));
+    creator.insert(QStringLiteral("version"), QStringLiteral("1.0"));
+    QJsonObject log;
+    log.insert(QStringLiteral("version"), QStringLiteral("1.2"));
+    log.insert(QStringLiteral("creator"), creator);
+    log.insert(QStringLiteral("entries"), entries);
+    QJsonObject har;
+    har.insert(QStringLiteral("log"), log);
+
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot write HTTP trace" << fileName << ":" << file.errorString());
+        return false;
+    }
+    file.write(QJsonDocument(har).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
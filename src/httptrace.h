@@ -0,0 +1,75 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef HTTPTRACE_H
+#define HTTPTRACE_H
+
+#include <QObject>
+#include <QDateTime>
+#include <QList>
+#include <QPair>
+#include <QUrl>
+#include <QVector>
+
+class QNetworkAccessManager;
+class QNetworkRequest;
+class QNetworkReply;
+
+// Keeps the last exchanges sent through a network access manager,
+// for offline analysis of slow syncs. Only the headers and sizes
+// are kept, never the calendar data, and credentials are redacted.
+// The trace can be saved in the HTTP Archive (HAR) format.
+class HttpTrace : public QObject
+{
+    Q_OBJECT
+public:
+    static HttpTrace* enable(QNetworkAccessManager *manager, int capacity);
+    static HttpTrace* instance(QNetworkAccessManager *manager);
+
+    void record(const QByteArray &method, const QNetworkRequest &request, qint64 requestSize,
+                const QNetworkReply &reply, qint64 responseSize, qint64 duration);
+    int count() const;
+    bool save(const QString &fileName) const;
+
+private:
+    HttpTrace(QNetworkAccessManager *manager, int capacity);
+
+    typedef QList<QPair<QByteArray, QByteArray> > Headers;
+    struct Entry {
+        QDateTime started;
+        qint64 duration;
+        QByteArray method;
+        QUrl url;
+        Headers requestHeaders;
+        qint64 requestSize;
+        int status;
+        QByteArray reason;
+        int error;
+        Headers responseHeaders;
+        qint64 responseSize;
+    };
+
+    int mCapacity;
+    int mNext;
+    QVector<Entry> mEntries;
+};
+
+#endif // HTTPTRACE_H
@@ -22,12 +22,13 @@
  */
 
 #include "incidencehandler.h"
+#include "tracer.h"
 
 #include <QDebug>
+#include <QSet>
 
 #include <LogMacros.h>
 
-#include <KCalendarCore/MemoryCalendar>
 #include <KCalendarCore/ICalFormat>
 
 #define PROP_DTEND_ADDED_USING_DTSTART "dtend-added-as-dtstart"
@@ -40,59 +41,105 @@ IncidenceHandler::~IncidenceHandler()
 {
 }
 
+namespace {
+    // Append the iCal component of an incidence to components, and the
+    // VTIMEZONE components it uses to timeZones, unless already written.
+    bool appendComponent(KCalendarCore::ICalFormat *icalFormat,
+                         const KCalendarCore::Incidence::Ptr &incidence,
+                         QByteArray *components, QByteArray *timeZones,
+                         QSet<QByteArray> *timeZoneIds)
+    {
+        static const QByteArray tzBegin = QByteArrayLiteral("BEGIN:VTIMEZONE");
+        static const QByteArray tzEnd = QByteArrayLiteral("END:VTIMEZONE");
+        static const QByteArray tzId = QByteArrayLiteral("\nTZID:");
+
+        const QByteArray raw = icalFormat->toRawString(incidence);
+        if (raw.isEmpty()) {
+            return false;
+        }
+
+        int pos = 0;
+        while (pos < raw.size()) {
+            const int begin = raw.indexOf(tzBegin, pos);
+            int end = begin < 0 ? -1 : raw.indexOf(tzEnd, begin);
+            if (end < 0) {
+                components->append(raw.constData() + pos, raw.size() - pos);
+                break;
+            }
+            components->append(raw.constData() + pos, begin - pos);
+            end += tzEnd.size();
+            while (end < raw.size() && (raw.at(end) == '\r' || raw.at(end) == '\n')) {
+                ++end;
+            }
+            const QByteArray block = QByteArray::fromRawData(raw.constData() + begin, end - begin);
+            QByteArray id;
+            const int idPos = block.indexOf(tzId);
+            if (idPos >= 0) {
+                const int idEnd = block.indexOf('\r', idPos + tzId.size());
+                id = block.mid(idPos + tzId.size(), idEnd < 0 ? -1 : idEnd - idPos - tzId.size());
+            }
+            if (!timeZoneIds->contains(id)) {
+                timeZoneIds->insert(id);
+                timeZones->append(block.constData(), block.size());
+            }
+            pos = end;
+        }
+
+        return true;
+    }
+}
+
 // A given incidence has been added or modified locally.
 // To upsync the change, we need to construct the .ics data to upload to server.
 // Since the incidence may be an occurrence or recurring series incidence,
 // we cannot simply convert the incidence to iCal data, but instead we have to
 // upsync an .ics containing the whole recurring series.
-QString IncidenceHandler::toIcs(const KCalendarCore::Incidence::Ptr incidence,
-                                const KCalendarCore::Incidence::List instances)
+// The components are written one by one in UTF-8, each VTIMEZONE only once,
+// without building an intermediate calendar.
+QByteArray IncidenceHandler::toIcs(const KCalendarCore::Incidence::Ptr incidence,
+                                   const KCalendarCore::Incidence::List instances)
 {
-    KCalendarCore::Incidence::Ptr exportableIncidence = IncidenceHandler::incidenceToExport(incidence, instances);
-
-    // create an in-memory calendar
-    // add to it the required incidences (ie, check if has recurrenceId -> load parent and all instances; etc)
-    // for each of those, we need to do the IncidenceToExport() modifications first
-    // then, export from that calendar to .ics file.
-    KCalendarCore::MemoryCalendar::Ptr memoryCalendar(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
-    // store the base recurring event into the in-memory calendar
-    if (!memoryCalendar->addIncidence(exportableIncidence)) {
-        LOG_WARNING("Unable to add base series event to in-memory calendar for incidence:"
+    // Run in worker threads, see NotebookSyncAgent::sendLocalChanges().
+    TraceSpan span("serialise", QStringLiteral("IncidenceHandler::toIcs"));
+    KCalendarCore::ICalFormat icalFormat;
+    QSet<QByteArray> timeZoneIds;
+    QByteArray timeZones;
+    QByteArray components;
+
+    if (!appendComponent(&icalFormat, IncidenceHandler::incidenceToExport(incidence, instances),
+                         &components, &timeZones, &timeZoneIds)) {
+        LOG_WARNING("Unable to export base series event for incidence:"
                     << incidence->uid() << ":" << incidence->recurrenceId().toString());
-        return QString();
+        return QByteArray();
     }
-    // now create the persistent occurrences in the in-memory calendar
+    // now add the persistent occurrences, they are already exceptions
+    // of the series, with a recurrence id.
     for (KCalendarCore::Incidence::Ptr instance : instances) {
-        // We cannot call dissociateSingleOccurrence() on the MemoryCalendar
-        // as that's an mKCal specific function.
-        // We cannot call dissociateOccurrence() because that function
-        // takes only a QDate instead of a KDateTime recurrenceId.
-        // Thus, we need to manually create an exception occurrence.
-        KCalendarCore::Incidence::Ptr exportableOccurrence(exportableIncidence->clone());
-        exportableOccurrence->setCreated(instance->created());
-        exportableOccurrence->setRevision(instance->revision());
-        exportableOccurrence->clearRecurrence();
-        exportableOccurrence->setRecurrenceId(instance->recurrenceId());
-        exportableOccurrence->setDtStart(instance->recurrenceId());
-
-        // add it, and then update it in-memory.
-        if (!memoryCalendar->addIncidence(exportableOccurrence)) {
-            LOG_WARNING("Unable to add this incidence to in-memory calendar for export:"
+        KCalendarCore::Incidence::Ptr exportableOccurrence = IncidenceHandler::incidenceToExport(instance);
+        if (!exportableOccurrence->hasRecurrenceId()) {
+            LOG_WARNING("Skipping instance without recurrence id in export:" << instance->uid());
+            continue;
+        }
+        if (!appendComponent(&icalFormat, exportableOccurrence,
+                             &components, &timeZones, &timeZoneIds)) {
+            LOG_WARNING("Unable to export this incidence:"
                         << instance->uid() << instance->recurrenceId().toString());
-            return QString();
-        } else {
-            KCalendarCore::Incidence::Ptr reloadedOccurrence = memoryCalendar->incidence(exportableIncidence->uid(), instance->recurrenceId());
-            if (!reloadedOccurrence) {
-                LOG_WARNING("Unable to find this incidence within in-memory calendar for export:"
-                            << exportableIncidence->uid() << instance->recurrenceId().toString());
-                return QString();
-            }
-            *reloadedOccurrence.staticCast<KCalendarCore::IncidenceBase>() = *IncidenceHandler::incidenceToExport(instance).staticCast<KCalendarCore::IncidenceBase>();
+            return QByteArray();
         }
     }
 
-    KCalendarCore::ICalFormat icalFormat;
-    return icalFormat.toString(memoryCalendar, QString(), false);
+    const QByteArray header = QByteArrayLiteral("BEGIN:VCALENDAR\r\nPRODID:")
+        + KCalendarCore::CalFormat::productId().toUtf8()
+        + QByteArrayLiteral("\r\nVERSION:2.0\r\n");
+    const QByteArray footer = QByteArrayLiteral("END:VCALENDAR\r\n");
+    QByteArray ics;
+    ics.reserve(header.size() + timeZones.size() + components.size() + footer.size());
+    ics.append(header);
+    ics.append(timeZones);
+    ics.append(components);
+    ics.append(footer);
+
+    return ics;
 }
 
 KCalendarCore::Incidence::Ptr IncidenceHandler::incidenceToExport(KCalendarCore::Incidence::Ptr sourceIncidence, const KCalendarCore::Incidence::List &instances)
@@ -142,12 +189,24 @@ KCalendarCore::Incidence::Ptr IncidenceHandler::incidenceToExport(KCalendarCore:
     }
 
     // remove EXDATE values from the recurring incidence which correspond to the persistent occurrences (instances)
-    if (incidence->recurs()) {
+    if (incidence->recurs() && !instances.isEmpty()) {
+        QSet<QDateTime> recurrenceIds;
+        recurrenceIds.reserve(instances.count());
         for (KCalendarCore::Incidence::Ptr instance : instances) {
-            KCalendarCore::DateTimeList exDateTimes = incidence->recurrence()->exDateTimes();
-            exDateTimes.removeAll(instance->recurrenceId());
-            incidence->recurrence()->setExDateTimes(exDateTimes);
-            LOG_DEBUG("Discarding exdate:" << instance->recurrenceId().toString());
+            recurrenceIds.insert(instance->recurrenceId());
+        }
+        const KCalendarCore::DateTimeList exDateTimes = incidence->recurrence()->exDateTimes();
+        KCalendarCore::DateTimeList keptExDateTimes;
+        keptExDateTimes.reserve(exDateTimes.count());
+        for (const QDateTime &exDateTime : exDateTimes) {
+            if (recurrenceIds.contains(exDateTime)) {
+                LOG_DEBUG("Discarding exdate:" << exDateTime.toString());
+            } else {
+                keptExDateTimes.append(exDateTime);
+            }
+        }
+        if (keptExDateTimes.count() != exDateTimes.count()) {
+            incidence->recurrence()->setExDateTimes(keptExDateTimes);
         }
     }
 
@@ -32,8 +32,8 @@
 class IncidenceHandler
 {
 public:
-    static QString toIcs(const KCalendarCore::Incidence::Ptr incidence,
-                         const KCalendarCore::Incidence::List instances = KCalendarCore::Incidence::List());
+    static QByteArray toIcs(const KCalendarCore::Incidence::Ptr incidence,
+                            const KCalendarCore::Incidence::List instances = KCalendarCore::Incidence::List());
 
 private:
     IncidenceHandler();
@@ -26,9 +26,15 @@
 #include "incidencehandler.h"
 #include "settings.h"
 #include "report.h"
+#include "propfind.h"
 #include "put.h"
 #include "delete.h"
 #include "reader.h"
+#include "receivespool.h"
+#include "upsyncjournal.h"
+#include "tombstoneindex.h"
+#include "syncmetrics.h"
+#include "tracer.h"
 
 #include <LogMacros.h>
 #include <SyncResults.h>
@@ -40,11 +46,43 @@
 #include <KCalendarCore/Attendee>
 
 #include <QDebug>
+#include <QMetaObject>
+#include <QElapsedTimer>
+#include <QtMath>
+#include <QtConcurrent/QtConcurrentRun>
+
+#include <algorithm>
 
 
 #define NOTEBOOK_FUNCTION_CALL_TRACE FUNCTION_CALL_TRACE(QLatin1String(Q_FUNC_INFO) + " " + (mNotebook ? mNotebook->account() : ""))
 
 namespace {
+    // Sync phases, as reported in the metrics.
+    const QString PHASE_REPORT = QStringLiteral("report");
+    const QString PHASE_ETAGS = QStringLiteral("etags");
+    const QString PHASE_DELTA = QStringLiteral("delta");
+    const QString PHASE_MULTIGET = QStringLiteral("multiget");
+    const QString PHASE_UPLOAD = QStringLiteral("upload");
+    const QString PHASE_APPLY = QStringLiteral("apply");
+
+    // Estimated transfer sizes in bytes, to compare the quick sync
+    // strategies. A round trip is given the cost of a transfer.
+    const qint64 REQUEST_COST = 4000;
+    const qint64 ETAG_ENTRY_SIZE = 250; // href and etag in a multistatus.
+    const qint64 HREF_SIZE = 120; // href listed in a multiget.
+    const qint64 DEFAULT_RESOURCE_SIZE = 2000;
+    const double STATS_SMOOTHING = 0.5; // weight of the last sync.
+
+    // A collection unchanged for that many syncs is listed less and less
+    // often, from every hour up to once a day.
+    const int COLD_IDLE_SYNCS = 3;
+    const qint64 MIN_POLL_INTERVAL = 3600; // seconds.
+    const qint64 MAX_POLL_INTERVAL = 86400;
+
+    // The first download of a calendar is written in slices,
+    // the coming days first.
+    const int IMMINENT_DAYS = 14;
+
     // mKCal deletes custom properties of deleted incidences.
     // This is problematic for sync, as we need some fields
     // (resource URI and ETAG) in order to sync properly.
@@ -238,10 +276,16 @@ NotebookSyncAgent::NotebookSyncAgent(mKCal::ExtendedCalendar::Ptr calendar,
     , mEncodedRemotePath(encodedRemotePath)
     , mSyncMode(NoSyncMode)
     , mRetriedReport(false)
+    , mFullFetch(false)
     , mNotebookNeedsDeletion(false)
     , mEnableUpsync(true)
     , mEnableDownsync(true)
     , mReadOnlyFlag(readOnlyFlag)
+    , mConflictResPolicy(Buteo::SyncProfile::CR_POLICY_PREFER_REMOTE_CHANGES)
+    , mReceivedDataSize(0)
+    , mCommittedCount(0)
+    , mDeferredCount(0)
+    , mMetrics(encodedRemotePath)
 {
     // the calendar path may be percent-encoded.  Return UTF-8 QString.
     mRemoteCalendarPath = QUrl::fromPercentEncoding(mEncodedRemotePath.toUtf8());
@@ -275,11 +319,29 @@ void NotebookSyncAgent::clearRequests()
         requests[i]->deleteLater();
     }
     mRequests.clear();
+    mRequestPhases.clear();
+
+    // Running serialisations cannot be stopped, their results are dropped.
+    for (QFutureWatcherBase *watcher : const_cast<const QSet<QFutureWatcherBase*>&>(mPayloadWatchers)) {
+        QObject::disconnect(watcher, 0, this, 0);
+        watcher->deleteLater();
+    }
+    mPayloadWatchers.clear();
 }
 
 static const QByteArray PATH_PROPERTY = QByteArrayLiteral("remoteCalendarPath");
 static const QByteArray EMAIL_PROPERTY = QByteArrayLiteral("userPrincipalEmail");
 static const QByteArray SERVER_COLOR_PROPERTY = QByteArrayLiteral("serverColor");
+// Statistics of the remote collection, to choose how to sync it.
+static const QByteArray COLLECTION_SIZE_PROPERTY = QByteArrayLiteral("collectionSize");
+static const QByteArray CHANGE_RATIO_PROPERTY = QByteArrayLiteral("changeRatio");
+static const QByteArray RESOURCE_SIZE_PROPERTY = QByteArrayLiteral("resourceSize");
+static const QByteArray IDLE_SYNCS_PROPERTY = QByteArrayLiteral("idleSyncs");
+static const QByteArray LAST_CHECK_PROPERTY = QByteArrayLiteral("lastRemoteCheck");
+static const QByteArray LAST_CHANGE_PROPERTY = QByteArrayLiteral("lastRemoteChange");
+static const QByteArray COLLECTION_TAG_PROPERTY = QByteArrayLiteral("collectionTag");
+// Set while the first download of a calendar is incomplete.
+static const QByteArray PARTIAL_SYNC_PROPERTY = QByteArrayLiteral("partialSync");
 
 bool NotebookSyncAgent::setNotebookFromInfo(const QString &notebookName,
                                             const QString &color,
@@ -328,9 +390,15 @@ bool NotebookSyncAgent::setNotebookFromInfo(const QString &notebookName,
     return true;
 }
 
+void NotebookSyncAgent::setConflictResolutionPolicy(Buteo::SyncProfile::ConflictResolutionPolicy policy)
+{
+    mConflictResPolicy = policy;
+}
+
 void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
                                   const QDateTime &toDateTime,
-                                  bool withUpsync, bool withDownsync)
+                                  bool withUpsync, bool withDownsync,
+                                  bool localChangesOnly)
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
@@ -343,26 +411,79 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
     // that may be inserted server side between now and the termination
     // of the process.
     mNotebookSyncedDateTime = QDateTime::currentDateTimeUtc();
+    if (Tracer::isEnabled()) {
+        // Until the notebook waits for the others to be applied.
+        const qint64 traceStart = Tracer::now();
+        connect(this, &NotebookSyncAgent::finished, this, [this, traceStart] {
+            Tracer::addSpan("sync", QStringLiteral("notebook sync"), traceStart, -1, traceArgs());
+        });
+    }
     mFromDateTime = fromDateTime;
     mToDateTime = toDateTime;
     mEnableUpsync = withUpsync;
     mEnableDownsync = withDownsync;
+    mJournal.reset(new UpsyncJournal(mSettings->cacheDirectory()
+                                     + QStringLiteral("/journal-") + mNotebook->uid()));
+    mJournal->load();
+    mTombstones.reset(new TombstoneIndex(mSettings->cacheDirectory()
+                                         + QStringLiteral("/tombstones-") + mNotebook->uid()));
+    mTombstones->load();
     if (mNotebook->syncDate().isNull()) {
 /*
     Slow sync mode:
 
-    1) Get all calendars on the server using Report::getAllEvents()
-    2) Save all received calendar data to disk.
+    1) Get all calendars on the server using Report::getAllEvents(),
+       slice by slice: the next two weeks, the rest of the future window,
+       then the past window
+    2) Save the received calendar data of each slice to disk, but the last
+       one, marking the notebook as partially synced
+    3) Save the last slice to disk.
 
-    Step 2) is triggered by CalDavClient once *all* notebook syncs have finished.
+    Step 3) is triggered by CalDavClient once *all* notebook syncs have finished.
+    An interrupted slow sync is completed by the next quick sync.
  */
         LOG_DEBUG("Start slow sync for notebook:" << mNotebook->name() << "for account" << mNotebook->account()
                   << "between" << fromDateTime << "to" << toDateTime);
         mSyncMode = SlowSync;
 
+        // Nothing was uploaded from this notebook yet,
+        // any journal entry is a left over.
+        for (const UpsyncJournal::Entry &entry : mJournal->entries()) {
+            mSettledHrefs.insert(entry.href);
+        }
+        mTombstones->clear();
+
         // Even if down sync is disabled in profile, we down sync the
         // remote calendar the first time, by design.
-        sendReportRequest();
+        mSlices = slowSyncSlices(fromDateTime, toDateTime, mNotebookSyncedDateTime);
+        sendSliceRequest();
+    } else if (mJournal->isEmpty() && mTombstones->exists()
+               && mNotebook->customProperty(PARTIAL_SYNC_PROPERTY).isEmpty()
+               && ((localChangesOnly && mEnableUpsync) || remoteIsCold())) {
+/*
+    Upsync only mode:
+
+    1) Get the local changes since the last sync from the local database only
+    2) Send the local changes to the server using Put and Delete requests,
+       with preconditions on the etags seen during the last sync
+    3) Download the resources refused by a precondition, since they have been
+       modified remotely, as a quick sync would have done
+    4) Write the downloaded calendar data and the new etags to disk.
+
+    Interrupted operations from the upsync journal require the remote
+    etags to be resolved, and a missing tombstone index requires to list
+    all past local deletions. A quick sync is done instead in these cases.
+
+    This mode is used for syncs triggered by a local change; when no
+    local change is found, a quick sync is done instead. It is also used
+    for remote collections that did not change for a while, until they
+    are due for a new listing.
+
+    Step 4) is triggered by CalDavClient once *all* notebook syncs have finished.
+ */
+        LOG_DEBUG("Start upsync of local changes for notebook:" << mNotebook->uid()
+                  << ", changes since" << mNotebook->syncDate());
+        sendLocalChangesOnly(!remoteIsCold());
     } else {
 /*
     Quick sync mode:
@@ -375,22 +496,111 @@ void NotebookSyncAgent::startSync(const QDateTime &fromDateTime,
     5) Write the remote calendar changes to disk.
 
     Step 5) is triggered by CalDavClient once *all* notebook syncs have finished.
+
+    Step 1) is preceded by reading the sync-token or ctag of the
+    collection, recorded once the listing is written. In low data mode,
+    a collection still at the recorded tag is only sent the local
+    changes, as in upsync only mode, and large remote changes are left
+    for the next unmetered sync.
  */
         LOG_DEBUG("Start quick sync for notebook:" << mNotebook->uid()
                   << "between" << fromDateTime << "to" << toDateTime
                   << ", sync changes since" << mNotebook->syncDate());
         mSyncMode = QuickSync;
 
+        if (mJournal->isEmpty() && mTombstones->exists()
+            && mNotebook->customProperty(PARTIAL_SYNC_PROPERTY).isEmpty()) {
+            checkCollectionTag();
+        } else {
+            fetchRemoteChanges();
+        }
+    }
+}
+
+void NotebookSyncAgent::sendLocalChangesOnly(bool listIfUnchanged)
+{
+    mSyncMode = UpsyncOnly;
+
+    if (!mEnableUpsync) {
+        LOG_DEBUG("Nothing to sync for notebook:" << mNotebook->uid());
+    } else {
+        mMetrics.start(PHASE_DELTA);
+        const bool delta = calculateLocalDelta(&mLocalAdditions,
+                                               &mLocalModifications,
+                                               &mLocalDeletions);
+        mMetrics.stop(PHASE_DELTA);
+        if (delta && listIfUnchanged && mLocalAdditions.isEmpty()
+            && mLocalModifications.isEmpty() && mLocalDeletions.isEmpty()) {
+            LOG_DEBUG("No local change for notebook:" << mNotebook->uid()
+                      << ", doing a quick sync instead");
+            mSyncMode = QuickSync;
+            fetchRemoteChanges();
+            return;
+        } else if (delta) {
+            sendLocalChanges();
+        } else {
+            LOG_WARNING("unable to calculate the local changes for:" << mRemoteCalendarPath);
+            mFailingUploads.insert(mRemoteCalendarPath);
+        }
+    }
+    if (isFinished()) {
+        // Nothing to wait for, but other notebooks may
+        // not be started yet.
+        QMetaObject::invokeMethod(this, "finished", Qt::QueuedConnection);
+    }
+}
+
+// The collection tag is read like the one of the calendar home,
+// it changes with any of the calendar resources. It is read in any
+// mode, so that a sync switching to low data mode can rely on it.
+void NotebookSyncAgent::checkCollectionTag()
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    PropFind *request = new PropFind(mNetworkManager, mSettings);
+    trackRequest(request, PHASE_ETAGS);
+    connect(request, &PropFind::finished, this, &NotebookSyncAgent::processCollectionTag);
+    request->listHomeTag(mRemoteCalendarPath);
+}
+
+void NotebookSyncAgent::processCollectionTag(const QString &uri)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    PropFind *request = qobject_cast<PropFind*>(sender());
+    if (!request) {
+        mFailingUpdates.insert(uri);
+        clearRequests();
+        emit finished();
+        return;
+    }
+
+    if (request->errorCode() == Buteo::SyncResults::NO_ERROR) {
+        mCollectionTag = request->homeTag();
+    } else {
+        LOG_WARNING("Cannot read the tag of" << uri << ", listing the collection instead");
+    }
+    const QString knownTag = mNotebook->customProperty(COLLECTION_TAG_PROPERTY);
+    if (mSettings->lowDataMode() && !mCollectionTag.isEmpty() && mCollectionTag == knownTag) {
+        LOG_INFO("Collection" << mRemoteCalendarPath << "unchanged since tag" << knownTag
+                 << ", sending the local changes only");
+        // Still the tag of the last listing.
+        mCollectionTag.clear();
+        sendLocalChangesOnly();
+    } else {
         fetchRemoteChanges();
     }
+
+    requestFinished(request);
 }
 
 void NotebookSyncAgent::sendReportRequest(const QStringList &remoteUris)
 {
     // must be m_syncMode = SlowSync.
     Report *report = new Report(mNetworkManager, mSettings);
-    mRequests.insert(report);
+    trackRequest(report, remoteUris.isEmpty() ? PHASE_REPORT : PHASE_MULTIGET);
     connect(report, &Report::finished, this, &NotebookSyncAgent::reportRequestFinished);
+    report->setSpool(receiveSpool());
     if (remoteUris.isEmpty()) {
         report->getAllEvents(mRemoteCalendarPath, mFromDateTime, mToDateTime);
     } else {
@@ -398,15 +608,228 @@ void NotebookSyncAgent::sendReportRequest(const QStringList &remoteUris)
     }
 }
 
+void NotebookSyncAgent::sendSliceRequest()
+{
+    if (mSlices.isEmpty()) {
+        sendReportRequest();
+        return;
+    }
+    const QPair<QDateTime, QDateTime> slice = mSlices.takeFirst();
+    LOG_DEBUG("Downloading" << mRemoteCalendarPath << "between" << slice.first << "and" << slice.second);
+    Report *report = new Report(mNetworkManager, mSettings);
+    trackRequest(report, PHASE_REPORT);
+    connect(report, &Report::finished, this, &NotebookSyncAgent::reportRequestFinished);
+    report->setSpool(receiveSpool());
+    report->getAllEvents(mRemoteCalendarPath, slice.first, slice.second);
+}
+
+// Splits the slow sync window, to show the coming events first.
+QList<QPair<QDateTime, QDateTime> > NotebookSyncAgent::slowSyncSlices(const QDateTime &fromDateTime,
+                                                                      const QDateTime &toDateTime,
+                                                                      const QDateTime &now)
+{
+    QList<QPair<QDateTime, QDateTime> > slices;
+    const QDateTime today(now.toUTC().date(), QTime(0, 0), Qt::UTC);
+    const QDateTime imminent = today.addDays(IMMINENT_DAYS);
+    if (!fromDateTime.isValid() || !toDateTime.isValid()
+        || today <= fromDateTime || imminent >= toDateTime) {
+        slices << qMakePair(fromDateTime, toDateTime);
+        return slices;
+    }
+    slices << qMakePair(today, imminent);
+    slices << qMakePair(imminent, toDateTime);
+    slices << qMakePair(fromDateTime, today);
+    return slices;
+}
+
+// Writes what was downloaded so far, so the coming events are
+// shown while the rest of the calendar is downloaded.
+bool NotebookSyncAgent::commitSlice()
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    mMetrics.start(PHASE_APPLY);
+    mKCal::Notebook::Ptr notebook(mStorage->notebook(mNotebook->uid()));
+    if (!notebook) {
+        if (!mStorage->addNotebook(mNotebook)) {
+            LOG_WARNING("Unable to create notebook" << mNotebook->name() << "for" << mRemoteCalendarPath);
+            mMetrics.stop(PHASE_APPLY);
+            return false;
+        }
+        notebook = mNotebook;
+    }
+    notebook->setIsReadOnly(false);
+    const int committedCount = mCommittedCount;
+    bool success = updateIncidences(mReceivedCalendarResources);
+    if (!updateSpooledIncidences()) {
+        success = false;
+    }
+    for (const Reader::CalendarResource &resource : const_cast<const QList<Reader::CalendarResource>&>(mReceivedCalendarResources)) {
+        if (!mFailingUpdates.contains(resource.href)) {
+            mCommittedCount += resource.incidences.count();
+        }
+        mCommittedETags.insert(resource.href, resource.etag);
+    }
+    if (mReceiveSpool) {
+        const QList<ReceiveSpool::Entry> &entries = mReceiveSpool->entries();
+        for (int index : mReceiveSpool->latestEntries()) {
+            const ReceiveSpool::Entry &entry = entries[index];
+            if (!mFailingUpdates.contains(entry.href) && !isCommitted(entry.href, entry.etag)) {
+                mCommittedCount += entry.incidenceCount;
+            }
+            mCommittedETags.insert(entry.href, entry.etag);
+        }
+        mReceiveSpool->clear();
+        mReceiveSpool.reset();
+    }
+    mMetrics.addWrittenIncidences(mCommittedCount - committedCount);
+    mReceivedCalendarResources.clear();
+    mReceivedDataSize = 0;
+
+    // The next quick sync completes the download, if this one is interrupted.
+    notebook->setIsReadOnly(mReadOnlyFlag);
+    notebook->setSyncDate(mNotebookSyncedDateTime);
+    notebook->setCustomProperty(PATH_PROPERTY, mRemoteCalendarPath);
+    notebook->setCustomProperty(PARTIAL_SYNC_PROPERTY, QStringLiteral("1"));
+    if (!mStorage->updateNotebook(notebook)) {
+        LOG_WARNING("Cannot update notebook" << notebook->name() << "in storage.");
+        success = false;
+    }
+    const qint64 traceStart = Tracer::now();
+    if (!mStorage->save()) {
+        success = false;
+    }
+    Tracer::addSpan("storage", QStringLiteral("save slice"), traceStart, -1, traceArgs());
+    mMetrics.stop(PHASE_APPLY);
+
+    return success;
+}
+
+// Written by a previous slice of the slow sync.
+bool NotebookSyncAgent::isCommitted(const QString &href, const QString &etag) const
+{
+    QHash<QString, QString>::ConstIterator it = mCommittedETags.constFind(href);
+    return it != mCommittedETags.constEnd() && *it == etag;
+}
+
 void NotebookSyncAgent::fetchRemoteChanges()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
     // must be m_syncMode = QuickSync.
+    // When most of a collection is expected to have changed, listing
+    // the calendar data with the etags saves the multiget round trip.
+    bool sizeOk = false;
+    bool ratioOk = false;
+    const int collectionSize = mNotebook->customProperty(COLLECTION_SIZE_PROPERTY).toInt(&sizeOk);
+    const double changeRatio = mNotebook->customProperty(CHANGE_RATIO_PROPERTY).toDouble(&ratioOk);
+    qint64 resourceSize = mNotebook->customProperty(RESOURCE_SIZE_PROPERTY).toLongLong();
+    if (resourceSize <= 0) {
+        resourceSize = DEFAULT_RESOURCE_SIZE;
+    }
+    qint64 fetchCost = 0;
+    qint64 etagsCost = 0;
+    const qint64 bufferSize = mSettings->receiveBufferSize();
+    mFullFetch = mEnableDownsync && !mSettings->lowDataMode() && sizeOk && ratioOk
+        && preferFullFetch(collectionSize, changeRatio, resourceSize, &fetchCost, &etagsCost)
+        && (bufferSize <= 0 || collectionSize * resourceSize <= bufferSize);
+    if (sizeOk && ratioOk) {
+        LOG_INFO("Sync strategy for" << mRemoteCalendarPath << ":"
+                 << (mFullFetch ? "full fetch" : "etags and multiget")
+                 << "- collection size" << collectionSize << "change ratio" << changeRatio
+                 << "resource size" << resourceSize << "- estimated cost full fetch"
+                 << fetchCost << "bytes, etags and multiget" << etagsCost << "bytes");
+    } else {
+        LOG_INFO("Sync strategy for" << mRemoteCalendarPath << ": etags and multiget, no statistics yet");
+    }
+
     Report *report = new Report(mNetworkManager, mSettings);
-    mRequests.insert(report);
+    trackRequest(report, PHASE_ETAGS);
     connect(report, &Report::finished, this, &NotebookSyncAgent::processETags);
-    report->getAllETags(mRemoteCalendarPath, mFromDateTime, mToDateTime);
+    if (mFullFetch) {
+        // Not spooled, the collection fits in the receive buffer
+        // and only its changed resources are kept.
+        report->getAllEvents(mRemoteCalendarPath, mFromDateTime, mToDateTime);
+    } else {
+        report->getAllETags(mRemoteCalendarPath, mFromDateTime, mToDateTime);
+    }
+}
+
+// Compares the expected transfers of an etag listing followed by a
+// multiget of the changed resources, with a listing of all the data.
+bool NotebookSyncAgent::preferFullFetch(int collectionSize, double changeRatio, qint64 resourceSize,
+                                        qint64 *fetchCost, qint64 *etagsCost)
+{
+    const qint64 changes = qint64(qCeil(collectionSize * qBound(0., changeRatio, 1.)));
+    *fetchCost = REQUEST_COST + collectionSize * (resourceSize + ETAG_ENTRY_SIZE);
+    *etagsCost = REQUEST_COST + collectionSize * ETAG_ENTRY_SIZE;
+    if (changes > 0) {
+        *etagsCost += REQUEST_COST + changes * (resourceSize + ETAG_ENTRY_SIZE + HREF_SIZE);
+    }
+    return *fetchCost < *etagsCost;
+}
+
+void NotebookSyncAgent::updateCollectionStats(int collectionSize, int changes)
+{
+    const double observed = collectionSize > 0 ? qMin(1., double(changes) / collectionSize) : 0.;
+    bool ok = false;
+    double changeRatio = mNotebook->customProperty(CHANGE_RATIO_PROPERTY).toDouble(&ok);
+    changeRatio = ok ? changeRatio + STATS_SMOOTHING * (observed - changeRatio) : observed;
+    mNotebook->setCustomProperty(COLLECTION_SIZE_PROPERTY, QString::number(collectionSize));
+    mNotebook->setCustomProperty(CHANGE_RATIO_PROPERTY, QString::number(changeRatio));
+}
+
+// Whether the remote listing can be skipped this time.
+bool NotebookSyncAgent::isCold(int idleSyncs, const QDateTime &lastCheck, const QDateTime &now)
+{
+    if (idleSyncs < COLD_IDLE_SYNCS || !lastCheck.isValid()) {
+        return false;
+    }
+    const qint64 interval = qMin(MAX_POLL_INTERVAL,
+                                 MIN_POLL_INTERVAL << qMin(idleSyncs - COLD_IDLE_SYNCS, 8));
+    const qint64 elapsed = lastCheck.secsTo(now);
+    return elapsed >= 0 && elapsed < interval;
+}
+
+bool NotebookSyncAgent::remoteIsCold() const
+{
+    bool ok = false;
+    const int idleSyncs = mNotebook->customProperty(IDLE_SYNCS_PROPERTY).toInt(&ok);
+    const QDateTime lastCheck = QDateTime::fromString(mNotebook->customProperty(LAST_CHECK_PROPERTY), Qt::ISODate);
+    if (!ok || !isCold(idleSyncs, lastCheck, QDateTime::currentDateTimeUtc())) {
+        return false;
+    }
+    LOG_INFO("Skipping remote listing of" << mRemoteCalendarPath << ": unchanged for"
+             << idleSyncs << "syncs, last change" << mNotebook->customProperty(LAST_CHANGE_PROPERTY)
+             << ", last checked" << lastCheck.toString(Qt::ISODate));
+    return true;
+}
+
+void NotebookSyncAgent::updatePollingStats(bool changed)
+{
+    const QString now = QDateTime::currentDateTimeUtc().toString(Qt::ISODate);
+    const int idleSyncs = changed ? 0 : mNotebook->customProperty(IDLE_SYNCS_PROPERTY).toInt() + 1;
+    mNotebook->setCustomProperty(IDLE_SYNCS_PROPERTY, QString::number(idleSyncs));
+    mNotebook->setCustomProperty(LAST_CHECK_PROPERTY, now);
+    if (changed) {
+        mNotebook->setCustomProperty(LAST_CHANGE_PROPERTY, now);
+    }
+}
+
+void NotebookSyncAgent::updateResourceSize(const QList<Reader::CalendarResource> &resources)
+{
+    if (resources.isEmpty()) {
+        return;
+    }
+    qint64 total = 0;
+    for (const Reader::CalendarResource &resource : resources) {
+        total += resource.iCalData.size();
+    }
+    const qint64 observed = total / resources.count();
+    qint64 resourceSize = mNotebook->customProperty(RESOURCE_SIZE_PROPERTY).toLongLong();
+    resourceSize = resourceSize > 0
+        ? resourceSize + qint64(STATS_SMOOTHING * (observed - resourceSize)) : observed;
+    mNotebook->setCustomProperty(RESOURCE_SIZE_PROPERTY, QString::number(resourceSize));
 }
 
 void NotebookSyncAgent::reportRequestFinished(const QString &uri)
@@ -427,15 +850,38 @@ void NotebookSyncAgent::reportRequestFinished(const QString &uri)
         // Instead, we just emit finished (for this notebook)
         // Once ALL notebooks are finished, then we apply the remote changes.
         // This prevents the worst partial-sync issues.
-        mReceivedCalendarResources += report->receivedCalendarResources();
+        mMetrics.addParsedResources(report->receivedCalendarResources().length()
+                                    + report->spooledResources());
+        updateResourceSize(report->receivedCalendarResources());
+        // Series overlapping several slices are received more than once.
+        QList<Reader::CalendarResource> resources;
+        for (const Reader::CalendarResource &resource : report->receivedCalendarResources()) {
+            if (!isCommitted(resource.href, resource.etag)) {
+                resources.append(resource);
+            }
+        }
+        storeReceivedResources(resources);
         LOG_DEBUG("Report request finished: received:"
                   << report->receivedCalendarResources().length() << "iCal blobs");
+        if (mSyncMode == SlowSync && !mSlices.isEmpty()) {
+            if (!commitSlice()) {
+                LOG_WARNING("Cannot write the downloaded slice of" << mRemoteCalendarPath);
+            }
+            sendSliceRequest();
+        } else if (mSyncMode == SlowSync) {
+            updateCollectionStats(mCommittedETags.count() + mReceivedCalendarResources.count()
+                                  + (mReceiveSpool ? mReceiveSpool->latestEntries().count() : 0), 0);
+            updatePollingStats(true);
+        }
     } else if (mSyncMode == SlowSync
                && report->networkError() == QNetworkReply::AuthenticationRequiredError
                && !mRetriedReport) {
         // Yahoo sometimes fails the initial request with an authentication error. Let's try once more
         LOG_WARNING("Retrying REPORT after request failed with QNetworkReply::AuthenticationRequiredError");
         mRetriedReport = true;
+        // Download the whole window at once, the slices
+        // already written are skipped when received again.
+        mSlices.clear();
         sendReportRequest();
     } else if (mSyncMode == SlowSync
                && report->networkError() == QNetworkReply::ContentNotFoundError) {
@@ -444,10 +890,14 @@ void NotebookSyncAgent::reportRequestFinished(const QString &uri)
         // so we can have local calendar metadata for remotely removed calendars.
         // In this case, we just skip sync of this calendar, as it was deleted.
         mNotebookNeedsDeletion = true;
+        mSlices.clear();
         LOG_DEBUG("calendar" << uri << "was deleted remotely, skipping sync locally.");
     } else {
+        LOG_WARNING("REPORT request failed for" << uri << ":" << report->errorString());
         mFailingUpdates += QSet<QString>::fromList(report->fetchedUris());
         mFailingUpdates.insert(uri);
+        // The slices not downloaded yet are left to the next sync.
+        mSlices.clear();
     }
 
     requestFinished(report);
@@ -483,12 +933,15 @@ void NotebookSyncAgent::processETags(const QString &uri)
         }
 
         // calculate the local and remote delta.
-        if (!calculateDelta(remoteHrefUriToEtags,
-                            &mLocalAdditions,
-                            &mLocalModifications,
-                            &mLocalDeletions,
-                            &mRemoteChanges,
-                            &mRemoteDeletions)) {
+        mMetrics.start(PHASE_DELTA);
+        const bool delta = calculateDelta(remoteHrefUriToEtags,
+                                          &mLocalAdditions,
+                                          &mLocalModifications,
+                                          &mLocalDeletions,
+                                          &mRemoteChanges,
+                                          &mRemoteDeletions);
+        mMetrics.stop(PHASE_DELTA);
+        if (!delta) {
             LOG_WARNING("unable to calculate the sync delta for:" << mRemoteCalendarPath);
             mFailingUpdates.insert(uri);
             clearRequests();
@@ -496,7 +949,37 @@ void NotebookSyncAgent::processETags(const QString &uri)
             return;
         }
 
-        if (mEnableDownsync && !mRemoteChanges.isEmpty()) {
+        updateCollectionStats(report->receivedCalendarResources().length(),
+                              mRemoteChanges.count() + mRemoteDeletions.count());
+        // Local changes are uploaded whatever the remote activity.
+        updatePollingStats(!mRemoteChanges.isEmpty() || !mRemoteDeletions.isEmpty());
+        if (mSettings->lowDataMode() && mSettings->lowDataMaxResourceSize() > 0) {
+            // Their local copy keeps its etag, so they are
+            // listed as changed again by the next sync.
+            const QSet<QString> deferred = deferredResources(report->receivedCalendarResources(),
+                                                             mRemoteChanges,
+                                                             mSettings->lowDataMaxResourceSize());
+            if (!deferred.isEmpty()) {
+                LOG_INFO("Deferring" << deferred.count() << "large resources of"
+                         << mRemoteCalendarPath << "to the next unmetered sync");
+                mRemoteChanges.subtract(deferred);
+                mDeferredCount += deferred.count();
+                mMetrics.addDeferredResources(deferred.count());
+            }
+        }
+        if (mFullFetch) {
+            // The new details came with the etags.
+            QList<Reader::CalendarResource> changed;
+            for (const Reader::CalendarResource &resource :
+                       report->receivedCalendarResources()) {
+                if (mRemoteChanges.contains(resource.href)) {
+                    changed.append(resource);
+                }
+            }
+            mMetrics.addParsedResources(changed.count());
+            updateResourceSize(report->receivedCalendarResources());
+            storeReceivedResources(changed);
+        } else if (mEnableDownsync && !mRemoteChanges.isEmpty()) {
             // some incidences have changed on the server, so fetch the new details
             sendReportRequest(mRemoteChanges.toList());
         }
@@ -520,6 +1003,49 @@ void NotebookSyncAgent::processETags(const QString &uri)
     requestFinished(report);
 }
 
+// Compare the exported local changes with the remote incidences,
+// ignoring the creation and modification stamps.
+bool NotebookSyncAgent::isSameContent(const QByteArray &icsData,
+                                      const KCalendarCore::Incidence::List &remoteIncidences)
+{
+    const KCalendarCore::Incidence::List localIncidences = Reader::readICalData(QString::fromUtf8(icsData));
+    if (localIncidences.isEmpty() || localIncidences.count() != remoteIncidences.count()) {
+        return false;
+    }
+    for (const KCalendarCore::Incidence::Ptr &local : localIncidences) {
+        bool found = false;
+        for (const KCalendarCore::Incidence::Ptr &remote : remoteIncidences) {
+            if (remote->uid() == local->uid()
+                && remote->recurrenceId() == local->recurrenceId()) {
+                local->setCreated(remote->created());
+                local->setRevision(remote->revision());
+                local->setLastModified(remote->lastModified());
+                found = (*local == *remote);
+                break;
+            }
+        }
+        if (!found) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Changed resources above maxSize, according to the size
+// announced in the listing.
+QSet<QString> NotebookSyncAgent::deferredResources(const QList<Reader::CalendarResource> &resources,
+                                                   const QSet<QString> &remoteChanges,
+                                                   qint64 maxSize)
+{
+    QSet<QString> deferred;
+    for (const Reader::CalendarResource &resource : resources) {
+        if (resource.contentLength > maxSize && remoteChanges.contains(resource.href)) {
+            deferred.insert(resource.href);
+        }
+    }
+    return deferred;
+}
+
 void NotebookSyncAgent::sendLocalChanges()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
@@ -547,12 +1073,20 @@ void NotebookSyncAgent::sendLocalChanges()
     // Hence, we first need to find out if any deletion is a lone-persistent-exception deletion.
     QMultiHash<QString, QDateTime> uidToRecurrenceIdDeletions;
     QHash<QString, QString> uidToUri;  // we cannot look up custom properties of deleted incidences, so cache them here.
+    QHash<QString, QString> uidToETag;
     for (KCalendarCore::Incidence::Ptr localDeletion : const_cast<const KCalendarCore::Incidence::List&>(mLocalDeletions)) {
         uidToRecurrenceIdDeletions.insert(localDeletion->uid(), localDeletion->recurrenceId());
         uidToUri.insert(localDeletion->uid(), incidenceHrefUri(localDeletion));
+        uidToETag.insert(localDeletion->uid(), incidenceETag(localDeletion));
     }
 
     // now send DELETEs as required, and PUTs as required.
+    // The intents of this pass are journaled together, before any
+    // request is sent.
+    if (mJournal) {
+        mJournal->startBatch();
+    }
+    QStringList deletedUids;
     const QStringList keys = uidToRecurrenceIdDeletions.uniqueKeys();
     for (const QString &uid : keys) {
         QList<QDateTime> recurrenceIds = uidToRecurrenceIdDeletions.values(uid);
@@ -569,12 +1103,8 @@ void NotebookSyncAgent::sendLocalChanges()
         }
 
         // the whole series is being deleted; can DELETE.
-        QString remoteUri = uidToUri.value(uid);
-        LOG_DEBUG("deleting whole series:" << remoteUri << "with uid:" << uid);
-        Delete *del = new Delete(mNetworkManager, mSettings);
-        mRequests.insert(del);
-        connect(del, &Delete::finished, this, &NotebookSyncAgent::nonReportRequestFinished);
-        del->deleteEvent(remoteUri);
+        journalOperation(UpsyncJournal::Removal, uidToUri.value(uid), uid, uidToETag.value(uid));
+        deletedUids.append(uid);
     }
     // Incidence will be actually purged only if all operations succeed.
     mPurgeList += mLocalDeletions;
@@ -588,13 +1118,19 @@ void NotebookSyncAgent::sendLocalChanges()
             LOG_DEBUG("Already handled upload" << i << "via series update");
             continue; // already handled this one, as a result of a previous update of another occurrence in the series.
         }
-        QString icsData;
+        // The payload is generated in a worker thread from copies of
+        // the incidences, since they may be updated here meanwhile.
+        KCalendarCore::Incidence::Ptr exported;
+        KCalendarCore::Incidence::List exportedInstances;
         if (toUpload[i]->recurs() || toUpload[i]->hasRecurrenceId()) {
             if (mStorage->loadSeries(toUpload[i]->uid())) {
                 KCalendarCore::Incidence::Ptr recurringIncidence(toUpload[i]->recurs() ? toUpload[i] : mCalendar->incidence(toUpload[i]->uid()));
                 if (recurringIncidence) {
-                    icsData = IncidenceHandler::toIcs(recurringIncidence,
-                                                      mCalendar->instances(recurringIncidence));
+                    exported = KCalendarCore::Incidence::Ptr(recurringIncidence->clone());
+                    const KCalendarCore::Incidence::List instances = mCalendar->instances(recurringIncidence);
+                    for (const KCalendarCore::Incidence::Ptr &instance : instances) {
+                        exportedInstances.append(KCalendarCore::Incidence::Ptr(instance->clone()));
+                    }
                 } else {
                     LOG_WARNING("Cannot find parent of " << toUpload[i]->uid() << "for upload of series.");
                 }
@@ -602,20 +1138,212 @@ void NotebookSyncAgent::sendLocalChanges()
                 LOG_WARNING("Cannot load series " << toUpload[i]->uid());
             }
         } else {
-            icsData = IncidenceHandler::toIcs(toUpload[i]);
+            exported = KCalendarCore::Incidence::Ptr(toUpload[i]->clone());
         }
-        if (icsData.isEmpty()) {
+        if (!exported) {
             LOG_DEBUG("Skipping upload of broken incidence:" << i << ":" << toUpload[i]->uid());
             mFailingUploads.insert(href);
         } else {
-            LOG_DEBUG("Uploading incidence" << i << "via PUT for uid:" << toUpload[i]->uid());
-            Put *put = new Put(mNetworkManager, mSettings);
-            mRequests.insert(put);
-            connect(put, &Put::finished, this, &NotebookSyncAgent::nonReportRequestFinished);
-            put->sendIcalData(href, icsData, incidenceETag(toUpload[i]));
-            mSentUids.insert(href, toUpload[i]->uid());
+            LOG_DEBUG("Serialising incidence" << i << "for PUT of uid:" << toUpload[i]->uid());
+            const QString uid = toUpload[i]->uid();
+            const QString etag = incidenceETag(toUpload[i]);
+            journalOperation(UpsyncJournal::Upload, href, uid, etag);
+            QFutureWatcher<QByteArray> *watcher = new QFutureWatcher<QByteArray>(this);
+            mPayloadWatchers.insert(watcher);
+            connect(watcher, &QFutureWatcher<QByteArray>::finished, this,
+                    [this, watcher, href, uid, etag] () {
+                        payloadReady(watcher, href, uid, etag);
+                    });
+            watcher->setFuture(QtConcurrent::run(&IncidenceHandler::toIcs, exported, exportedInstances));
+            mSentUids.insert(href, uid);
+        }
+    }
+
+    if (mJournal) {
+        mJournal->flush();
+    }
+    for (const QString &uid : const_cast<const QStringList&>(deletedUids)) {
+        const QString remoteUri = uidToUri.value(uid);
+        LOG_DEBUG("deleting whole series:" << remoteUri << "with uid:" << uid);
+        sendDelete(remoteUri, uid, uidToETag.value(uid));
+    }
+}
+
+void NotebookSyncAgent::payloadReady(QFutureWatcher<QByteArray> *watcher,
+                                     const QString &href, const QString &uid, const QString &etag)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    mPayloadWatchers.remove(watcher);
+    watcher->deleteLater();
+
+    const QByteArray icsData = watcher->result();
+    if (icsData.isEmpty()) {
+        LOG_DEBUG("Skipping upload of broken incidence:" << uid);
+        mFailingUploads.insert(href);
+        mSentUids.remove(href);
+        // Never sent, the journaled intent can be dropped.
+        mSettledHrefs.insert(href);
+        if (!hasPendingUploads()) {
+            finalizeSendingLocalChanges();
+            if (mRequests.isEmpty()) {
+                emit finished();
+            }
+        }
+        return;
+    }
+
+    LOG_DEBUG("Uploading incidence via PUT for uid:" << uid);
+    sendPut(href, uid, icsData, etag);
+}
+
+void NotebookSyncAgent::journalOperation(UpsyncJournal::Operation operation, const QString &href,
+                                         const QString &uid, const QString &etag)
+{
+    if (mJournal) {
+        mJournal->begin(operation, href, uid, etag);
+        mSettledHrefs.remove(href);
+    }
+}
+
+void NotebookSyncAgent::sendPut(const QString &href, const QString &uid,
+                                const QByteArray &icsData, const QString &etag)
+{
+    // The data is shared with the request, keeping it costs nothing.
+    mPendingPayloads.insert(href, icsData);
+    Put *put = new Put(mNetworkManager, mSettings);
+    trackRequest(put, PHASE_UPLOAD);
+    connect(put, &Put::finished, this, &NotebookSyncAgent::nonReportRequestFinished);
+    put->sendIcalData(href, icsData, etag);
+}
+
+void NotebookSyncAgent::sendDelete(const QString &href, const QString &uid, const QString &etag)
+{
+    Delete *del = new Delete(mNetworkManager, mSettings);
+    trackRequest(del, PHASE_UPLOAD);
+    connect(del, &Delete::finished, this, &NotebookSyncAgent::nonReportRequestFinished);
+    del->deleteEvent(href, etag);
+}
+
+// 412 Precondition Failed: the resource has been modified remotely
+// since last sync. According to the conflict resolution policy, the
+// remote resource is fetched to be compared with the local changes
+// before sending them again with the current etag, or it is downloaded
+// to replace the local changes. Returns false when the conflict cannot
+// be resolved.
+bool NotebookSyncAgent::resolveConflict(Request *request, const QString &uri)
+{
+    if (mConflictResPolicy == Buteo::SyncProfile::CR_POLICY_PREFER_LOCAL_CHANGES) {
+        LOG_DEBUG("Conflict on" << uri << ", comparing before retrying" << request->command());
+        mPendingConflicts.insert(uri);
+        Report *report = new Report(mNetworkManager, mSettings);
+        trackRequest(report, PHASE_UPLOAD);
+        connect(report, &Report::finished, this, &NotebookSyncAgent::processConflicts);
+        if (mPendingPayloads.contains(uri)) {
+            report->multiGetEvents(mRemoteCalendarPath, QStringList() << uri);
+        } else {
+            // A deletion only needs the current etag.
+            report->multiGetETags(mRemoteCalendarPath, QStringList() << uri);
+        }
+        return true;
+    } else if (mEnableDownsync) {
+        LOG_DEBUG("Conflict on" << uri << ", downloading the remote version.");
+        mPreconditionFailures.insert(uri);
+        mSentUids.remove(uri);
+        mPendingPayloads.remove(uri);
+        // A discarded deletion is replaced by the downloaded resource.
+        if (mTombstones) {
+            mTombstones->remove(uri);
+        }
+        mSettledHrefs.insert(uri);
+        return true;
+    }
+    return false;
+}
+
+void NotebookSyncAgent::processConflicts(const QString &uri)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    Report *report = qobject_cast<Report*>(sender());
+    if (!report) {
+        clearRequests();
+        emit finished();
+        return;
+    }
+    LOG_DEBUG("fetch of conflicts finished with result:" << report->errorCode() << report->errorString());
+
+    QHash<QString, Reader::CalendarResource> resources;
+    for (const Reader::CalendarResource &resource : report->receivedCalendarResources()) {
+        resources.insert(resource.href, resource);
+    }
+    for (const QString &href : report->fetchedUris()) {
+        mPendingConflicts.remove(href);
+        const Reader::CalendarResource resource = resources.value(href);
+        const QString etag = resource.etag;
+        const QString uid = mJournal ? mJournal->entry(href).uid : mSentUids.value(href);
+        if (report->errorCode() != Buteo::SyncResults::NO_ERROR) {
+            LOG_WARNING("Cannot retrieve current etag of" << href << "in" << uri);
+            mFailingUploads.insert(href);
+            mSentUids.remove(href);
+            if (!mPendingPayloads.remove(href)) {
+                // Don't purge yet the locally deleted incidence.
+                KCalendarCore::Incidence::List::Iterator it = mPurgeList.begin();
+                while (it != mPurgeList.end()) {
+                    if (incidenceHrefUri(*it) == href) {
+                        it = mPurgeList.erase(it);
+                    } else {
+                        ++it;
+                    }
+                }
+            }
+            mSettledHrefs.insert(href);
+        } else if (mPendingPayloads.contains(href) && !etag.isEmpty()
+                   && isSameContent(mPendingPayloads.value(href), resource.incidences)) {
+            LOG_DEBUG("Conflicting upload of" << href << "already matches the remote content.");
+            mPendingPayloads.remove(href);
+            updateHrefETag(mSentUids.take(href), href, etag);
+            mSettledHrefs.insert(href);
+        } else if (mPendingPayloads.contains(href)) {
+            // Without etag, the resource has been deleted remotely
+            // and is created again.
+            if (!resource.incidences.isEmpty()) {
+                LOG_INFO("Overwriting remote changes of" << href << "last modified on"
+                         << resource.incidences.first()->lastModified() << "with local changes.");
+            }
+            journalOperation(UpsyncJournal::Upload, href, uid, etag);
+            sendPut(href, uid, mPendingPayloads.take(href), etag);
+        } else if (!etag.isEmpty()) {
+            journalOperation(UpsyncJournal::Removal, href, uid, etag);
+            sendDelete(href, uid, etag);
+        } else {
+            LOG_DEBUG("Conflicting deletion of" << href << "already done remotely.");
+            if (mTombstones) {
+                mTombstones->remove(href);
+            }
+            mSettledHrefs.insert(href);
+        }
+    }
+
+    if (!hasPendingUploads(report)) {
+        finalizeSendingLocalChanges();
+    }
+
+    requestFinished(report);
+}
+
+bool NotebookSyncAgent::hasPendingUploads(Request *ignored) const
+{
+    if (!mPayloadWatchers.isEmpty() || !mPendingConflicts.isEmpty()) {
+        return true;
+    }
+    for (QSet<Request*>::ConstIterator it = mRequests.constBegin();
+         it != mRequests.constEnd(); ++it) {
+        if (*it != ignored && (qobject_cast<Put*>(*it) || qobject_cast<Delete*>(*it))) {
+            return true;
         }
     }
+    return false;
 }
 
 void NotebookSyncAgent::nonReportRequestFinished(const QString &uri)
@@ -629,18 +1357,37 @@ void NotebookSyncAgent::nonReportRequestFinished(const QString &uri)
         emit finished();
         return;
     }
+    // Conflicts are resolved once per sync, to not loop
+    // while the remote resource keeps changing.
+    if (request->httpStatus() == 412 && !mConflictingHrefs.contains(uri)) {
+        mConflictingHrefs.insert(uri);
+        if (resolveConflict(request, uri)) {
+            if (!hasPendingUploads(request)) {
+                finalizeSendingLocalChanges();
+            }
+            requestFinished(request);
+            return;
+        }
+    }
     if (request->errorCode() != Buteo::SyncResults::NO_ERROR) {
         mFailingUploads.insert(uri);
     }
+    // Without any answer from the server, the outcome of the
+    // operation is unknown and left pending in the journal.
+    bool settled = (request->errorCode() != Buteo::SyncResults::CONNECTION_ERROR);
 
     Put *putRequest = qobject_cast<Put*>(request);
     if (putRequest) {
+        mPendingPayloads.remove(uri);
         if (request->errorCode() == Buteo::SyncResults::NO_ERROR) {
             const QString &etag = putRequest->updatedETag(uri);
             if (!etag.isEmpty()) {
                 // Apply Etag and Href changes immediately since incidences are now
                 // for sure on server.
                 updateHrefETag(mSentUids.take(uri), uri, etag);
+            } else {
+                // Settled once the etag is fetched.
+                settled = false;
             }
         } else {
             // Don't try to get etag later for a failed upload.
@@ -649,7 +1396,11 @@ void NotebookSyncAgent::nonReportRequestFinished(const QString &uri)
     }
     Delete *deleteRequest = qobject_cast<Delete*>(request);
     if (deleteRequest) {
-        if (request->errorCode() != Buteo::SyncResults::NO_ERROR) {
+        if (request->errorCode() == Buteo::SyncResults::NO_ERROR) {
+            if (mTombstones) {
+                mTombstones->remove(uri);
+            }
+        } else {
             // Don't purge yet the locally deleted incidence.
             KCalendarCore::Incidence::List::Iterator it = mPurgeList.begin();
             while (it != mPurgeList.end()) {
@@ -662,13 +1413,11 @@ void NotebookSyncAgent::nonReportRequestFinished(const QString &uri)
         }
     }
 
-    bool last = true;
-    for (QSet<Request*>::ConstIterator it = mRequests.constBegin();
-         it != mRequests.constEnd(); ++it) {
-        last = last && (*it == request ||
-                        (!qobject_cast<Put*>(*it) && !qobject_cast<Delete*>(*it)));
+    if (settled) {
+        mSettledHrefs.insert(uri);
     }
-    if (last) {
+
+    if (!hasPendingUploads(request)) {
         finalizeSendingLocalChanges();
     }
 
@@ -700,11 +1449,49 @@ void NotebookSyncAgent::finalizeSendingLocalChanges()
     // mSentUids have been cleared from uids that have already
     // been updated with new etag value. Just remains the ones
     // that requires additional retrieval to get etag values.
+    // Only the etags are fetched, the bodies are the ones just sent.
     if (!mSentUids.isEmpty()) {
-        sendReportRequest(mSentUids.keys());
+        Report *report = new Report(mNetworkManager, mSettings);
+        trackRequest(report, PHASE_UPLOAD);
+        connect(report, &Report::finished, this, &NotebookSyncAgent::processUploadedETags);
+        report->multiGetETags(mRemoteCalendarPath, mSentUids.keys());
+    }
+
+    if (!mPreconditionFailures.isEmpty()) {
+        sendReportRequest(QStringList(mPreconditionFailures.constBegin(),
+                                      mPreconditionFailures.constEnd()));
     }
 }
 
+void NotebookSyncAgent::processUploadedETags(const QString &uri)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    Report *report = qobject_cast<Report*>(sender());
+    if (!report) {
+        clearRequests();
+        emit finished();
+        return;
+    }
+    LOG_DEBUG("fetch etags of uploads finished with result:" << report->errorCode() << report->errorString());
+
+    if (report->errorCode() == Buteo::SyncResults::NO_ERROR) {
+        for (const Reader::CalendarResource &resource : report->receivedCalendarResources()) {
+            if (!mSentUids.contains(resource.href) || resource.etag.isEmpty()) {
+                continue;
+            }
+            updateHrefETag(mSentUids.take(resource.href), resource.href, resource.etag);
+            mSettledHrefs.insert(resource.href);
+        }
+    }
+    if (!mSentUids.isEmpty()) {
+        // They will be resolved at next sync from the upsync journal.
+        LOG_WARNING("Cannot retrieve etags of" << mSentUids.count() << "uploads for" << uri);
+    }
+
+    requestFinished(report);
+}
+
 bool NotebookSyncAgent::applyRemoteChanges()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
@@ -734,19 +1521,42 @@ bool NotebookSyncAgent::applyRemoteChanges()
         notebook = mNotebook;
     }
 
+    mMetrics.start(PHASE_APPLY);
+    TraceSpan span("sync", QStringLiteral("applyRemoteChanges"), traceArgs());
     bool success = true;
     // Make notebook writable for the time of the modifications.
     notebook->setIsReadOnly(false);
+    mRemoteAdditions.clear();
+    mRemoteModifications.clear();
     if ((mEnableDownsync || mSyncMode == SlowSync)
         && !updateIncidences(mReceivedCalendarResources)) {
         success = false;
     }
+    if ((mEnableDownsync || mSyncMode == SlowSync)
+        && !updateSpooledIncidences()) {
+        success = false;
+    }
     if (mEnableDownsync && !deleteIncidences(mRemoteDeletions)) {
         success = false;
     }
+    mMetrics.addWrittenIncidences(mRemoteAdditions.count() + mRemoteModifications.count()
+                                  + (mEnableDownsync ? mRemoteDeletions.count() : 0));
     // Update storage, before possibly changing readOnly flag for this notebook.
-    if (!mStorage->save(mKCal::ExtendedStorage::PurgeDeleted)) {
+    QElapsedTimer storageTimer;
+    storageTimer.start();
+    const qint64 traceStart = Tracer::now();
+    const bool saved = mStorage->save(mKCal::ExtendedStorage::PurgeDeleted);
+    Tracer::addSpan("storage", QStringLiteral("save"), traceStart, -1, traceArgs());
+    mMetrics.addStorageTime(storageTimer.elapsed());
+    if (!saved) {
         success = false;
+    } else if (mJournal) {
+        // The outcome of these operations is now saved locally.
+        mJournal->complete(mSettledHrefs);
+        mJournal->compact();
+    }
+    if (mTombstones) {
+        mTombstones->save();
     }
     if (!mPurgeList.isEmpty() && !mStorage->purgeDeletedIncidences(mPurgeList)) {
         // Silently ignore failed purge action in database.
@@ -759,10 +1569,28 @@ bool NotebookSyncAgent::applyRemoteChanges()
     notebook->setColor(mNotebook->color());
     notebook->setSyncProfile(mNotebook->syncProfile());
     notebook->setCustomProperty(PATH_PROPERTY, mRemoteCalendarPath);
+    if (mDeferredCount) {
+        // Listed in full by the next syncs, until all is downloaded.
+        notebook->setCustomProperty(PARTIAL_SYNC_PROPERTY, QStringLiteral("1"));
+    } else if (success && mSlices.isEmpty() && mFailingUpdates.isEmpty()
+        && (mSyncMode == SlowSync || mSyncMode == QuickSync)) {
+        // The whole window has been listed.
+        notebook->setCustomProperty(PARTIAL_SYNC_PROPERTY, QString());
+    }
+    if (success && mFailingUpdates.isEmpty() && !mCollectionTag.isEmpty()) {
+        notebook->setCustomProperty(COLLECTION_TAG_PROPERTY, mCollectionTag);
+    }
+    for (const QByteArray &property : {COLLECTION_SIZE_PROPERTY, CHANGE_RATIO_PROPERTY, RESOURCE_SIZE_PROPERTY,
+                                       IDLE_SYNCS_PROPERTY, LAST_CHECK_PROPERTY, LAST_CHANGE_PROPERTY}) {
+        if (!mNotebook->customProperty(property).isEmpty()) {
+            notebook->setCustomProperty(property, mNotebook->customProperty(property));
+        }
+    }
     if (!mStorage->updateNotebook(notebook)) {
         LOG_WARNING("Cannot update notebook" << notebook->name() << "in storage.");
         success = false;
     }
+    mMetrics.stop(PHASE_APPLY);
 
     return success;
 }
@@ -770,12 +1598,21 @@ bool NotebookSyncAgent::applyRemoteChanges()
 Buteo::TargetResults NotebookSyncAgent::result() const
 {
     if (mSyncMode == SlowSync) {
-        unsigned int count = 0;
+        unsigned int count = mCommittedCount;
         for (QList<Reader::CalendarResource>::ConstIterator it = mReceivedCalendarResources.constBegin(); it != mReceivedCalendarResources.constEnd(); ++it) {
             if (!mFailingUpdates.contains(it->href)) {
                 count += it->incidences.count();
             }
         }
+        if (mReceiveSpool) {
+            const QList<ReceiveSpool::Entry> &entries = mReceiveSpool->entries();
+            for (int index : mReceiveSpool->latestEntries()) {
+                if (!mFailingUpdates.contains(entries[index].href)
+                    && !isCommitted(entries[index].href, entries[index].etag)) {
+                    count += entries[index].incidenceCount;
+                }
+            }
+        }
         return Buteo::TargetResults(mNotebook->name().toHtmlEscaped(),
                                     Buteo::ItemCounts(count, 0, 0),
                                     Buteo::ItemCounts());
@@ -806,11 +1643,38 @@ void NotebookSyncAgent::requestFinished(Request *request)
     mRequests.remove(request);
     request->deleteLater();
 
-    if (mRequests.isEmpty()) {
+    const QString phase = mRequestPhases.take(request);
+    if (!phase.isEmpty()) {
+        mMetrics.addRequest(phase, request->bytesSent(), request->bytesReceived());
+        mMetrics.stop(phase);
+    }
+
+    if (mRequests.isEmpty() && mPayloadWatchers.isEmpty()) {
         emit finished();
     }
 }
 
+void NotebookSyncAgent::trackRequest(Request *request, const QString &phase)
+{
+    mRequests.insert(request);
+    mRequestPhases.insert(request, phase);
+    mMetrics.start(phase);
+}
+
+QVariantMap NotebookSyncAgent::traceArgs() const
+{
+    QVariantMap args;
+    if (Tracer::isEnabled()) {
+        args.insert(QStringLiteral("notebook"), mRemoteCalendarPath);
+    }
+    return args;
+}
+
+const SyncMetrics& NotebookSyncAgent::metrics() const
+{
+    return mMetrics;
+}
+
 void NotebookSyncAgent::finalize()
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
@@ -818,7 +1682,7 @@ void NotebookSyncAgent::finalize()
 
 bool NotebookSyncAgent::isFinished() const
 {
-    return mRequests.isEmpty();
+    return mRequests.isEmpty() && mPayloadWatchers.isEmpty();
 }
 
 bool NotebookSyncAgent::isDeleted() const
@@ -855,6 +1719,8 @@ bool NotebookSyncAgent::calculateDelta(
         QSet<QString> *remoteChanges,
         KCalendarCore::Incidence::List *remoteDeletions)
 {
+    TraceSpan span("sync", QStringLiteral("calculateDelta"), traceArgs());
+
     // Note that the mKCal API doesn't provide a way to get all deleted/modified incidences
     // for a notebook, as it implements the SQL query using an inequality on both modifiedAfter
     // and createdBefore; so instead we have to build a datetime which "should" satisfy
@@ -876,7 +1742,31 @@ bool NotebookSyncAgent::calculateDelta(
         bool modified = (incidence->created() < syncDateTime && incidence->lastModified() >= syncDateTime);
         bool uriWasEmpty = false;
         QString remoteUri = incidenceHrefUri(incidence, mRemoteCalendarPath, &uriWasEmpty);
-        if (uriWasEmpty) {
+        if (mJournal && mJournal->contains(remoteUri)
+            && mJournal->entry(remoteUri).operation == UpsyncJournal::Upload
+            && (remoteUriEtags.contains(remoteUri) || mJournal->entry(remoteUri).etag.isEmpty())) {
+            // this incidence was being uploaded when the previous sync was interrupted.
+            // Compare the etag before the upload with the current remote one to know
+            // if the upload reached the server.
+            const UpsyncJournal::Entry entry = mJournal->entry(remoteUri);
+            if (!remoteUriEtags.contains(remoteUri)) {
+                LOG_DEBUG("have interrupted upload of local addition:" << incidence->uid() << incidence->recurrenceId().toString());
+                localAdditions->append(incidence);
+            } else if (remoteUriEtags.value(remoteUri) == entry.etag) {
+                LOG_DEBUG("have interrupted upload of local modification:" << incidence->uid() << incidence->recurrenceId().toString());
+                localModifications->append(incidence);
+                localUriEtags.insert(remoteUri, entry.etag);
+            } else {
+                LOG_DEBUG("have completed upload, adopting remote etag:" << incidence->uid() << incidence->recurrenceId().toString() << ":" << remoteUri);
+                const bool modifiedSinceUpload = (incidence->lastModified() > entry.dateTime);
+                updateIncidenceHrefEtag(incidence, remoteUri, remoteUriEtags.value(remoteUri));
+                if (modifiedSinceUpload) {
+                    LOG_DEBUG("have local modification since the upload:" << incidence->uid() << incidence->recurrenceId().toString());
+                    localModifications->append(incidence);
+                }
+                localUriEtags.insert(remoteUri, remoteUriEtags.value(remoteUri));
+            }
+        } else if (uriWasEmpty) {
             // must be either a new local addition or a previously-upsynced local addition
             // if we failed to update its uri after the successful upsync.
             if (remoteUriEtags.contains(remoteUri)) { // we saw this on remote side...
@@ -937,10 +1827,8 @@ bool NotebookSyncAgent::calculateDelta(
         }
     }
 
-    // List all local deletions reported by mkcal.
     KCalendarCore::Incidence::List deleted;
-    if (!mStorage->deletedIncidences(&deleted, QDateTime(), mNotebook->uid())) {
-        LOG_WARNING("mKCal::ExtendedStorage::deletedIncidences() failed");
+    if (!loadLocalDeletions(&deleted)) {
         return false;
     }
     for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(deleted)) {
@@ -958,7 +1846,16 @@ bool NotebookSyncAgent::calculateDelta(
                 setIncidenceETag(incidence, remoteUriEtags.value(remoteUri));
                 localDeletions->append(incidence);
             } else {
-                if (incidenceETag(incidence) == remoteUriEtags.value(remoteUri)) {
+                const bool uploaded = mJournal && mJournal->contains(remoteUri)
+                    && mJournal->entry(remoteUri).operation == UpsyncJournal::Upload
+                    && mJournal->entry(remoteUri).etag != remoteUriEtags.value(remoteUri);
+                if (uploaded) {
+                    // the upload of the previous sync reached the server before
+                    // the incidence was deleted locally.
+                    LOG_DEBUG("have local deletion for uploaded incidence:" << incidence->uid() << incidence->recurrenceId().toString());
+                    setIncidenceETag(incidence, remoteUriEtags.value(remoteUri));
+                    localDeletions->append(incidence);
+                } else if (incidenceETag(incidence) == remoteUriEtags.value(remoteUri)) {
                     // the incidence was previously synced successfully.  it has now been deleted locally.
                     LOG_DEBUG("have local deletion for previously synced incidence:" << incidence->uid() << incidence->recurrenceId().toString());
                     localDeletions->append(incidence);
@@ -997,12 +1894,121 @@ bool NotebookSyncAgent::calculateDelta(
     }
     *remoteChanges = remoteAdditions + remoteModifications;
 
+    // Tombstones of deletions that are ignored or already done remotely expire here.
+    updateTombstones(*localDeletions);
+
+    // Interrupted operations are all resolved by this delta.
+    if (mJournal) {
+        for (const UpsyncJournal::Entry &entry : mJournal->entries()) {
+            mSettledHrefs.insert(entry.href);
+        }
+    }
+
     LOG_DEBUG("Calculated local  A/M/R:" << localAdditions->size() << "/" << localModifications->size() << "/" << localDeletions->size());
     LOG_DEBUG("Calculated remote A/M/R:" << remoteAdditions.size() << "/" << remoteModifications.size() << "/" << remoteDeletions->size());
 
     return true;
 }
 
+// called in the UpsyncOnly codepath, when the remote etags are not known.
+// Possible remote changes are detected later by the upload preconditions.
+bool NotebookSyncAgent::calculateLocalDelta(
+        KCalendarCore::Incidence::List *localAdditions,
+        KCalendarCore::Incidence::List *localModifications,
+        KCalendarCore::Incidence::List *localDeletions)
+{
+    TraceSpan span("sync", QStringLiteral("calculateLocalDelta"), traceArgs());
+
+    // See calculateDelta() for the one second shift.
+    QDateTime syncDateTime = mNotebook->syncDate().addSecs(1);
+
+    KCalendarCore::Incidence::List inserted;
+    KCalendarCore::Incidence::List modified;
+    if (!mStorage->insertedIncidences(&inserted, syncDateTime, mNotebook->uid())
+        || !mStorage->modifiedIncidences(&modified, syncDateTime, mNotebook->uid())) {
+        LOG_WARNING("Unable to load notebook changes, aborting upsync of notebook:" << mRemoteCalendarPath << ":" << mNotebook->uid());
+        return false;
+    }
+
+    const KCalendarCore::Incidence::List changed = inserted + modified;
+    for (KCalendarCore::Incidence::Ptr incidence : changed) {
+        bool uriWasEmpty = false;
+        incidenceHrefUri(incidence, mRemoteCalendarPath, &uriWasEmpty);
+        if (uriWasEmpty || isCopiedDetachedIncidence(incidence)) {
+            LOG_DEBUG("have new local addition:" << incidence->uid() << incidence->recurrenceId().toString());
+            localAdditions->append(incidence);
+        } else if (incidence->created() < syncDateTime && incidence->lastModified() >= syncDateTime) {
+            LOG_DEBUG("have local modification:" << incidence->uid() << incidence->recurrenceId().toString());
+            localModifications->append(incidence);
+        }
+        // Otherwise, it has been written by the previous sync.
+    }
+
+    KCalendarCore::Incidence::List deleted;
+    if (!loadLocalDeletions(&deleted)) {
+        return false;
+    }
+    for (KCalendarCore::Incidence::Ptr incidence : const_cast<const KCalendarCore::Incidence::List&>(deleted)) {
+        bool uriWasEmpty = false;
+        incidenceHrefUri(incidence, mRemoteCalendarPath, &uriWasEmpty);
+        if (uriWasEmpty) {
+            LOG_DEBUG("ignoring local deletion of never upsynced incidence:" << incidence->uid() << incidence->recurrenceId().toString());
+            mPurgeList.append(incidence);
+        } else {
+            LOG_DEBUG("have local deletion for previously synced incidence:" << incidence->uid() << incidence->recurrenceId().toString());
+            localDeletions->append(incidence);
+        }
+    }
+    updateTombstones(*localDeletions);
+
+    LOG_DEBUG("Calculated local  A/M/R:" << localAdditions->size() << "/" << localModifications->size() << "/" << localDeletions->size());
+
+    return true;
+}
+
+bool NotebookSyncAgent::loadLocalDeletions(KCalendarCore::Incidence::List *deleted)
+{
+    // List the local deletions reported by mkcal since the last sync,
+    // and the ones of previous syncs still waiting for the server.
+    // Without tombstone index, all local deletions are listed.
+    const QDateTime deletedSince = (mTombstones && mTombstones->exists())
+        ? mNotebook->syncDate() : QDateTime();
+    if (!mStorage->deletedIncidences(deleted, deletedSince, mNotebook->uid())) {
+        LOG_WARNING("mKCal::ExtendedStorage::deletedIncidences() failed");
+        return false;
+    }
+    if (mTombstones) {
+        QSet<QString> deletedUids;
+        for (const KCalendarCore::Incidence::Ptr &incidence : const_cast<const KCalendarCore::Incidence::List&>(*deleted)) {
+            deletedUids.insert(incidence->uid());
+        }
+        for (const TombstoneIndex::Tombstone &tombstone : mTombstones->tombstones()) {
+            if (!deletedUids.contains(tombstone.uid)) {
+                KCalendarCore::Incidence::Ptr incidence(new KCalendarCore::Event);
+                incidence->setUid(tombstone.uid);
+                setIncidenceHrefUri(incidence, tombstone.href);
+                setIncidenceETag(incidence, tombstone.etag);
+                deleted->append(incidence);
+            }
+        }
+    }
+    return true;
+}
+
+void NotebookSyncAgent::updateTombstones(const KCalendarCore::Incidence::List &localDeletions)
+{
+    // Only deletions of whole series end as DELETE requests, others
+    // are uploads of the series.
+    if (mTombstones) {
+        mTombstones->clear();
+        for (const KCalendarCore::Incidence::Ptr &incidence : localDeletions) {
+            if (!incidence->hasRecurrenceId()) {
+                mTombstones->insert(incidenceHrefUri(incidence), incidence->uid(), incidenceETag(incidence));
+            }
+        }
+    }
+}
+
 static QString nbUid(const QString &notebookId, const QString &uid)
 {
     return QStringLiteral("NBUID:%1:%2").arg(notebookId).arg(uid);
@@ -1041,9 +2047,19 @@ void NotebookSyncAgent::updateIncidence(KCalendarCore::Incidence::Ptr incidence,
         // and add them back as EXDATEs.  This is because mkcal expects that dissociated
         // single instances will correspond to an EXDATE, but most sync servers do not (and
         // so will not include the RECURRENCE-ID values as EXDATEs of the parent).
-        for (KCalendarCore::Incidence::Ptr instance : instances) {
-            if (instance->hasRecurrenceId()) {
-                storedIncidence->recurrence()->addExDateTime(instance->recurrenceId());
+        if (!instances.isEmpty()) {
+            KCalendarCore::DateTimeList exDateTimes = storedIncidence->recurrence()->exDateTimes();
+            QSet<QDateTime> knownExDateTimes(exDateTimes.constBegin(), exDateTimes.constEnd());
+            for (KCalendarCore::Incidence::Ptr instance : instances) {
+                if (instance->hasRecurrenceId()
+                    && !knownExDateTimes.contains(instance->recurrenceId())) {
+                    knownExDateTimes.insert(instance->recurrenceId());
+                    exDateTimes.append(instance->recurrenceId());
+                }
+            }
+            if (exDateTimes.count() != storedIncidence->recurrence()->exDateTimes().count()) {
+                std::sort(exDateTimes.begin(), exDateTimes.end());
+                storedIncidence->recurrence()->setExDateTimes(exDateTimes);
             }
         }
 
@@ -1113,12 +2129,110 @@ bool NotebookSyncAgent::addException(KCalendarCore::Incidence::Ptr incidence,
     return addIncidence(incidence);
 }
 
-bool NotebookSyncAgent::updateIncidences(const QList<Reader::CalendarResource> &resources)
+void NotebookSyncAgent::storeReceivedResources(const QList<Reader::CalendarResource> &resources)
 {
     NOTEBOOK_FUNCTION_CALL_TRACE;
 
-    mRemoteAdditions.clear();
-    mRemoteModifications.clear();
+    mReceivedCalendarResources += resources;
+    for (const Reader::CalendarResource &resource : resources) {
+        mReceivedDataSize += resource.iCalData.size() * sizeof(QChar);
+    }
+
+    const qint64 bufferSize = mSettings->receiveBufferSize();
+    if (bufferSize <= 0 || mReceivedDataSize <= bufferSize) {
+        return;
+    }
+
+    // Move everything received so far to disk, only an index
+    // is kept in memory. Resources are parsed again when applied.
+    receiveSpool();
+    LOG_DEBUG("Spooling" << mReceivedCalendarResources.count() << "received resources to"
+              << mReceiveSpool->fileName());
+    QList<Reader::CalendarResource>::Iterator it = mReceivedCalendarResources.begin();
+    while (it != mReceivedCalendarResources.end()) {
+        if (!mReceiveSpool->append(*it)) {
+            LOG_WARNING("Cannot spool received resource" << it->href << ", keeping the remaining ones in memory.");
+            break;
+        }
+        mReceivedDataSize -= it->iCalData.size() * sizeof(QChar);
+        it = mReceivedCalendarResources.erase(it);
+    }
+}
+
+ReceiveSpool* NotebookSyncAgent::receiveSpool()
+{
+    if (!mReceiveSpool) {
+        mReceiveSpool.reset(new ReceiveSpool(mSettings->cacheDirectory()
+                                             + QStringLiteral("/receive-")
+                                             + mNotebook->uid()
+                                             + QStringLiteral(".spool")));
+    }
+    return mReceiveSpool.data();
+}
+
+bool NotebookSyncAgent::updateSpooledIncidences()
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
+
+    if (!mReceiveSpool || !mReceiveSpool->count()) {
+        return true;
+    }
+
+    // Resources providing a base incidence are applied first,
+    // so persistent exceptions received in another resource
+    // and another batch can be attached to their series.
+    // Series overlapping several slices are received more than once.
+    const QList<ReceiveSpool::Entry> &entries = mReceiveSpool->entries();
+    QList<int> latest;
+    for (int i : mReceiveSpool->latestEntries()) {
+        if (!isCommitted(entries[i].href, entries[i].etag)) {
+            latest.append(i);
+        }
+    }
+    QList<int> order;
+    for (int i : latest) {
+        if (entries[i].hasBaseIncidence) {
+            order.append(i);
+        }
+    }
+    for (int i : latest) {
+        if (!entries[i].hasBaseIncidence) {
+            order.append(i);
+        }
+    }
+
+    bool success = true;
+    const qint64 bufferSize = mSettings->receiveBufferSize();
+    QList<Reader::CalendarResource> batch;
+    qint64 batchSize = 0;
+    for (int index : order) {
+        Reader::CalendarResource resource;
+        if (!mReceiveSpool->resource(index, &resource)) {
+            LOG_WARNING("Cannot read spooled resource" << entries[index].href);
+            mFailingUpdates.insert(entries[index].href);
+            success = false;
+            continue;
+        }
+        batchSize += resource.iCalData.size() * sizeof(QChar);
+        batch.append(resource);
+        if (batchSize > bufferSize) {
+            if (!updateIncidences(batch)) {
+                success = false;
+            }
+            batch.clear();
+            batchSize = 0;
+        }
+    }
+    if (!batch.isEmpty() && !updateIncidences(batch)) {
+        success = false;
+    }
+
+    return success;
+}
+
+bool NotebookSyncAgent::updateIncidences(const QList<Reader::CalendarResource> &resources)
+{
+    NOTEBOOK_FUNCTION_CALL_TRACE;
 
     // We need to coalesce any resources which have the same UID.
     // This can be the case if there is addition of both a recurring event,
@@ -1210,13 +2324,13 @@ bool NotebookSyncAgent::updateIncidences(const QList<Reader::CalendarResource> &
         }
 
         // update persistent exceptions which are in the remote list.
-        QList<QDateTime> remoteRecurrenceIds;
+        QSet<QDateTime> remoteRecurrenceIds;
         for (int i = 0; i < resource.incidences.size(); ++i) {
             KCalendarCore::Incidence::Ptr remoteInstance = resource.incidences[i];
             if (!remoteInstance->hasRecurrenceId()) {
                 continue; // already handled this one.
             }
-            remoteRecurrenceIds.append(remoteInstance->recurrenceId());
+            remoteRecurrenceIds.insert(remoteInstance->recurrenceId());
 
             LOG_DEBUG("Now saving a persistent exception:" << remoteInstance->recurrenceId().toString());
             remoteInstance->setUid(localBaseIncidence->uid());
@@ -24,17 +24,26 @@
 #define NOTEBOOKSYNCAGENT_P_H
 
 #include "reader.h"
+#include "syncmetrics.h"
+#include "upsyncjournal.h"
 
 #include <extendedcalendar.h>
 #include <extendedstorage.h>
 
 #include <QDateTime>
+#include <QPair>
+#include <QFutureWatcher>
+#include <QScopedPointer>
+#include <QVariantMap>
 
 #include <SyncResults.h>
+#include <SyncProfile.h>
 
 class QNetworkAccessManager;
 class Request;
 class Settings;
+class ReceiveSpool;
+class TombstoneIndex;
 
 class NotebookSyncAgent : public QObject
 {
@@ -43,7 +52,8 @@ public:
     enum SyncMode {
         NoSyncMode,
         SlowSync,   // download everything
-        QuickSync   // updates only
+        QuickSync,  // updates only
+        UpsyncOnly  // local changes only, without remote listing
     };
 
     explicit NotebookSyncAgent(mKCal::ExtendedCalendar::Ptr calendar,
@@ -62,9 +72,12 @@ public:
                              const QString &pluginName,
                              const QString &syncProfile);
 
+    void setConflictResolutionPolicy(Buteo::SyncProfile::ConflictResolutionPolicy policy);
+
     void startSync(const QDateTime &fromDateTime,
                    const QDateTime &toDateTime,
-                   bool withUpsync, bool withDownsync);
+                   bool withUpsync, bool withDownsync,
+                   bool localChangesOnly = false);
 
     void abort();
     bool applyRemoteChanges();
@@ -77,6 +90,7 @@ public:
     bool hasUploadErrors() const;
 
     const QString& path() const;
+    const SyncMetrics& metrics() const;
 
 signals:
     void finished();
@@ -85,13 +99,41 @@ private slots:
     void reportRequestFinished(const QString &uri);
     void nonReportRequestFinished(const QString &uri);
     void processETags(const QString &uri);
+    void processUploadedETags(const QString &uri);
+    void processConflicts(const QString &uri);
+    void processCollectionTag(const QString &uri);
 private:
     void sendReportRequest(const QStringList &remoteUris = QStringList());
+    void sendSliceRequest();
+    static QList<QPair<QDateTime, QDateTime> > slowSyncSlices(const QDateTime &fromDateTime,
+                                                             const QDateTime &toDateTime,
+                                                             const QDateTime &now);
+    bool commitSlice();
+    bool isCommitted(const QString &href, const QString &etag) const;
     void clearRequests();
+    void trackRequest(Request *request, const QString &phase);
+    QVariantMap traceArgs() const;
     void requestFinished(Request *request);
 
     void fetchRemoteChanges();
+    void checkCollectionTag();
+    void sendLocalChangesOnly(bool listIfUnchanged = false);
+    static QSet<QString> deferredResources(const QList<Reader::CalendarResource> &resources,
+                                           const QSet<QString> &remoteChanges,
+                                           qint64 maxSize);
+    static bool isSameContent(const QByteArray &icsData,
+                              const KCalendarCore::Incidence::List &remoteIncidences);
+    static bool preferFullFetch(int collectionSize, double changeRatio, qint64 resourceSize,
+                                qint64 *fetchCost, qint64 *etagsCost);
+    void updateCollectionStats(int collectionSize, int changes);
+    void updateResourceSize(const QList<Reader::CalendarResource> &resources);
+    static bool isCold(int idleSyncs, const QDateTime &lastCheck, const QDateTime &now);
+    bool remoteIsCold() const;
+    void updatePollingStats(bool changed);
+    void storeReceivedResources(const QList<Reader::CalendarResource> &resources);
     bool updateIncidences(const QList<Reader::CalendarResource> &resources);
+    ReceiveSpool* receiveSpool();
+    bool updateSpooledIncidences();
     bool deleteIncidences(const KCalendarCore::Incidence::List deletedIncidences);
     void updateIncidence(KCalendarCore::Incidence::Ptr incidence,
                          KCalendarCore::Incidence::Ptr storedIncidence,
@@ -103,6 +145,15 @@ private:
     void updateHrefETag(const QString &uid, const QString &href, const QString &etag) const;
 
     void sendLocalChanges();
+    void payloadReady(QFutureWatcher<QByteArray> *watcher,
+                      const QString &href, const QString &uid, const QString &etag);
+    void journalOperation(UpsyncJournal::Operation operation, const QString &href,
+                          const QString &uid, const QString &etag);
+    void sendPut(const QString &href, const QString &uid,
+                 const QByteArray &icsData, const QString &etag);
+    void sendDelete(const QString &href, const QString &uid, const QString &etag);
+    bool resolveConflict(Request *request, const QString &uri);
+    bool hasPendingUploads(Request *ignored = 0) const;
     QString constructLocalChangeIcs(KCalendarCore::Incidence::Ptr updatedIncidence);
     void finalizeSendingLocalChanges();
 
@@ -112,10 +163,17 @@ private:
                         KCalendarCore::Incidence::List *localDeletions,
                         QSet<QString> *remoteChanges,
                         KCalendarCore::Incidence::List *remoteDeletions);
+    bool calculateLocalDelta(KCalendarCore::Incidence::List *localAdditions,
+                             KCalendarCore::Incidence::List *localModifications,
+                             KCalendarCore::Incidence::List *localDeletions);
+    bool loadLocalDeletions(KCalendarCore::Incidence::List *deleted);
+    void updateTombstones(const KCalendarCore::Incidence::List &localDeletions);
 
     QNetworkAccessManager* mNetworkManager;
     Settings *mSettings;
     QSet<Request *> mRequests;
+    QHash<Request *, QString> mRequestPhases; // for the metrics.
+    QSet<QFutureWatcherBase *> mPayloadWatchers; // PUT payloads being serialised.
     mKCal::ExtendedCalendar::Ptr mCalendar;
     mKCal::ExtendedStorage::Ptr mStorage;
     mKCal::Notebook::Ptr mNotebook;
@@ -126,9 +184,11 @@ private:
     QString mRemoteCalendarPath; // contains calendar path.  resource prefix.  doesn't include host, percent decoded.
     SyncMode mSyncMode;          // quick (etag-based delta detection) or slow (full report) sync
     bool mRetriedReport;         // some servers will fail the first request but succeed on second
+    bool mFullFetch;             // quick sync listing the calendar data with the etags
     bool mNotebookNeedsDeletion; // if the calendar was deleted remotely, we will need to delete it locally.
     bool mEnableUpsync, mEnableDownsync;
     bool mReadOnlyFlag;
+    Buteo::SyncProfile::ConflictResolutionPolicy mConflictResPolicy;
 
     // these are used only in quick-sync mode.
     // delta detection and change data
@@ -145,9 +205,25 @@ private:
                                        // local additions, modifications.
     QSet<QString> mFailingUploads; // List of hrefs with upload errors.
     QSet<QString> mFailingUpdates; // List of hrefs from which incidences failed to update.
+    QSet<QString> mPreconditionFailures; // List of hrefs modified remotely since last sync, refused on upload.
+    QSet<QString> mConflictingHrefs; // List of hrefs that already failed a precondition during this sync.
+    QSet<QString> mPendingConflicts; // List of hrefs waiting for their current etag before a retry.
+    QHash<QString, QByteArray> mPendingPayloads; // PUT payloads, kept to be sent again on conflict.
+    QScopedPointer<UpsyncJournal> mJournal; // PUT and DELETE requests in flight.
+    QSet<QString> mSettledHrefs; // Journaled hrefs with a known outcome.
+    QScopedPointer<TombstoneIndex> mTombstones; // Local deletions not yet confirmed by the server.
 
     // received remote incidence resource data
     QList<Reader::CalendarResource> mReceivedCalendarResources;
+    qint64 mReceivedDataSize; // size of the iCal data in mReceivedCalendarResources.
+    QList<QPair<QDateTime, QDateTime> > mSlices; // time ranges left to download in slow sync.
+    QHash<QString, QString> mCommittedETags; // resources already written by a previous slice.
+    unsigned int mCommittedCount; // incidences written by the previous slices.
+    QString mCollectionTag; // sync-token or ctag read before listing.
+    int mDeferredCount; // large remote changes left for an unmetered sync.
+    QScopedPointer<ReceiveSpool> mReceiveSpool; // received data above the receive buffer size.
+
+    SyncMetrics mMetrics;
 
     friend class tst_NotebookSyncAgent;
 };
@@ -23,9 +23,9 @@
 
 #include "propfind.h"
 #include "settings.h"
+#include "tracer.h"
 
 #include <QNetworkAccessManager>
-#include <QBuffer>
 #include <QXmlStreamReader>
 
 #include <LogMacros.h>
@@ -319,6 +319,93 @@ static bool readUserPrincipalResponse(QXmlStreamReader *reader, QString *userPri
     return false;
 }
 
+static bool readDiscoveryResponse(QXmlStreamReader *reader, QString *userPrincipal,
+                                  QString *mailtoHref, QString *homeHref)
+{
+    /* expect a response like:
+        <?xml version='1.0' encoding='utf-8'?>
+        <D:multistatus xmlns:D="DAV:">
+            <D:response>
+                <href xmlns="DAV:">/</href>
+                <D:propstat>
+                    <D:prop>
+                        <D:current-user-principal>
+                            <D:href>/principals/users/username%40server.tld/</D:href>
+                        </D:current-user-principal>
+                        <C:calendar-home-set xmlns:C="urn:ietf:params:xml:ns:caldav">
+                            <D:href>/caldav/</D:href>
+                        </C:calendar-home-set>
+                        <C:calendar-user-address-set xmlns:C="urn:ietf:params:xml:ns:caldav">
+                            <D:href>mailto:username@server.tld</D:href>
+                        </C:calendar-user-address-set>
+                    </D:prop>
+                    <status xmlns="DAV:">HTTP/1.1 200 OK</status>
+                </D:propstat>
+            </D:response>
+        </D:multistatus>
+       Servers exposing the calendar properties on the principal
+       resource only answer them with a 404 status here.
+    */
+
+    QString property;
+    for (; !reader->atEnd(); reader->readNext()) {
+        if (reader->name() == "current-user-principal"
+            || reader->name() == "calendar-home-set"
+            || reader->name() == "calendar-user-address-set") {
+            property = reader->isStartElement() ? reader->name().toString() : QString();
+        } else if (!property.isEmpty()
+                   && reader->name() == "href" && reader->isStartElement()) {
+            const QString href = reader->readElementText();
+            if (property == QStringLiteral("current-user-principal")) {
+                *userPrincipal = href;
+            } else if (property == QStringLiteral("calendar-home-set")) {
+                *homeHref = href;
+            } else if (href.startsWith(QStringLiteral("mailto:"), Qt::CaseInsensitive)) {
+                *mailtoHref = href.mid(7); // chop off "mailto:"
+            }
+        } else if (reader->name() == "response" && reader->isEndElement()) {
+            return !userPrincipal->isEmpty();
+        }
+    }
+
+    return false;
+}
+
+static bool readHomeTagResponse(QXmlStreamReader *reader, QString *tag)
+{
+    /* expect a response like:
+        <?xml version='1.0' encoding='utf-8'?>
+        <D:multistatus xmlns:D="DAV:">
+            <D:response>
+                <href xmlns="DAV:">/caldav/</href>
+                <D:propstat>
+                    <D:prop>
+                        <D:sync-token>http://server.tld/ns/sync/1234</D:sync-token>
+                        <CS:getctag xmlns:CS="http://calendarserver.org/ns/">1234</CS:getctag>
+                    </D:prop>
+                    <status xmlns="DAV:">HTTP/1.1 200 OK</status>
+                </D:propstat>
+            </D:response>
+        </D:multistatus>
+    */
+
+    QString syncToken;
+    QString ctag;
+    for (; !reader->atEnd(); reader->readNext()) {
+        if (reader->name() == "sync-token" && reader->isStartElement()) {
+            syncToken = reader->readElementText().trimmed();
+        } else if (reader->name() == "getctag" && reader->isStartElement()) {
+            ctag = reader->readElementText().trimmed();
+        } else if (reader->name() == "response" && reader->isEndElement()) {
+            // The sync-token changes with the members, like the ctag.
+            *tag = syncToken.isEmpty() ? ctag : syncToken;
+            return true;
+        }
+    }
+
+    return false;
+}
+
 bool PropFind::parseCalendarResponse(const QByteArray &data)
 {
     if (data.isNull() || data.isEmpty()) {
@@ -367,6 +454,39 @@ bool PropFind::parseUserAddressSetResponse(const QByteArray &data)
     return true;
 }
 
+bool PropFind::parseDiscoveryResponse(const QByteArray &data)
+{
+    if (data.isNull() || data.isEmpty()) {
+        return false;
+    }
+    QXmlStreamReader reader(data);
+    reader.setNamespaceProcessing(true);
+    for (; !reader.atEnd(); reader.readNext()) {
+        if (reader.name() == "response" && reader.isStartElement()
+                && !readDiscoveryResponse(&reader, &mUserPrincipal,
+                                          &mUserMailtoHref, &mUserHomeHref)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool PropFind::parseHomeTagResponse(const QByteArray &data)
+{
+    if (data.isNull() || data.isEmpty()) {
+        return false;
+    }
+    QXmlStreamReader reader(data);
+    reader.setNamespaceProcessing(true);
+    for (; !reader.atEnd(); reader.readNext()) {
+        if (reader.name() == "response" && reader.isStartElement()
+                && !readHomeTagResponse(&reader, &mHomeTag)) {
+            return false;
+        }
+    }
+    return !reader.hasError();
+}
+
 PropFind::PropFind(QNetworkAccessManager *manager, Settings *settings, QObject *parent)
     : Request(manager, settings, "PROPFIND", parent)
 {
@@ -388,6 +508,22 @@ void PropFind::listCalendars(const QString &calendarsPath)
     sendRequest(calendarsPath, requestData, ListCalendars);
 }
 
+// The tag changes when calendars are added to or removed
+// from the home, or when their properties change.
+void PropFind::listHomeTag(const QString &calendarsPath)
+{
+    const QByteArray requestData(QByteArrayLiteral(
+            "<d:propfind xmlns:d=\"DAV:\" xmlns:cs=\"http://calendarserver.org/ns/\">"
+            "  <d:prop>"
+            "    <d:sync-token />"
+            "    <cs:getctag />"
+            "  </d:prop>"
+            "</d:propfind>"
+    ));
+    mHomeTag.clear();
+    sendRequest(calendarsPath, requestData, HomeTag);
+}
+
 void PropFind::listUserAddressSet(const QString &userPrincipal)
 {
     const QByteArray requestData(QByteArrayLiteral(
@@ -418,6 +554,27 @@ void PropFind::listCurrentUserPrincipal()
                 requestData, UserPrincipal);
 }
 
+// Asks in one round trip for the properties that are otherwise
+// read with listCurrentUserPrincipal() and then listUserAddressSet().
+void PropFind::discover()
+{
+    const QByteArray requestData(QByteArrayLiteral(
+            "<d:propfind xmlns:d=\"DAV:\" xmlns:c=\"urn:ietf:params:xml:ns:caldav\">"
+            "  <d:prop>"
+            "    <d:current-user-principal />"
+            "    <c:calendar-user-address-set />"
+            "    <c:calendar-home-set />"
+            "  </d:prop>"
+            "</d:propfind>"
+    ));
+    mUserPrincipal.clear();
+    mUserMailtoHref.clear();
+    mUserHomeHref.clear();
+    const QString &rootPath = mSettings->davRootPath();
+    sendRequest(rootPath.isEmpty() ? QStringLiteral("/") : rootPath,
+                requestData, Discovery);
+}
+
 void PropFind::sendRequest(const QString &remotePath, const QByteArray &requestData, PropFindRequestType reqType)
 {
     FUNCTION_CALL_TRACE;
@@ -433,38 +590,20 @@ void PropFind::sendRequest(const QString &remotePath, const QByteArray &requestD
     request.setRawHeader("Prefer", "return-minimal");
     request.setHeader(QNetworkRequest::ContentLengthHeader, requestData.length());
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/xml; charset=utf-8");
-    QBuffer *buffer = new QBuffer(this);
-    buffer->setData(requestData);
-    // TODO: when Qt5.8 is available, remove the use of buffer, and pass requestData directly.
-    QNetworkReply *reply = mNAManager->sendCustomRequest(request, REQUEST_TYPE.toLatin1(), buffer);
-    reply->setProperty(PROP_URI, remotePath);
-    debugRequest(request, buffer->buffer());
-    connect(reply, SIGNAL(finished()), this, SLOT(processResponse()));
-    connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
-            this, SLOT(slotSslErrors(QList<QSslError>)));
+    send(request, requestData, remotePath);
 }
 
-void PropFind::processResponse()
+void PropFind::handleReply(QNetworkReply *reply)
 {
     FUNCTION_CALL_TRACE;
 
     LOG_DEBUG("Process PROPFIND response.");
 
-    if (wasDeleted()) {
-        LOG_DEBUG("PROPFIND request was aborted");
-        return;
-    }
-
-    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (!reply) {
-        finishedWithInternalError(QString());
-        return;
-    }
     reply->deleteLater();
     const QString &uri = reply->property(PROP_URI).toString();
     if (reply->error() != QNetworkReply::NoError) {
         debugReplyAndReadAll(reply);
-        finishedWithReplyResult(uri, reply->error());
+        finishedWithReplyResult(uri, reply);
         return;
     }
     QVariant statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
@@ -480,16 +619,25 @@ void PropFind::processResponse()
     QByteArray data = reply->readAll();
     debugReply(*reply, data);
     bool success = false;
-    switch (mPropFindRequestType) {
-    case (UserPrincipal):
-        success = parseUserPrincipalResponse(data);
-        break;
-    case (UserAddressSet):
-        success = parseUserAddressSetResponse(data);
-        break;
-    case (ListCalendars):
-        success = parseCalendarResponse(data);
-        break;
+    {
+        TraceSpan span("parse", QStringLiteral("PropFind::parse"));
+        switch (mPropFindRequestType) {
+        case (UserPrincipal):
+            success = parseUserPrincipalResponse(data);
+            break;
+        case (UserAddressSet):
+            success = parseUserAddressSetResponse(data);
+            break;
+        case (ListCalendars):
+            success = parseCalendarResponse(data);
+            break;
+        case (Discovery):
+            success = parseDiscoveryResponse(data);
+            break;
+        case (HomeTag):
+            success = parseHomeTagResponse(data);
+            break;
+        }
     }
     if (success) {
         finishedWithSuccess(uri);
@@ -514,6 +662,11 @@ QString PropFind::userMailtoHref() const
     return mUserMailtoHref;
 }
 
+QString PropFind::homeTag() const
+{
+    return mHomeTag;
+}
+
 QString PropFind::userHomeHref() const
 {
     return mUserHomeHref;
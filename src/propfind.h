@@ -60,6 +60,8 @@ public:
     void listCurrentUserPrincipal();
     QString userPrincipal() const;
 
+    void discover();
+
     void listUserAddressSet(const QString &userPrincipal);
     QString userMailtoHref() const;
     QString userHomeHref() const;
@@ -67,24 +69,32 @@ public:
     void listCalendars(const QString &calendarsPath);
     const QList<CalendarInfo>& calendars() const;
 
-private Q_SLOTS:
-    void processResponse();
+    void listHomeTag(const QString &calendarsPath);
+    QString homeTag() const;
+
+protected:
+    void handleReply(QNetworkReply *reply) override;
 
 private:
     enum PropFindRequestType {
         UserPrincipal,
         UserAddressSet,
-        ListCalendars
+        ListCalendars,
+        Discovery,
+        HomeTag
     };
     void sendRequest(const QString &remotePath, const QByteArray &requestData, PropFindRequestType reqType);
     bool parseUserPrincipalResponse(const QByteArray &data);
     bool parseUserAddressSetResponse(const QByteArray &data);
     bool parseCalendarResponse(const QByteArray &data);
+    bool parseDiscoveryResponse(const QByteArray &data);
+    bool parseHomeTagResponse(const QByteArray &data);
 
     QList<CalendarInfo> mCalendars;
     QString mUserPrincipal;
     QString mUserMailtoHref;
     QString mUserHomeHref;
+    QString mHomeTag;
     PropFindRequestType mPropFindRequestType = UserPrincipal;
 
     friend class tst_Propfind;
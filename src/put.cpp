@@ -27,7 +27,6 @@
 
 #include <QNetworkAccessManager>
 #include <QNetworkRequest>
-#include <QBuffer>
 #include <QDebug>
 #include <QStringList>
 #include <QUrl>
@@ -41,7 +40,7 @@ Put::Put(QNetworkAccessManager *manager, Settings *settings, QObject *parent)
 {
 }
 
-void Put::sendIcalData(const QString &uri, const QString &icalData,
+void Put::sendIcalData(const QString &uri, const QByteArray &icalData,
                        const QString &eTag)
 {
     FUNCTION_CALL_TRACE;
@@ -56,9 +55,9 @@ void Put::sendIcalData(const QString &uri, const QString &icalData,
     }
 
     mLocalUriList.insert(uri);
-    QByteArray data = icalData.toUtf8();
+    const QByteArray &data = icalData;
     if (data.isEmpty()) {
-        finishedWithInternalError("no ical data provided or cannot convert data to UTF-8");
+        finishedWithInternalError("no ical data provided");
         return;
     }
 
@@ -72,28 +71,13 @@ void Put::sendIcalData(const QString &uri, const QString &icalData,
     request.setHeader(QNetworkRequest::ContentLengthHeader, data.length());
     request.setHeader(QNetworkRequest::ContentTypeHeader, "text/calendar; charset=utf-8");
 
-    QNetworkReply *reply = mNAManager->put(request, data);
-    reply->setProperty(PROP_INCIDENCE_URI, uri);
-    debugRequest(request, data);
-    connect(reply, SIGNAL(finished()), this, SLOT(requestFinished()));
-    connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
-            this, SLOT(slotSslErrors(QList<QSslError>)));
+    send(request, data, uri);
 }
 
-void Put::requestFinished()
+void Put::handleReply(QNetworkReply *reply)
 {
     FUNCTION_CALL_TRACE;
 
-    if (wasDeleted()) {
-        LOG_DEBUG(command() << "request was aborted");
-        return;
-    }
-
-    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (!reply) {
-        finishedWithInternalError(QString(), "Internal error: PUT request finished but null");
-        return;
-    }
     reply->deleteLater();
 
     LOG_DEBUG("PUT request finished:" << reply->error());
@@ -113,7 +97,7 @@ void Put::requestFinished()
     }
     mLocalUriList.remove(uri);
 
-    finishedWithReplyResult(uri, reply->error());
+    finishedWithReplyResult(uri, reply);
 }
 
 QString Put::updatedETag(const QString &uri) const
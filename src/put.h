@@ -41,13 +41,13 @@ class Put : public Request
 public:
     explicit Put(QNetworkAccessManager *manager, Settings *settings, QObject *parent = 0);
 
-    void sendIcalData(const QString &uri, const QString &icalData,
+    void sendIcalData(const QString &uri, const QByteArray &icalData,
                       const QString &eTag = QString());
 
     QString updatedETag(const QString &uri) const;
 
-private Q_SLOTS:
-    void requestFinished();
+protected:
+    void handleReply(QNetworkReply *reply) override;
 
 private:
     QSet<QString> mLocalUriList;
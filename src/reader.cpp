@@ -42,46 +42,39 @@ namespace {
     * in the XML stream, so we need to fix any issues.
     * Note that this can cause line-lengths to exceed the spec (due to
     * & -> &amp; expansion etc) but our iCal parser is more robust than
-    * our XML parser, so this works. */
-    QByteArray xmlSanitiseIcsData(const QByteArray &data) {
-        QList<QByteArray> lines = data.split('\n');
-        int depth = 0;
-        bool inCData = false;
-        QByteArray retn;
-        retn.reserve(data.size());
-        for (QList<QByteArray>::const_iterator it = lines.constBegin(); it != lines.constEnd(); it++) {
-            QByteArray line = *it;
-            if (line.contains("BEGIN:VCALENDAR")) {
-                depth += 1;
-                inCData = line.contains("<![CDATA[");
-            } else if (line.contains("END:VCALENDAR")) {
-                depth -= 1;
-                inCData = false;
-            } else if (depth > 0 && !inCData) {
-                // We're inside a VCALENDAR/ics block.
-                // First, hack to turn sanitised input into malformed input:
-                line.replace("&amp;",  "&");
-                line.replace("&quot;", "\"");
-                line.replace("&apos;", "'");
-                line.replace("&lt;",   "<");
-                line.replace("&gt;",   ">");
-                // Then, fix for malformed input:
-                QString lineStr(line);
-                // RegExp should avoid escaping & when this character is starting
-                // a valid numeric character reference (decimal or hexadecimal).
-                // Other HTLML entities like &nbsp; seems to make iCal parser
-                // fails, so we're encoding them.
-                lineStr.replace(QRegExp("&(?!#[0-9]+;|#x[0-9A-Fa-f]+;)"), "&amp;");
-                line = lineStr.toUtf8();
-                line.replace('"',  "&quot;");
-                line.replace('\'', "&apos;");
-                line.replace('<',  "&lt;");
-                line.replace('>',  "&gt;");
-            }
-            retn.append(line);
-            retn.append('\n');
+    * our XML parser, so this works.
+    * The data is sanitised line by line, the state being kept between
+    * the lines of a response received in several chunks. */
+    QByteArray xmlSanitiseIcsLine(const QByteArray &data, int *depth, bool *inCData) {
+        QByteArray line = data;
+        if (line.contains("BEGIN:VCALENDAR")) {
+            *depth += 1;
+            *inCData = line.contains("<![CDATA[");
+        } else if (line.contains("END:VCALENDAR")) {
+            *depth -= 1;
+            *inCData = false;
+        } else if (*depth > 0 && !*inCData) {
+            // We're inside a VCALENDAR/ics block.
+            // First, hack to turn sanitised input into malformed input:
+            line.replace("&amp;",  "&");
+            line.replace("&quot;", "\"");
+            line.replace("&apos;", "'");
+            line.replace("&lt;",   "<");
+            line.replace("&gt;",   ">");
+            // Then, fix for malformed input:
+            QString lineStr(line);
+            // RegExp should avoid escaping & when this character is starting
+            // a valid numeric character reference (decimal or hexadecimal).
+            // Other HTLML entities like &nbsp; seems to make iCal parser
+            // fails, so we're encoding them.
+            lineStr.replace(QRegExp("&(?!#[0-9]+;|#x[0-9A-Fa-f]+;)"), "&amp;");
+            line = lineStr.toUtf8();
+            line.replace('"',  "&quot;");
+            line.replace('\'', "&apos;");
+            line.replace('<',  "&lt;");
+            line.replace('>',  "&gt;");
         }
-        return retn;
+        return line;
     }
 
     QString ensureUidInVEvent(const QString &data) {
@@ -151,6 +144,12 @@ Reader::Reader(QObject *parent)
     : QObject(parent)
     , mReader(0)
     , mValidResponse(false)
+    , mParseICalData(true)
+    , mICalDepth(0)
+    , mInCData(false)
+    , mInResponse(false)
+    , mField(NoField)
+    , mFieldDepth(0)
 {
 }
 
@@ -162,13 +161,61 @@ Reader::~Reader()
 void Reader::read(const QByteArray &data)
 {
     delete mReader;
-    mReader = new QXmlStreamReader(xmlSanitiseIcsData(data));
-    while (mReader->readNextStartElement()) {
-        if (mReader->name() == "multistatus") {
-            mValidResponse = true;
-            readMultiStatus();
-        }
+    mReader = 0;
+    addData(data);
+    finish();
+}
+
+// Reads the complete lines of data, the incomplete last one
+// is kept until the next chunk or the end of the response.
+void Reader::addData(const QByteArray &data)
+{
+    if (!mReader) {
+        mReader = new QXmlStreamReader;
+        mPendingLine.clear();
+        mICalDepth = 0;
+        mInCData = false;
+        mElements.clear();
+        mInResponse = false;
+        mField = NoField;
+    } else if (mReader->hasError() && mReader->error() != QXmlStreamReader::PrematureEndOfDocumentError) {
+        // Malformed XML, the rest of the data cannot be read.
+        return;
+    }
+    mPendingLine += data;
+    const int end = mPendingLine.lastIndexOf('\n');
+    if (end < 0) {
+        return;
     }
+    QByteArray sanitised;
+    sanitised.reserve(end + 1);
+    int start = 0;
+    while (start <= end) {
+        const int eol = mPendingLine.indexOf('\n', start);
+        sanitised += xmlSanitiseIcsLine(mPendingLine.mid(start, eol - start), &mICalDepth, &mInCData);
+        sanitised += '\n';
+        start = eol + 1;
+    }
+    mPendingLine.remove(0, end + 1);
+    mReader->addData(sanitised);
+    readTokens();
+}
+
+void Reader::finish()
+{
+    if (!mReader) {
+        mReader = new QXmlStreamReader;
+    }
+    mReader->addData(xmlSanitiseIcsLine(mPendingLine, &mICalDepth, &mInCData) + '\n');
+    mPendingLine.clear();
+    readTokens();
+}
+
+// Responses without calendar data parsing are cheaper to read,
+// the data being parsed later, or in another thread.
+void Reader::setParseICalData(bool parse)
+{
+    mParseICalData = parse;
 }
 
 bool Reader::hasError() const
@@ -184,116 +231,188 @@ const QList<Reader::CalendarResource>& Reader::results() const
     return mResults;
 }
 
-void Reader::readMultiStatus()
+// The responses read so far, to not keep them all in memory.
+QList<Reader::CalendarResource> Reader::takeResults()
 {
-    while (mReader->readNextStartElement()) {
-        if (mReader->name() == "response") {
-            readResponse();
-        } else {
-            mReader->skipCurrentElement();
+    QList<CalendarResource> results;
+    results.swap(mResults);
+    return results;
+}
+
+void Reader::readTokens()
+{
+    while (!mReader->atEnd()) {
+        switch (mReader->readNext()) {
+        case QXmlStreamReader::StartElement:
+            startElement();
+            break;
+        case QXmlStreamReader::EndElement:
+            endElement();
+            break;
+        case QXmlStreamReader::Characters:
+        case QXmlStreamReader::EntityReference:
+            if (mField != NoField) {
+                mText += mReader->text();
+            }
+            break;
+        default:
+            break;
         }
     }
+    if (mReader->hasError() && mReader->error() != QXmlStreamReader::PrematureEndOfDocumentError) {
+        LOG_WARNING("Invalid XML in response:" << mReader->errorString());
+    }
 }
 
-void Reader::readResponse()
+void Reader::startElement()
 {
-    CalendarResource resource;
-    while (mReader->readNextStartElement()) {
-        if (mReader->name() == "href") {
-            resource.href = QUrl::fromPercentEncoding(mReader->readElementText().toLatin1());
-        } else if (mReader->name() == "propstat") {
-            readPropStat(resource);
-        } else {
-            mReader->skipCurrentElement();
-        }
+    const QString parent = mElements.isEmpty() ? QString() : mElements.last();
+    mElements.append(mReader->name().toString());
+    if (mField != NoField) {
+        // The text of children is part of the calendar data.
+        return;
     }
-    if (resource.href.isEmpty()) {
-        LOG_WARNING("Ignoring received calendar object data, is missing href value");
+
+    const QStringRef name = mReader->name();
+    if (name == "multistatus") {
+        mValidResponse = true;
+    } else if (name == "response" && parent == QStringLiteral("multistatus")) {
+        mResource = CalendarResource();
+        mResource.contentLength = -1;
+        mInResponse = true;
+    } else if (!mInResponse) {
         return;
+    } else if (name == "href" && parent == QStringLiteral("response")) {
+        mField = Href;
+    } else if (name == "status" && parent == QStringLiteral("propstat")) {
+        mField = Status;
+    } else if (parent == QStringLiteral("prop")) {
+        if (name == "getetag") {
+            mField = ETag;
+        } else if (name == "calendar-data") {
+            mField = CalendarData;
+        } else if (name == "getcontentlength") {
+            mField = ContentLength;
+        }
     }
-    if (!resource.iCalData.trimmed().isEmpty()) {
-        bool parsed = true;
-        QString icsData = preprocessIcsData(resource.iCalData);
-        KCalendarCore::ICalFormat iCalFormat;
-        KCalendarCore::MemoryCalendar::Ptr cal(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
-        if (!iCalFormat.fromString(cal, icsData)) {
-            if (iCalFormat.exception() && iCalFormat.exception()->code()
-                == KCalendarCore::Exception::CalVersion1) {
-                KCalendarCore::VCalFormat vCalFormat;
-                if (!vCalFormat.fromString(cal, icsData)) {
-                    LOG_WARNING("unable to parse vCal data");
-                    parsed = false;
-                }
-            } else if (iCalFormat.exception()
-                       && (iCalFormat.exception()->code()
-                           == KCalendarCore::Exception::CalVersionUnknown
-                           || iCalFormat.exception()->code()
-                           == KCalendarCore::Exception::VersionPropertyMissing)) {
-                iCalFormat.setException(0);
-                LOG_WARNING("unknown or missing version, trying iCal 2.0");
-                icsData = ensureICalVersion(icsData);
-                if (!iCalFormat.fromString(cal, icsData)) {
-                    LOG_WARNING("unable to parse iCal data, returning" << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1));
-                    parsed = false;
-                }
-            } else {
-                LOG_WARNING("unable to parse iCal data, returning" << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1));
-                parsed = false;
+    if (mField != NoField) {
+        mFieldDepth = mElements.count();
+        mText.clear();
+    }
+}
+
+void Reader::endElement()
+{
+    if (mField != NoField && mElements.count() == mFieldDepth) {
+        switch (mField) {
+        case Href:
+            mResource.href = QUrl::fromPercentEncoding(mText.toLatin1());
+            break;
+        case Status:
+            mResource.status = mText;
+            break;
+        case ETag:
+            mResource.etag = mText;
+            break;
+        case ContentLength: {
+            bool ok = false;
+            const qint64 length = mText.trimmed().toLongLong(&ok);
+            if (ok) {
+                mResource.contentLength = length;
             }
+            break;
         }
-        if (parsed) {
-            const KCalendarCore::Incidence::List incidences = cal->incidences();
-            LOG_DEBUG("iCal data contains" << incidences.count() << " incidences");
-            if (incidences.count()) {
-                QString uid = incidences.first()->uid();
-                // In case of more than one incidence, it contains some
-                // recurring event information, with exception / RECURRENCE-ID defined.
-                for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
-                    if (incidence->uid() != uid) {
-                        LOG_WARNING("iCal data contains invalid incidences with conflicting uids");
-                        uid.clear();
-                        break;
-                    }
-                }
-                if (!uid.isEmpty()) {
-                    for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
-                        if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent
-                            || incidence->type() == KCalendarCore::IncidenceBase::TypeTodo)
-                            resource.incidences.append(incidence);
-                    }
-                }
-                LOG_DEBUG("parsed" << resource.incidences.count() << "events or todos from the iCal data");
-            } else {
-                LOG_WARNING("iCal data doesn't contain a valid incidence");
-            }
+        case CalendarData:
+            mResource.iCalData = mText;
+            break;
+        default:
+            break;
         }
+        mField = NoField;
+        mText.clear();
+    }
+    if (mInResponse && mElements.count() >= 2
+        && mElements.last() == QStringLiteral("response")
+        && mElements.at(mElements.count() - 2) == QStringLiteral("multistatus")) {
+        endResponse();
+    }
+    if (!mElements.isEmpty()) {
+        mElements.removeLast();
     }
-
-    mResults.append(resource);
 }
 
-void Reader::readPropStat(CalendarResource &resource)
+void Reader::endResponse()
 {
-    while (mReader->readNextStartElement()) {
-        if (mReader->name() == "prop") {
-            readProp(resource);
-        } else if (mReader->name() == "status") {
-            resource.status = mReader->readElementText();
-        } else {
-            mReader->skipCurrentElement();
-        }
+    mInResponse = false;
+    if (mResource.href.isEmpty()) {
+        LOG_WARNING("Ignoring received calendar object data, is missing href value");
+        return;
     }
+    if (mParseICalData && !mResource.iCalData.trimmed().isEmpty()) {
+        mResource.incidences = readICalData(mResource.iCalData);
+    }
+
+    mResults.append(mResource);
+    mResource = CalendarResource();
 }
 
-void Reader::readProp(CalendarResource &resource)
+KCalendarCore::Incidence::List Reader::readICalData(const QString &iCalData)
 {
-    while (mReader->readNextStartElement()) {
-        if (mReader->name() == "getetag") {
-            resource.etag = mReader->readElementText();
-        } else if (mReader->name() == "calendar-data") {
-            resource.iCalData = mReader->readElementText(QXmlStreamReader::IncludeChildElements);
+    KCalendarCore::Incidence::List result;
+    bool parsed = true;
+    QString icsData = preprocessIcsData(iCalData);
+    KCalendarCore::ICalFormat iCalFormat;
+    KCalendarCore::MemoryCalendar::Ptr cal(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+    if (!iCalFormat.fromString(cal, icsData)) {
+        if (iCalFormat.exception() && iCalFormat.exception()->code()
+            == KCalendarCore::Exception::CalVersion1) {
+            KCalendarCore::VCalFormat vCalFormat;
+            if (!vCalFormat.fromString(cal, icsData)) {
+                LOG_WARNING("unable to parse vCal data");
+                parsed = false;
+            }
+        } else if (iCalFormat.exception()
+                   && (iCalFormat.exception()->code()
+                       == KCalendarCore::Exception::CalVersionUnknown
+                       || iCalFormat.exception()->code()
+                       == KCalendarCore::Exception::VersionPropertyMissing)) {
+            iCalFormat.setException(0);
+            LOG_WARNING("unknown or missing version, trying iCal 2.0");
+            icsData = ensureICalVersion(icsData);
+            if (!iCalFormat.fromString(cal, icsData)) {
+                LOG_WARNING("unable to parse iCal data, returning" << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1));
+                parsed = false;
+            }
+        } else {
+            LOG_WARNING("unable to parse iCal data, returning" << (iCalFormat.exception() ? iCalFormat.exception()->code() : -1));
+            parsed = false;
+        }
+    }
+    if (parsed) {
+        const KCalendarCore::Incidence::List incidences = cal->incidences();
+        LOG_DEBUG("iCal data contains" << incidences.count() << " incidences");
+        if (incidences.count()) {
+            QString uid = incidences.first()->uid();
+            // In case of more than one incidence, it contains some
+            // recurring event information, with exception / RECURRENCE-ID defined.
+            for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+                if (incidence->uid() != uid) {
+                    LOG_WARNING("iCal data contains invalid incidences with conflicting uids");
+                    uid.clear();
+                    break;
+                }
+            }
+            if (!uid.isEmpty()) {
+                for (const KCalendarCore::Incidence::Ptr &incidence : incidences) {
+                    if (incidence->type() == KCalendarCore::IncidenceBase::TypeEvent
+                        || incidence->type() == KCalendarCore::IncidenceBase::TypeTodo)
+                        result.append(incidence);
+                }
+            }
+            LOG_DEBUG("parsed" << result.count() << "events or todos from the iCal data");
         } else {
-            mReader->skipCurrentElement();
+            LOG_WARNING("iCal data doesn't contain a valid incidence");
         }
     }
+    return result;
 }
@@ -25,6 +25,7 @@
 #define READER_H
 
 #include <QObject>
+#include <QStringList>
 
 #include <KCalendarCore/Incidence>
 
@@ -40,25 +41,53 @@ public:
         QString status;
         QString iCalData;
         KCalendarCore::Incidence::List incidences;
+        qint64 contentLength = -1; // when not given by the server.
     };
 
     explicit Reader(QObject *parent = 0);
     ~Reader();
 
     void read(const QByteArray &data);
+    void addData(const QByteArray &data);
+    void finish();
+    void setParseICalData(bool parse);
     bool hasError() const;
     const QList<CalendarResource>& results() const;
+    QList<CalendarResource> takeResults();
+
+    static KCalendarCore::Incidence::List readICalData(const QString &iCalData);
 
 private:
-    void readMultiStatus();
-    void readResponse();
-    void readPropStat(CalendarResource &resource);
-    void readProp(CalendarResource &resource);
+    enum Field {
+        NoField,
+        Href,
+        Status,
+        ETag,
+        ContentLength,
+        CalendarData
+    };
+
+    void readTokens();
+    void startElement();
+    void endElement();
+    void endResponse();
 
 private:
     QXmlStreamReader *mReader;
     bool mValidResponse;
+    bool mParseICalData;
     QList<CalendarResource> mResults;
+
+    // State kept between chunks of data.
+    QByteArray mPendingLine; // not yet terminated by a new line.
+    int mICalDepth;
+    bool mInCData;
+    QStringList mElements; // local names of the open elements.
+    bool mInResponse;
+    CalendarResource mResource;
+    Field mField;
+    int mFieldDepth;
+    QString mText;
 };
 
 #endif // READER_H
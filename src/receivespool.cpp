@@ -0,0 +1,205 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "receivespool.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+
+#include <LogMacros.h>
+
+namespace {
+    // Counts the events and todos of iCal data without parsing it,
+    // the resources being spooled before their data is parsed.
+    void countComponents(const QString &iCalData, int *count, bool *hasBase)
+    {
+        *count = 0;
+        *hasBase = false;
+        bool inComponent = false;
+        bool isException = false;
+        for (const QStringRef &line : iCalData.splitRef(QLatin1Char('\n'))) {
+            if (line.startsWith(QLatin1String("BEGIN:VEVENT"))
+                || line.startsWith(QLatin1String("BEGIN:VTODO"))) {
+                inComponent = true;
+                isException = false;
+            } else if (inComponent && (line.startsWith(QLatin1String("END:VEVENT"))
+                                       || line.startsWith(QLatin1String("END:VTODO")))) {
+                inComponent = false;
+                *count += 1;
+                if (!isException) {
+                    *hasBase = true;
+                }
+            } else if (inComponent && line.startsWith(QLatin1String("RECURRENCE-ID"))) {
+                isException = true;
+            }
+        }
+    }
+}
+
+ReceiveSpool::ReceiveSpool(const QString &fileName)
+    : mFileName(fileName)
+    , mSize(0)
+    , mMapping(0)
+    , mMappingSize(0)
+{
+}
+
+ReceiveSpool::~ReceiveSpool()
+{
+    clear();
+}
+
+bool ReceiveSpool::append(const Reader::CalendarResource &resource)
+{
+    if (!mFile.isOpen()) {
+        QDir().mkpath(QFileInfo(mFileName).absolutePath());
+        mFile.setFileName(mFileName);
+        if (!mFile.open(QIODevice::ReadWrite | QIODevice::Truncate)) {
+            LOG_WARNING("Cannot open receive spool" << mFileName << ":" << mFile.errorString());
+            return false;
+        }
+        mSize = 0;
+    }
+
+    const QByteArray data = resource.iCalData.toUtf8();
+    if (!mFile.seek(mSize) || mFile.write(data) != data.size()) {
+        LOG_WARNING("Cannot write to receive spool" << mFileName << ":" << mFile.errorString());
+        return false;
+    }
+
+    Entry entry;
+    entry.href = resource.href;
+    entry.etag = resource.etag;
+    entry.status = resource.status;
+    entry.offset = mSize;
+    entry.length = data.size();
+    countComponents(resource.iCalData, &entry.incidenceCount, &entry.hasBaseIncidence);
+    mEntries.append(entry);
+    mSize += data.size();
+
+    return true;
+}
+
+bool ReceiveSpool::resource(int index, Reader::CalendarResource *resource)
+{
+    if (index < 0 || index >= mEntries.count() || !resource) {
+        return false;
+    }
+
+    const Entry &entry = mEntries.at(index);
+    if (entry.length > 0 && entry.offset + entry.length > mMappingSize && !map()) {
+        return false;
+    }
+
+    resource->href = entry.href;
+    resource->etag = entry.etag;
+    resource->status = entry.status;
+    resource->contentLength = entry.length;
+    resource->iCalData.clear();
+    resource->incidences.clear();
+    if (entry.length > 0) {
+        resource->iCalData = QString::fromUtf8(reinterpret_cast<const char*>(mMapping + entry.offset),
+                                               entry.length);
+        if (!resource->iCalData.trimmed().isEmpty()) {
+            resource->incidences = Reader::readICalData(resource->iCalData);
+        }
+    }
+    if (resource->incidences.count() != entry.incidenceCount) {
+        LOG_WARNING("Spooled resource" << entry.href << "parsed to a different number of incidences.");
+    }
+
+    return true;
+}
+
+void ReceiveSpool::clear()
+{
+    unmap();
+    if (mFile.isOpen()) {
+        mFile.close();
+        mFile.remove();
+    }
+    mEntries.clear();
+    mSize = 0;
+}
+
+// The last entry received for each href, in the order they were
+// received. A resource is spooled again when its request is retried.
+QList<int> ReceiveSpool::latestEntries() const
+{
+    QHash<QString, int> latest;
+    for (int i = 0; i < mEntries.count(); ++i) {
+        latest.insert(mEntries[i].href, i);
+    }
+    QList<int> indexes;
+    for (int i = 0; i < mEntries.count(); ++i) {
+        if (latest.value(mEntries[i].href) == i) {
+            indexes.append(i);
+        }
+    }
+    return indexes;
+}
+
+int ReceiveSpool::count() const
+{
+    return mEntries.count();
+}
+
+const QList<ReceiveSpool::Entry>& ReceiveSpool::entries() const
+{
+    return mEntries;
+}
+
+qint64 ReceiveSpool::size() const
+{
+    return mSize;
+}
+
+const QString& ReceiveSpool::fileName() const
+{
+    return mFileName;
+}
+
+bool ReceiveSpool::map()
+{
+    unmap();
+    if (!mFile.isOpen() || !mFile.flush()) {
+        return false;
+    }
+    if (mSize > 0) {
+        mMapping = mFile.map(0, mSize);
+        if (!mMapping) {
+            LOG_WARNING("Cannot map receive spool" << mFileName << ":" << mFile.errorString());
+            return false;
+        }
+        mMappingSize = mSize;
+    }
+    return true;
+}
+
+void ReceiveSpool::unmap()
+{
+    if (mMapping) {
+        mFile.unmap(mMapping);
+        mMapping = 0;
+        mMappingSize = 0;
+    }
+}
@@ -0,0 +1,72 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef RECEIVESPOOL_H
+#define RECEIVESPOOL_H
+
+#include "reader.h"
+
+#include <QFile>
+#include <QList>
+
+// Stores received calendar resources in a file, keeping
+// only a small index in memory. The raw iCal data are written
+// in UTF-8 as they are received and read back through a memory
+// mapping of the file, incidences being parsed only on demand.
+class ReceiveSpool
+{
+public:
+    struct Entry {
+        QString href;
+        QString etag;
+        QString status;
+        qint64 offset;
+        qint64 length;
+        int incidenceCount;
+        bool hasBaseIncidence;
+    };
+
+    explicit ReceiveSpool(const QString &fileName);
+    ~ReceiveSpool();
+
+    bool append(const Reader::CalendarResource &resource);
+    bool resource(int index, Reader::CalendarResource *resource);
+    void clear();
+
+    int count() const;
+    const QList<Entry>& entries() const;
+    QList<int> latestEntries() const;
+    qint64 size() const;
+    const QString& fileName() const;
+
+private:
+    bool map();
+    void unmap();
+
+    QFile mFile;
+    QString mFileName;
+    QList<Entry> mEntries;
+    qint64 mSize;
+    uchar *mMapping;
+    qint64 mMappingSize;
+};
+
+#endif // RECEIVESPOOL_H
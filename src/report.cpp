@@ -25,11 +25,17 @@
 #include "report.h"
 #include "reader.h"
 #include "settings.h"
+#include "receivespool.h"
+#include "requestscheduler.h"
+#include "tracer.h"
 
 #include <QNetworkAccessManager>
-#include <QBuffer>
 #include <QDebug>
 #include <QStringList>
+#include <QThread>
+#include <QThreadPool>
+#include <QFutureWatcher>
+#include <QtConcurrent/QtConcurrentRun>
 
 #include <LogMacros.h>
 
@@ -38,6 +44,22 @@
 static const QString DateTimeFormat = QStringLiteral("yyyyMMddTHHmmss");
 static const QString DateTimeFormatUTC = DateTimeFormat + QStringLiteral("Z");
 
+// Responses are parsed out of the event loop serving the sockets,
+// by a couple of threads only, to leave CPU to the rest of the sync.
+class ParserPool : public QThreadPool
+{
+public:
+    ParserPool()
+    {
+        setMaxThreadCount(qBound(1, QThread::idealThreadCount() - 1, 2));
+    }
+};
+Q_GLOBAL_STATIC(ParserPool, parserPool)
+
+// Responses are read as they arrive, at most this much
+// being buffered by the network stack.
+static const qint64 READ_BUFFER_SIZE = 64 * 1024;
+
 static QString dateTimeToString(const QDateTime &dt)
 {
     if (dt.timeSpec() == Qt::UTC) {
@@ -66,10 +88,23 @@ static QByteArray timeRangeFilterXml(const QDateTime &fromDateTime, const QDateT
 
 Report::Report(QNetworkAccessManager *manager, Settings *settings, QObject *parent)
     : Request(manager, settings, "REPORT", parent)
+    , mSpool(0)
+    , mReceivedDataSize(0)
+    , mBodySize(0)
+    , mSpooledCount(0)
+    , mParsing(false)
 {
     FUNCTION_CALL_TRACE;
 }
 
+Report::~Report()
+{
+    if (mParsing) {
+        // The parse result is dropped, give back its place in the backlog.
+        RequestScheduler::instance(mNAManager)->parseFinished();
+    }
+}
+
 void Report::getAllEvents(const QString &remoteCalendarPath, const QDateTime &fromDateTime, const QDateTime &toDateTime)
 {
     FUNCTION_CALL_TRACE;
@@ -95,6 +130,10 @@ void Report::sendCalendarQuery(const QString &remoteCalendarPath,
     if (getCalendarData) {
         requestData += \
                     "<c:calendar-data />";
+    } else if (mSettings->lowDataMode()) {
+        // Size hints, to leave large resources for later.
+        requestData += \
+                    "<d:getcontentlength />";
     }
     requestData += \
                 "</d:prop>"
@@ -131,6 +170,27 @@ void Report::multiGetEvents(const QString &remoteCalendarPath, const QStringList
     mFetchedUris = eventHrefList;
 }
 
+void Report::multiGetETags(const QString &remoteCalendarPath, const QStringList &eventHrefList)
+{
+    FUNCTION_CALL_TRACE;
+    if (eventHrefList.isEmpty()) {
+        return;
+    }
+
+    QByteArray requestData = "<c:calendar-multiget xmlns:d=\"DAV:\" xmlns:c=\"urn:ietf:params:xml:ns:caldav\">" \
+                             "<d:prop><d:getetag /></d:prop>";
+    for (const QString &eventHref : eventHrefList) {
+        requestData.append("<d:href>");
+        requestData.append(eventHref.toUtf8());
+        requestData.append("</d:href>");
+    }
+    requestData.append("</c:calendar-multiget>");
+
+    sendRequest(remoteCalendarPath, requestData);
+
+    mFetchedUris = eventHrefList;
+}
+
 void Report::sendRequest(const QString &remoteCalendarPath, const QByteArray &requestData)
 {
     FUNCTION_CALL_TRACE;
@@ -142,38 +202,86 @@ void Report::sendRequest(const QString &remoteCalendarPath, const QByteArray &re
     request.setRawHeader("Prefer", "return-minimal");
     request.setHeader(QNetworkRequest::ContentLengthHeader, requestData.length());
     request.setHeader(QNetworkRequest::ContentTypeHeader, "application/xml; charset=utf-8");
-    QBuffer *buffer = new QBuffer(this);
-    buffer->setData(requestData);
-    // TODO: when Qt5.8 is available, remove the use of buffer, and pass requestData directly.
-    QNetworkReply *reply = mNAManager->sendCustomRequest(request, REQUEST_TYPE.toLatin1(), buffer);
-    reply->setProperty(PROP_URI, remoteCalendarPath);
-    debugRequest(request, buffer->buffer());
-    connect(reply, SIGNAL(finished()), this, SLOT(processResponse()));
-    connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
-            this, SLOT(slotSslErrors(QList<QSslError>)));
+    send(request, requestData, remoteCalendarPath);
 }
 
-void Report::processResponse()
+// Above the receive buffer size, the calendar data are written to
+// the spool while they are read, instead of being kept in memory.
+void Report::setSpool(ReceiveSpool *spool)
 {
-    FUNCTION_CALL_TRACE;
+    mSpool = spool;
+}
 
-    LOG_DEBUG("Process REPORT response for server path" << mRemoteCalendarPath);
+// Each attempt is read from the start. Resources already spooled by
+// a failed attempt are spooled again, the last entry being the one used.
+void Report::replyStarted(QNetworkReply *reply)
+{
+    mReader.reset(new Reader);
+    mReader->setParseICalData(false);
+    mReceivedResources.clear();
+    mReceivedDataSize = 0;
+    mBodySize = 0;
+    mErrorData.clear();
+    mSpooledCount = 0;
+    reply->setReadBufferSize(READ_BUFFER_SIZE);
+    connect(reply, &QNetworkReply::readyRead, this, [this, reply] {
+        readReply(reply);
+    });
+}
 
-    if (wasDeleted()) {
-        LOG_DEBUG("REPORT request was aborted");
+void Report::readReply(QNetworkReply *reply)
+{
+    const QByteArray data = reply->readAll();
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (reply->error() != QNetworkReply::NoError || status > 299) {
+        // Kept for debugging only.
+        mErrorData += data.left(int(READ_BUFFER_SIZE) - mErrorData.size());
+        return;
+    }
+    if (data.isEmpty()) {
         return;
     }
+    debugReplyData(data);
+    mBodySize += data.size();
+    mReader->addData(data);
+    keepResources(mReader->takeResults());
+}
+
+void Report::keepResources(const QList<Reader::CalendarResource> &resources)
+{
+    for (const Reader::CalendarResource &resource : resources) {
+        mReceivedResources.append(resource);
+        mReceivedDataSize += resource.iCalData.size() * sizeof(QChar);
+    }
 
-    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
-    if (!reply) {
-        finishedWithInternalError(QString());
+    const qint64 bufferSize = mSettings->receiveBufferSize();
+    if (!mSpool || bufferSize <= 0 || mReceivedDataSize <= bufferSize) {
         return;
     }
+    QList<Reader::CalendarResource>::Iterator it = mReceivedResources.begin();
+    while (it != mReceivedResources.end()) {
+        if (!mSpool->append(*it)) {
+            LOG_WARNING("Cannot spool received resource" << it->href << ", keeping the next ones in memory.");
+            mSpool = 0;
+            break;
+        }
+        mReceivedDataSize -= it->iCalData.size() * sizeof(QChar);
+        mSpooledCount += 1;
+        it = mReceivedResources.erase(it);
+    }
+}
+
+void Report::handleReply(QNetworkReply *reply)
+{
+    FUNCTION_CALL_TRACE;
+
+    LOG_DEBUG("Process REPORT response for server path" << mRemoteCalendarPath);
+
     reply->deleteLater();
     const QString &uri = reply->property(PROP_URI).toString();
     if (reply->error() != QNetworkReply::NoError) {
-        debugReplyAndReadAll(reply);
-        finishedWithReplyResult(uri, reply->error());
+        debugReply(*reply, mErrorData + reply->readAll());
+        finishedWithReplyResult(uri, reply);
         return;
     }
     QVariant statusCode = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute);
@@ -186,21 +294,45 @@ void Report::processResponse()
         }
     }
 
-    QByteArray data = reply->readAll();
-    debugReply(*reply, data);
+    // The last chunk may not have been signalled yet.
+    readReply(reply);
+    debugReply(*reply, QByteArray());
+    if (!mBodySize) {
+        finishedWithError(uri, Buteo::SyncResults::INTERNAL_ERROR, QString("Empty response body for REPORT"));
+        return;
+    }
+    mReader->finish();
+    keepResources(mReader->takeResults());
+    if (mReader->hasError()) {
+        finishedWithError(uri, Buteo::SyncResults::INTERNAL_ERROR, QString("Malformed response body for REPORT"));
+        return;
+    }
 
-    if (!data.isNull() && !data.isEmpty()) {
-        Reader reader;
-        reader.read(data);
-        if (reader.hasError()) {
-            finishedWithError(uri, Buteo::SyncResults::INTERNAL_ERROR, QString("Malformed response body for REPORT"));
-        } else {
-            mReceivedResources = reader.results();
-            finishedWithSuccess(uri);
+    // The calendar data kept in memory are parsed out of the event loop,
+    // the spooled ones are only parsed when written to the database.
+    RequestScheduler::instance(mNAManager)->parseStarted();
+    mParsing = true;
+    QFutureWatcher<QList<Reader::CalendarResource> > *watcher
+        = new QFutureWatcher<QList<Reader::CalendarResource> >(this);
+    connect(watcher, &QFutureWatcher<QList<Reader::CalendarResource> >::finished, this, [this, watcher, uri] {
+        watcher->deleteLater();
+        mParsing = false;
+        RequestScheduler::instance(mNAManager)->parseFinished();
+        mReceivedResources = watcher->result();
+        finishedWithSuccess(uri);
+    });
+    watcher->setFuture(QtConcurrent::run(parserPool(), &Report::parse, mReceivedResources));
+}
+
+QList<Reader::CalendarResource> Report::parse(QList<Reader::CalendarResource> resources)
+{
+    TraceSpan span("parse", QStringLiteral("Reader::readICalData"));
+    for (Reader::CalendarResource &resource : resources) {
+        if (!resource.iCalData.trimmed().isEmpty()) {
+            resource.incidences = Reader::readICalData(resource.iCalData);
         }
-    } else {
-        finishedWithError(uri, Buteo::SyncResults::INTERNAL_ERROR, QString("Empty response body for REPORT"));
     }
+    return resources;
 }
 
 const QList<Reader::CalendarResource>& Report::receivedCalendarResources() const
@@ -208,6 +340,12 @@ const QList<Reader::CalendarResource>& Report::receivedCalendarResources() const
     return mReceivedResources;
 }
 
+// Resources written to the spool instead of being received in memory.
+int Report::spooledResources() const
+{
+    return mSpooledCount;
+}
+
 const QStringList& Report::fetchedUris() const
 {
     return mFetchedUris;
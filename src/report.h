@@ -29,9 +29,11 @@
 
 #include <QObject>
 #include <QMultiHash>
+#include <QScopedPointer>
 
 class QNetworkAccessManager;
 class Settings;
+class ReceiveSpool;
 
 class Report : public Request
 {
@@ -39,6 +41,7 @@ class Report : public Request
 
 public:
     explicit Report(QNetworkAccessManager *manager, Settings *settings, QObject *parent = 0);
+    ~Report();
 
     void getAllEvents(const QString &remoteCalendarPath,
                       const QDateTime &fromDateTime = QDateTime(),
@@ -47,14 +50,24 @@ public:
                      const QDateTime &fromDateTime = QDateTime(),
                      const QDateTime &toDateTime = QDateTime());
     void multiGetEvents(const QString &remoteCalendarPath, const QStringList &eventHrefList);
+    void multiGetETags(const QString &remoteCalendarPath, const QStringList &eventHrefList);
+
+    void setSpool(ReceiveSpool *spool);
 
     const QList<Reader::CalendarResource>& receivedCalendarResources() const;
+    int spooledResources() const;
     const QStringList& fetchedUris() const;
 
-private Q_SLOTS:
-    void processResponse();
+protected:
+    void handleReply(QNetworkReply *reply) override;
+    void replyStarted(QNetworkReply *reply) override;
 
 private:
+    static QList<Reader::CalendarResource> parse(QList<Reader::CalendarResource> resources);
+
+    void readReply(QNetworkReply *reply);
+    void keepResources(const QList<Reader::CalendarResource> &resources);
+
     void sendRequest(const QString &remoteCalendarPath, const QByteArray &requestData);
     void sendCalendarQuery(const QString &remoteCalendarPath,
                            const QDateTime &fromDateTime,
@@ -63,6 +76,15 @@ private:
     QString mRemoteCalendarPath;
     QStringList mFetchedUris;
     QList<Reader::CalendarResource> mReceivedResources;
+    QScopedPointer<Reader> mReader;
+    ReceiveSpool *mSpool; // owned by the caller.
+    qint64 mReceivedDataSize; // size of the iCal data in mReceivedResources.
+    qint64 mBodySize;
+    QByteArray mErrorData;
+    int mSpooledCount;
+    bool mParsing;
+
+    friend class tst_NotebookSyncAgent;
 };
 
 #endif // REPORT_H
@@ -22,8 +22,84 @@
  */
 
 #include "request.h"
+#include "requestscheduler.h"
+#include "httptrace.h"
+#include "tracer.h"
+
+#include <QNetworkAccessManager>
+#include <QBuffer>
+#include <QDateTime>
+#include <QLocale>
+#include <QRandomGenerator>
 
 #include <LogMacros.h>
+#include <Logger.h>
+
+#define PROP_URI "uri"
+
+namespace {
+    // LOG_PROTOCOL messages are written at the debug level of the
+    // Buteo logger, the exchanged headers and bodies are only
+    // formatted when they are.
+    bool protocolLogging()
+    {
+        return Buteo::Logger::instance()->enabled(QtDebugMsg);
+    }
+
+    void logProtocolLines(const QString &text)
+    {
+        LOG_PROTOCOL("---------------------------------------------------------------------");
+        const QStringList lines = text.split('\n', QString::SkipEmptyParts);
+        for (QString line : lines) {
+            LOG_PROTOCOL(line.replace('\r', ' '));
+        }
+    }
+
+    const int MAX_RETRIES = 3;
+    const qint64 BASE_RETRY_DELAY = 1000; // ms, doubled at each retry.
+    const qint64 MAX_RETRY_DELAY = 30000;
+    const qint64 MAX_RETRY_AFTER = 120000; // longer delays are not waited for.
+
+    // Failures that may not happen again a bit later.
+    bool isTransient(QNetworkReply::NetworkError error, int status)
+    {
+        if (status == 429 || status == 502 || status == 503 || status == 504) {
+            return true;
+        }
+        switch (error) {
+        case QNetworkReply::RemoteHostClosedError:
+        case QNetworkReply::TemporaryNetworkFailureError:
+        case QNetworkReply::NetworkSessionFailedError:
+        case QNetworkReply::ProxyConnectionClosedError:
+        case QNetworkReply::UnknownNetworkError:
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    // Retry-After is either a number of seconds or an HTTP date.
+    // Returns -1 when the header is missing or invalid.
+    qint64 retryAfter(const QNetworkReply &reply)
+    {
+        const QByteArray value = reply.rawHeader("Retry-After").trimmed();
+        if (value.isEmpty()) {
+            return -1;
+        }
+        bool ok = false;
+        const qint64 seconds = value.toLongLong(&ok);
+        if (ok) {
+            return seconds >= 0 ? seconds * 1000 : -1;
+        }
+        QDateTime date = QLocale::c().toDateTime(QString::fromLatin1(value),
+                                                 QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'"));
+        if (!date.isValid()) {
+            return -1;
+        }
+        date.setTimeSpec(Qt::UTC);
+        return qMax(qint64(0), QDateTime::currentDateTimeUtc().msecsTo(date));
+    }
+}
 
 Request::Request(QNetworkAccessManager *manager,
                  Settings *settings,
@@ -34,11 +110,37 @@ Request::Request(QNetworkAccessManager *manager,
     , REQUEST_TYPE(requestType)
     , mSettings(settings)
     , mNetworkError(QNetworkReply::NoError)
+    , mHttpStatus(0)
     , mMinorCode(Buteo::SyncResults::NO_ERROR)
+    , mAttempts(0)
+    , mInactivityTimeout(0)
+    , mTotalTimeout(0)
+    , mTimedOut(false)
+    , mBytesSent(0)
+    , mBytesReceived(0)
+    , mReplyBytes(0)
+    , mQueuedAt(0)
+    , mStartedAt(0)
 {
     FUNCTION_CALL_TRACE;
 
     mSelfPointer = this;
+    mStallTimer.setSingleShot(true);
+    connect(&mStallTimer, &QTimer::timeout, this, &Request::replyStalled);
+}
+
+Request::~Request()
+{
+    if (mReply) {
+        // Give back its slot to the other requests to this host.
+        disconnect(mReply, 0, this, 0);
+        mReply->abort();
+        mReply->deleteLater();
+        RequestScheduler::instance(mNAManager)->replyFinished(host(), command(), -1, 0, false, false);
+    }
+    if (mRejectedReply) {
+        mRejectedReply->deleteLater();
+    }
 }
 
 Buteo::SyncResults::MinorCode Request::errorCode() const
@@ -56,11 +158,280 @@ QNetworkReply::NetworkError Request::networkError() const
     return mNetworkError;
 }
 
+int Request::httpStatus() const
+{
+    return mHttpStatus;
+}
+
+// Totals over all the attempts, the retries included.
+qint64 Request::bytesSent() const
+{
+    return mBytesSent;
+}
+
+qint64 Request::bytesReceived() const
+{
+    return mBytesReceived;
+}
+
 QString Request::command() const
 {
     return REQUEST_TYPE;
 }
 
+QString Request::host() const
+{
+    return mRequest.url().host();
+}
+
+void Request::send(const QNetworkRequest &request, const QByteArray &data, const QString &uri)
+{
+    mRequest = request;
+    mRequestData = data;
+    mRequestUri = uri;
+    mAttempts = 0;
+    mQueuedAt = Tracer::now();
+    RequestScheduler::instance(mNAManager)->schedule(this);
+}
+
+void Request::startReply()
+{
+    mAttempts += 1;
+    mStartedAt = Tracer::now();
+    if (Tracer::isEnabled()) {
+        QVariantMap args;
+        args.insert(QStringLiteral("uri"), mRequestUri);
+        Tracer::addSpan("queue", command(), mQueuedAt, mStartedAt, args);
+    }
+
+    // The token may have been refreshed since the request was prepared.
+    if (mRequest.hasRawHeader("Authorization") && !mSettings->authToken().isEmpty()) {
+        mRequest.setRawHeader("Authorization", "Bearer " + mSettings->authToken().toLatin1());
+    }
+
+    QNetworkReply *reply;
+    if (mRequestData.isEmpty()) {
+        reply = mNAManager->sendCustomRequest(mRequest, REQUEST_TYPE.toLatin1());
+    } else {
+        QBuffer *buffer = new QBuffer;
+        buffer->setData(mRequestData);
+        // TODO: when Qt5.8 is available, remove the use of buffer, and pass the data directly.
+        reply = mNAManager->sendCustomRequest(mRequest, REQUEST_TYPE.toLatin1(), buffer);
+        buffer->setParent(reply);
+    }
+    reply->setProperty(PROP_URI, mRequestUri);
+    mReply = reply;
+    mReplyBytes = 0;
+    mReplyTimer.start();
+    replyStarted(reply);
+    debugRequest(mRequest, mRequestData);
+    connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+    connect(reply, SIGNAL(sslErrors(QList<QSslError>)),
+            this, SLOT(slotSslErrors(QList<QSslError>)));
+    connect(reply, SIGNAL(downloadProgress(qint64, qint64)), this, SLOT(replyDownloadProgress(qint64, qint64)));
+    connect(reply, SIGNAL(uploadProgress(qint64, qint64)), this, SLOT(replyProgress()));
+
+    RequestScheduler *scheduler = RequestScheduler::instance(mNAManager);
+    mInactivityTimeout = scheduler->inactivityTimeout(host(), command());
+    mTotalTimeout = scheduler->totalTimeout(host(), command(), mRequestData.size());
+    mTimedOut = false;
+    armStallTimer();
+}
+
+void Request::armStallTimer()
+{
+    mStallTimer.start(int(stallDelay()));
+}
+
+// The total deadline only bounds the time until the response starts
+// to arrive: the size of a response is not known beforehand, and a
+// large one still being received is not aborted.
+qint64 Request::stallDelay() const
+{
+    if (mReplyBytes > 0) {
+        return mInactivityTimeout;
+    }
+    const qint64 remaining = mTotalTimeout - mReplyTimer.elapsed();
+    return qMax(qint64(0), qMin(mInactivityTimeout, remaining));
+}
+
+void Request::replyProgress()
+{
+    if (mReply) {
+        armStallTimer();
+    }
+}
+
+void Request::replyDownloadProgress(qint64 bytesReceived, qint64 bytesTotal)
+{
+    Q_UNUSED(bytesTotal);
+    if (mReply) {
+        // Counted here, the data may be consumed while it arrives.
+        mReplyBytes = bytesReceived;
+        armStallTimer();
+    }
+}
+
+// Called for each attempt, before any data is received.
+void Request::replyStarted(QNetworkReply *reply)
+{
+    Q_UNUSED(reply);
+}
+
+void Request::replyStalled()
+{
+    if (!mReply) {
+        return;
+    }
+    if (mReplyBytes == 0 && mReplyTimer.elapsed() >= mTotalTimeout) {
+        LOG_WARNING(command() << "request to" << mRequestUri << "not finished after"
+                    << mReplyTimer.elapsed() << "ms, aborting");
+    } else {
+        LOG_WARNING(command() << "request to" << mRequestUri << "stalled for"
+                    << mInactivityTimeout << "ms, aborting");
+    }
+    // The reply finishes with OperationCanceledError, then
+    // goes through the retry path as a timeout.
+    mTimedOut = true;
+    mReply->abort();
+}
+
+void Request::replyFinished()
+{
+    if (wasDeleted()) {
+        LOG_DEBUG(command() << "request was aborted");
+        return;
+    }
+
+    QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
+    if (!reply) {
+        finishedWithInternalError(QString());
+        return;
+    }
+    mReply = 0;
+    mStallTimer.stop();
+    const qint64 received = qMax(mReplyBytes, reply->bytesAvailable());
+    mBytesSent += mRequestData.size();
+    mBytesReceived += received;
+    if (Tracer::isEnabled()) {
+        QVariantMap args;
+        args.insert(QStringLiteral("uri"), mRequestUri);
+        args.insert(QStringLiteral("attempt"), mAttempts);
+        args.insert(QStringLiteral("status"), reply->attribute(QNetworkRequest::HttpStatusCodeAttribute));
+        args.insert(QStringLiteral("error"), int(reply->error()));
+        args.insert(QStringLiteral("bytes"), mRequestData.size() + received);
+        Tracer::addSpan("request", command(), mStartedAt, -1, args);
+    }
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    const QNetworkReply::NetworkError error = reply->error();
+    const bool congested = (mTimedOut || status == 429 || status == 502 || status == 503 || status == 504
+                            || error == QNetworkReply::TimeoutError);
+    RequestScheduler::instance(mNAManager)->replyFinished(host(), command(), mReplyTimer.elapsed(),
+                                                          mRequestData.size() + received,
+                                                          error != QNetworkReply::NoError, congested);
+    if (HttpTrace *trace = HttpTrace::instance(mNAManager)) {
+        trace->record(REQUEST_TYPE.toLatin1(), mRequest, mRequestData.size(),
+                      *reply, received, mReplyTimer.elapsed());
+    }
+    if (authorizationExpired(reply)) {
+        return;
+    }
+    if (retry(reply)) {
+        debugReplyAndReadAll(reply);
+        reply->deleteLater();
+        return;
+    }
+    handleReply(reply);
+}
+
+// A 401 on a bearer token usually means it expired during the sync.
+// The request is sent again once a new token is available, the
+// rejected reply is kept to be handled as usual if none comes.
+bool Request::authorizationExpired(QNetworkReply *reply)
+{
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status != 401 || mSettings->authToken().isEmpty()) {
+        return false;
+    }
+    RequestScheduler *scheduler = RequestScheduler::instance(mNAManager);
+    if (mRequest.rawHeader("Authorization") != "Bearer " + mSettings->authToken().toLatin1()) {
+        // Sent before the token got refreshed by another request.
+        debugReplyAndReadAll(reply);
+        reply->deleteLater();
+        mQueuedAt = Tracer::now();
+        scheduler->schedule(this);
+        return true;
+    }
+    if (!scheduler->waitForToken(this)) {
+        return false;
+    }
+    mRejectedReply = reply;
+    return true;
+}
+
+void Request::replayWithToken(bool refreshed)
+{
+    QNetworkReply *reply = mRejectedReply;
+    mRejectedReply = 0;
+    if (!reply) {
+        return;
+    }
+    if (!refreshed) {
+        handleReply(reply);
+        return;
+    }
+    debugReplyAndReadAll(reply);
+    reply->deleteLater();
+    mQueuedAt = Tracer::now();
+    RequestScheduler::instance(mNAManager)->schedule(this);
+}
+
+// GET, REPORT, PROPFIND and DELETE can be sent again safely.
+// A PUT only with a precondition, to not overwrite a resource
+// that changed since the first attempt.
+bool Request::isIdempotent() const
+{
+    if (REQUEST_TYPE == QStringLiteral("PUT")) {
+        return mRequest.hasRawHeader("If-Match") || mRequest.hasRawHeader("If-None-Match");
+    }
+    return true;
+}
+
+bool Request::retry(QNetworkReply *reply)
+{
+    const int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (!mTimedOut && !isTransient(reply->error(), status)) {
+        return false;
+    }
+    if (mAttempts > MAX_RETRIES || !isIdempotent()) {
+        LOG_WARNING(command() << "request failed with transient error" << reply->error() << status
+                    << "after" << mAttempts << "attempts, not retrying");
+        return false;
+    }
+
+    // Jittered exponential backoff, so clients do not retry all together.
+    const qint64 backoff = qMin(MAX_RETRY_DELAY, BASE_RETRY_DELAY << (mAttempts - 1));
+    qint64 delay = backoff / 2 + QRandomGenerator::global()->bounded(int(backoff / 2 + 1));
+    const qint64 requested = retryAfter(*reply);
+    if (requested > MAX_RETRY_AFTER) {
+        LOG_WARNING(command() << "request asked to retry after" << requested << "ms, not retrying");
+        return false;
+    } else if (requested >= 0) {
+        delay = requested;
+    }
+    // An overloaded server gets no request at all from us for a while,
+    // not only this one.
+    RequestScheduler *scheduler = RequestScheduler::instance(mNAManager);
+    if (status == 429 || status == 503) {
+        scheduler->pause(host(), delay);
+    }
+    LOG_WARNING("Retrying" << command() << "request in" << delay << "ms after error" << reply->error() << status);
+    mQueuedAt = Tracer::now();
+    scheduler->schedule(this, delay);
+
+    return true;
+}
+
 void Request::finishedWithReplyResult(const QString &uri, QNetworkReply::NetworkError error)
 {
     mNetworkError = error;
@@ -84,6 +455,14 @@ void Request::finishedWithReplyResult(const QString &uri, QNetworkReply::Network
     }
 }
 
+void Request::finishedWithReplyResult(const QString &uri, QNetworkReply *reply)
+{
+    // Some statuses like 412 Precondition Failed have no
+    // dedicated QNetworkReply::NetworkError value.
+    mHttpStatus = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    finishedWithReplyResult(uri, reply->error());
+}
+
 void Request::slotSslErrors(QList<QSslError> errors)
 {
     QNetworkReply *reply = qobject_cast<QNetworkReply*>(sender());
@@ -142,40 +521,48 @@ bool Request::wasDeleted() const
 
 void Request::debugRequest(const QNetworkRequest &request, const QByteArray &data)
 {
-    const QStringList lines = debuggingString(request, data).split('\n', QString::SkipEmptyParts);
-    for (QString line : lines) {
-        LOG_PROTOCOL(line.replace('\r', ' '));
+    if (!protocolLogging()) {
+        return;
     }
+    logProtocolLines(debuggingString(request, data));
 }
 
 void Request::debugRequest(const QNetworkRequest &request, const QString &data)
 {
-    const QStringList lines = debuggingString(request, data.toUtf8()).split('\n', QString::SkipEmptyParts);
-    for (QString line : lines) {
-        LOG_PROTOCOL(line.replace('\r', ' '));
+    if (!protocolLogging()) {
+        return;
     }
+    logProtocolLines(debuggingString(request, data.toUtf8()));
 }
 
 void Request::debugReply(const QNetworkReply &reply, const QByteArray &data)
 {
-    const QStringList lines = debuggingString(reply, data).split('\n', QString::SkipEmptyParts);
-    for (QString line : lines) {
-        LOG_PROTOCOL(line.replace('\r', ' '));
+    if (!protocolLogging()) {
+        return;
     }
+    logProtocolLines(debuggingString(reply, data));
 }
 
 void Request::debugReplyAndReadAll(QNetworkReply *reply)
 {
-    const QStringList lines = debuggingString(*reply, reply->readAll()).split('\n', QString::SkipEmptyParts);
-    for (QString line : lines) {
-        LOG_PROTOCOL(line.replace('\r', ' '));
+    if (!protocolLogging()) {
+        return;
+    }
+    logProtocolLines(debuggingString(*reply, reply->readAll()));
+}
+
+// Logs a part of a response body read while it is received.
+void Request::debugReplyData(const QByteArray &data)
+{
+    if (!protocolLogging()) {
+        return;
     }
+    logProtocolLines(QString::fromUtf8(data));
 }
 
 QString Request::debuggingString(const QNetworkRequest &request, const QByteArray &data)
 {
     QStringList text;
-    text += "---------------------------------------------------------------------";
     const QList<QByteArray> &rawHeaderList = request.rawHeaderList();
     for (const QByteArray &rawHeader : rawHeaderList) {
         text += rawHeader + " : " + request.rawHeader(rawHeader);
@@ -192,7 +579,6 @@ QString Request::debuggingString(const QNetworkRequest &request, const QByteArra
 QString Request::debuggingString(const QNetworkReply &reply, const QByteArray &data)
 {
     QStringList text;
-    text += "---------------------------------------------------------------------";
     text += REQUEST_TYPE + " response status code: " + reply.attribute(QNetworkRequest::HttpStatusCodeAttribute).toString();
     const QList<QNetworkReply::RawHeaderPair> headers = reply.rawHeaderPairs();
     text += REQUEST_TYPE + " response headers:";
@@ -31,6 +31,8 @@
 
 #include <QObject>
 #include <QPointer>
+#include <QElapsedTimer>
+#include <QTimer>
 #include <QNetworkReply>
 #include <QSslError>
 #include <QNetworkRequest>
@@ -43,11 +45,16 @@ public:
                      Settings *settings,
                      const QString &requestType,
                      QObject *parent = 0);
+    ~Request();
 
     QString command() const;
+    QString host() const;
     Buteo::SyncResults::MinorCode errorCode() const;
     QString errorString() const;
     QNetworkReply::NetworkError networkError() const;
+    int httpStatus() const;
+    qint64 bytesSent() const;
+    qint64 bytesReceived() const;
 
 Q_SIGNALS:
     void finished(const QString &uri);
@@ -55,8 +62,17 @@ Q_SIGNALS:
 protected Q_SLOTS:
     virtual void slotSslErrors(QList<QSslError>);
 
+private Q_SLOTS:
+    void replyFinished();
+    void replyProgress();
+    void replyDownloadProgress(qint64 bytesReceived, qint64 bytesTotal);
+    void replyStalled();
+
 protected:
     void prepareRequest(QNetworkRequest *request, const QString &requestPath);
+    void send(const QNetworkRequest &request, const QByteArray &data, const QString &uri);
+    virtual void handleReply(QNetworkReply *reply) = 0;
+    virtual void replyStarted(QNetworkReply *reply);
 
     bool wasDeleted() const;
 
@@ -64,11 +80,13 @@ protected:
     void finishedWithError(const QString &uri, Buteo::SyncResults::MinorCode minorCode, const QString &errorString);
     void finishedWithInternalError(const QString &uri, const QString &errorString = QString());
     void finishedWithReplyResult(const QString &uri, QNetworkReply::NetworkError error);
+    void finishedWithReplyResult(const QString &uri, QNetworkReply *reply);
 
     void debugRequest(const QNetworkRequest &request, const QByteArray &data);
     void debugRequest(const QNetworkRequest &request, const QString &data);
     void debugReply(const QNetworkReply &reply, const QByteArray &data);
     void debugReplyAndReadAll(QNetworkReply *reply);
+    void debugReplyData(const QByteArray &data);
 
     QString debuggingString(const QNetworkRequest &request, const QByteArray &data);
     QString debuggingString(const QNetworkReply &reply, const QByteArray &data);
@@ -78,8 +96,38 @@ protected:
     Settings* mSettings;
     QPointer<Request> mSelfPointer;
     QNetworkReply::NetworkError mNetworkError;
+    int mHttpStatus;
     Buteo::SyncResults::MinorCode mMinorCode;
     QString mErrorString;
+
+private:
+    void startReply();
+    bool isIdempotent() const;
+    bool retry(QNetworkReply *reply);
+    void armStallTimer();
+    qint64 stallDelay() const;
+    bool authorizationExpired(QNetworkReply *reply);
+    void replayWithToken(bool refreshed);
+
+    QNetworkRequest mRequest;
+    QByteArray mRequestData;
+    QString mRequestUri;
+    int mAttempts;
+    QPointer<QNetworkReply> mReply;
+    QPointer<QNetworkReply> mRejectedReply; // waiting for a new token.
+    QElapsedTimer mReplyTimer;
+    QTimer mStallTimer;
+    qint64 mInactivityTimeout;
+    qint64 mTotalTimeout;
+    bool mTimedOut;
+    qint64 mBytesSent;
+    qint64 mBytesReceived;
+    qint64 mReplyBytes; // received by the current attempt.
+    qint64 mQueuedAt; // trace times, in microseconds.
+    qint64 mStartedAt;
+
+    friend class RequestScheduler;
+    friend class tst_RequestScheduler;
 };
 
 #endif // REQUEST_H
@@ -0,0 +1,331 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "requestscheduler.h"
+#include "request.h"
+
+#include <QNetworkAccessManager>
+#include <QElapsedTimer>
+#include <QTimer>
+
+#include <LogMacros.h>
+
+namespace {
+    const double INITIAL_WINDOW = 4.;
+    const double MIN_WINDOW = 1.;
+    const double MAX_WINDOW = 16.;
+    // The latency is flat while below this factor of the lowest one.
+    const qint64 LATENCY_TOLERANCE = 2;
+
+    // Deadlines are a multiple of what was observed so far,
+    // within fixed bounds while nothing is known.
+    const qint64 TIMEOUT_FACTOR = 4;
+    const qint64 MIN_INACTIVITY_TIMEOUT = 15000;
+    const qint64 DEFAULT_INACTIVITY_TIMEOUT = 30000;
+    const qint64 MAX_INACTIVITY_TIMEOUT = 60000;
+    const qint64 MIN_TOTAL_TIMEOUT = 60000;
+    const qint64 DEFAULT_TOTAL_TIMEOUT = 300000;
+    const qint64 MAX_TOTAL_TIMEOUT = 600000;
+    const double SMOOTHING = 0.25; // weight of the last observation.
+
+    // Responses parsed or waiting for a parser thread.
+    const int MAX_PARSE_BACKLOG = 4;
+}
+
+RequestScheduler::Timing::Timing()
+    : duration(0)
+    , throughput(0.)
+{
+}
+
+RequestScheduler::Host::Host()
+    : resumeTime(0)
+    , inFlight(0)
+    , window(INITIAL_WINDOW)
+    , lastDecrease(0)
+    , requests(0)
+    , failures(0)
+    , totalLatency(0)
+{
+}
+
+RequestScheduler::RequestScheduler(QNetworkAccessManager *manager)
+    : QObject(manager)
+    , mTimer(new QTimer(this))
+    , mParsing(0)
+{
+    mTimer->setSingleShot(true);
+    connect(mTimer, &QTimer::timeout, this, &RequestScheduler::dispatchReady);
+}
+
+// Milliseconds on the monotonic clock. Unlike the wall clock, it
+// is not stepped back or forth when the system time is set.
+qint64 RequestScheduler::monotonicTime()
+{
+    QElapsedTimer clock;
+    clock.start();
+    return clock.msecsSinceReference();
+}
+
+RequestScheduler* RequestScheduler::instance(QNetworkAccessManager *manager)
+{
+    RequestScheduler *scheduler = manager->findChild<RequestScheduler*>(QString(), Qt::FindDirectChildrenOnly);
+    if (!scheduler) {
+        scheduler = new RequestScheduler(manager);
+    }
+    return scheduler;
+}
+
+void RequestScheduler::schedule(Request *request, qint64 delay)
+{
+    const qint64 now = monotonicTime();
+    Host &host = mHosts[request->host()];
+
+    Pending pending;
+    pending.request = request;
+    pending.readyTime = qMax(now + delay, host.resumeTime);
+    if (pending.readyTime <= now && host.queue.isEmpty()
+        && host.inFlight < int(host.window) && !isHeld(request)) {
+        start(&host, request);
+        return;
+    }
+    host.queue.append(pending);
+    armTimer();
+}
+
+void RequestScheduler::pause(const QString &host, qint64 delay)
+{
+    Host &state = mHosts[host];
+    const qint64 resumeTime = monotonicTime() + delay;
+    if (resumeTime > state.resumeTime) {
+        LOG_WARNING("Pausing requests to" << host << "for" << delay << "ms");
+        state.resumeTime = resumeTime;
+        armTimer();
+    }
+}
+
+void RequestScheduler::replyFinished(const QString &host, const QString &command,
+                                     qint64 latency, qint64 bytes, bool failed, bool congested)
+{
+    Host &state = mHosts[host];
+    state.inFlight = qMax(0, state.inFlight - 1);
+    if (latency < 0) {
+        // Aborted, nothing learnt about the server.
+        armTimer();
+        return;
+    }
+
+    state.requests += 1;
+    state.totalLatency += latency;
+    if (failed) {
+        state.failures += 1;
+    }
+    const qint64 now = monotonicTime();
+    if (congested) {
+        // Replies of a same burst are a single congestion signal.
+        if (now - state.lastDecrease > latency) {
+            state.window = qMax(MIN_WINDOW, state.window / 2.);
+            state.lastDecrease = now;
+            LOG_DEBUG("Reducing the concurrency window for" << host << "to" << int(state.window));
+        }
+    } else if (!failed) {
+        qint64 &baseLatency = state.baseLatencies[command];
+        if (!baseLatency || latency < baseLatency) {
+            baseLatency = qMax(qint64(1), latency);
+        }
+        if (latency <= baseLatency * LATENCY_TOLERANCE) {
+            state.window = qMin(MAX_WINDOW, state.window + 1. / state.window);
+        }
+
+        Timing &timing = state.timings[command];
+        const double throughput = double(bytes) / qMax(qint64(1), latency);
+        if (!timing.duration) {
+            timing.duration = latency;
+            timing.throughput = throughput;
+        } else {
+            timing.duration += qint64(SMOOTHING * (latency - timing.duration));
+            timing.throughput += SMOOTHING * (throughput - timing.throughput);
+        }
+    }
+    armTimer();
+}
+
+qint64 RequestScheduler::inactivityTimeout(const QString &host, const QString &command) const
+{
+    const Timing timing = mHosts.value(host).timings.value(command);
+    if (!timing.duration) {
+        return DEFAULT_INACTIVITY_TIMEOUT;
+    }
+    return qBound(MIN_INACTIVITY_TIMEOUT, TIMEOUT_FACTOR * timing.duration, MAX_INACTIVITY_TIMEOUT);
+}
+
+qint64 RequestScheduler::totalTimeout(const QString &host, const QString &command, qint64 bytes) const
+{
+    const Timing timing = mHosts.value(host).timings.value(command);
+    if (!timing.duration) {
+        return DEFAULT_TOTAL_TIMEOUT;
+    }
+    // Large uploads are given the time to transfer at the usual pace.
+    qint64 expected = timing.duration;
+    if (timing.throughput > 0.) {
+        expected = qMax(expected, qint64(bytes / timing.throughput));
+    }
+    return qBound(MIN_TOTAL_TIMEOUT, TIMEOUT_FACTOR * expected, MAX_TOTAL_TIMEOUT);
+}
+
+int RequestScheduler::window(const QString &host) const
+{
+    return int(mHosts.value(host).window);
+}
+
+void RequestScheduler::logStatistics() const
+{
+    for (QHash<QString, Host>::ConstIterator it = mHosts.constBegin(); it != mHosts.constEnd(); ++it) {
+        LOG_INFO("Requests to" << it.key() << ":" << it->requests << "replies,"
+                 << it->failures << "failures, mean latency"
+                 << (it->requests ? it->totalLatency / it->requests : 0) << "ms,"
+                 << "concurrency window" << int(it->window));
+    }
+}
+
+// Holds a request rejected for its token until a new one is
+// obtained. The token is refreshed only once, a request rejected
+// again after that is failing for another reason.
+bool RequestScheduler::waitForToken(Request *request)
+{
+    const Settings *settings = request->mSettings;
+    if (mTokenRefreshed.contains(settings)) {
+        return false;
+    }
+    QList<QPointer<Request> > &awaiting = mAwaitingToken[settings];
+    awaiting.append(request);
+    if (awaiting.count() == 1) {
+        LOG_WARNING("Access token rejected, refreshing it");
+        emit tokenExpired(settings);
+    }
+    return true;
+}
+
+void RequestScheduler::tokenRefreshed(const Settings *settings, bool success)
+{
+    mTokenRefreshed.insert(settings);
+    const QList<QPointer<Request> > awaiting = mAwaitingToken.take(settings);
+    for (const QPointer<Request> &request : awaiting) {
+        if (request) {
+            request->replayWithToken(success);
+        }
+    }
+}
+
+// Called at the end of a sync, the next one may refresh again.
+void RequestScheduler::forgetToken(const Settings *settings)
+{
+    mTokenRefreshed.remove(settings);
+    mAwaitingToken.remove(settings);
+}
+
+void RequestScheduler::parseStarted()
+{
+    mParsing += 1;
+}
+
+void RequestScheduler::parseFinished()
+{
+    mParsing = qMax(0, mParsing - 1);
+    if (mParsing == MAX_PARSE_BACKLOG - 1) {
+        armTimer();
+    }
+}
+
+// A REPORT brings more to parse, wait for the parsers to catch up.
+bool RequestScheduler::isHeld(const Request *request) const
+{
+    return mParsing >= MAX_PARSE_BACKLOG && request->command() == QStringLiteral("REPORT");
+}
+
+void RequestScheduler::start(Host *host, Request *request)
+{
+    host->inFlight += 1;
+    request->startReply();
+}
+
+void RequestScheduler::dispatchReady()
+{
+    const qint64 now = monotonicTime();
+    QList<QPair<QString, QPointer<Request> > > ready;
+    for (QHash<QString, Host>::Iterator host = mHosts.begin(); host != mHosts.end(); ++host) {
+        if (host->resumeTime > now) {
+            continue;
+        }
+        int slots = int(host->window) - host->inFlight;
+        QList<Pending>::Iterator it = host->queue.begin();
+        while (it != host->queue.end() && slots > 0) {
+            if (!it->request) {
+                it = host->queue.erase(it);
+            } else if (isHeld(it->request)) {
+                ++it;
+            } else if (it->readyTime <= now) {
+                ready.append(qMakePair(host.key(), it->request));
+                host->inFlight += 1;
+                slots -= 1;
+                it = host->queue.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Started requests may schedule new ones.
+    for (const QPair<QString, QPointer<Request> > &request : ready) {
+        if (request.second) {
+            request.second->startReply();
+        } else {
+            mHosts[request.first].inFlight -= 1;
+        }
+    }
+    armTimer();
+}
+
+void RequestScheduler::armTimer()
+{
+    qint64 next = 0;
+    for (const Host &host : const_cast<const QHash<QString, Host>&>(mHosts)) {
+        if (host.inFlight >= int(host.window)) {
+            // Dispatched when a reply finishes.
+            continue;
+        }
+        for (const Pending &pending : host.queue) {
+            if (pending.request && isHeld(pending.request)) {
+                // Dispatched when a parse finishes.
+                continue;
+            }
+            const qint64 readyTime = qMax(pending.readyTime, host.resumeTime);
+            if (!next || readyTime < next) {
+                next = readyTime;
+            }
+        }
+    }
+    if (next) {
+        // Capped to an hour, the timer is armed again on timeout.
+        mTimer->start(int(qBound(qint64(0), next - monotonicTime(), qint64(3600000))));
+    } else {
+        mTimer->stop();
+    }
+}
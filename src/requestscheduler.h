@@ -0,0 +1,120 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef REQUESTSCHEDULER_H
+#define REQUESTSCHEDULER_H
+
+#include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPointer>
+#include <QSet>
+
+class QNetworkAccessManager;
+class QTimer;
+class Request;
+class Settings;
+
+// Dispatches the requests sent through a network access manager,
+// host by host. When a server asks to slow down, the whole host is
+// paused, so retries and new requests wait together instead of
+// adding to the load.
+// The number of requests in flight to a host is limited by a window
+// that grows additively while the latency stays flat and is halved
+// on congestion signals (429, 503, gateway errors and timeouts).
+// The observed durations and throughput also give the deadlines
+// after which a stalled request is aborted.
+// Requests rejected with 401 wait for a single token refresh and
+// are then sent again. The token state is kept per account settings,
+// until the end of their sync.
+// The HTTP exchanges themselves run in the network manager thread,
+// while REPORT responses are parsed in a thread pool. When too many
+// of them are waiting to be parsed, no new REPORT is started.
+class RequestScheduler : public QObject
+{
+    Q_OBJECT
+public:
+    static RequestScheduler* instance(QNetworkAccessManager *manager);
+
+    void schedule(Request *request, qint64 delay = 0);
+    void pause(const QString &host, qint64 delay);
+    void replyFinished(const QString &host, const QString &command,
+                       qint64 latency, qint64 bytes, bool failed, bool congested);
+
+    int window(const QString &host) const;
+    qint64 inactivityTimeout(const QString &host, const QString &command) const;
+    qint64 totalTimeout(const QString &host, const QString &command, qint64 bytes) const;
+    void logStatistics() const;
+
+    bool waitForToken(Request *request);
+    void tokenRefreshed(const Settings *settings, bool success);
+    void forgetToken(const Settings *settings);
+
+    void parseStarted();
+    void parseFinished();
+
+Q_SIGNALS:
+    void tokenExpired(const Settings *settings);
+
+private Q_SLOTS:
+    void dispatchReady();
+
+private:
+    explicit RequestScheduler(QNetworkAccessManager *manager);
+
+    struct Pending {
+        QPointer<Request> request;
+        qint64 readyTime;
+    };
+    struct Timing {
+        Timing();
+        qint64 duration; // smoothed, in ms.
+        double throughput; // smoothed, in bytes per ms.
+    };
+    struct Host {
+        Host();
+        qint64 resumeTime;
+        QList<Pending> queue;
+        int inFlight;
+        double window;
+        qint64 lastDecrease;
+        QHash<QString, qint64> baseLatencies; // lowest latency per request type.
+        QHash<QString, Timing> timings;
+        int requests;
+        int failures;
+        qint64 totalLatency;
+    };
+
+    static qint64 monotonicTime();
+    void start(Host *host, Request *request);
+    void armTimer();
+    bool isHeld(const Request *request) const;
+
+    QHash<QString, Host> mHosts;
+    QTimer *mTimer;
+    QHash<const Settings*, QList<QPointer<Request> > > mAwaitingToken;
+    QSet<const Settings*> mTokenRefreshed;
+    int mParsing;
+
+    friend class tst_RequestScheduler;
+};
+
+#endif // REQUESTSCHEDULER_H
@@ -23,9 +23,17 @@
 
 #include "settings.h"
 
+#include <QStandardPaths>
+
+#define DEFAULT_RECEIVE_BUFFER_SIZE (4 * 1024 * 1024)
+#define DEFAULT_LOW_DATA_MAX_RESOURCE_SIZE (64 * 1024)
+
 Settings::Settings()
-    : mAccountId(0)
+    : mReceiveBufferSize(DEFAULT_RECEIVE_BUFFER_SIZE)
+    , mLowDataMaxResourceSize(DEFAULT_LOW_DATA_MAX_RESOURCE_SIZE)
+    , mAccountId(0)
     , mIgnoreSSLErrors(false)
+    , mLowDataMode(false)
 {
 }
 
@@ -118,3 +126,53 @@ QString Settings::userMailtoHref() const
 {
     return mUserMailtoHref;
 }
+
+void Settings::setCacheDirectory(const QString &path)
+{
+    mCacheDirectory = path;
+}
+
+QString Settings::cacheDirectory() const
+{
+    if (!mCacheDirectory.isEmpty()) {
+        return mCacheDirectory;
+    }
+    return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+        + QStringLiteral("/msyncd/caldav/") + QString::number(mAccountId);
+}
+
+// Amount of downloaded iCal data kept in memory before
+// being spooled to disk, zero or negative to never spool.
+void Settings::setReceiveBufferSize(qint64 size)
+{
+    mReceiveBufferSize = size;
+}
+
+qint64 Settings::receiveBufferSize() const
+{
+    return mReceiveBufferSize;
+}
+
+// On metered links, only the cheapest change detection is done
+// and large resources are left for the next unmetered sync.
+void Settings::setLowDataMode(bool enabled)
+{
+    mLowDataMode = enabled;
+}
+
+bool Settings::lowDataMode() const
+{
+    return mLowDataMode;
+}
+
+// In low data mode, changed resources larger than this wait
+// for an unmetered sync, zero or negative to never defer them.
+void Settings::setLowDataMaxResourceSize(qint64 size)
+{
+    mLowDataMaxResourceSize = size;
+}
+
+qint64 Settings::lowDataMaxResourceSize() const
+{
+    return mLowDataMaxResourceSize;
+}
@@ -59,6 +59,18 @@ public:
     void setUserMailtoHref(const QString &href);
     QString userMailtoHref() const;
 
+    void setCacheDirectory(const QString &path);
+    QString cacheDirectory() const;
+
+    void setReceiveBufferSize(qint64 size);
+    qint64 receiveBufferSize() const;
+
+    void setLowDataMode(bool enabled);
+    bool lowDataMode() const;
+
+    void setLowDataMaxResourceSize(qint64 size);
+    qint64 lowDataMaxResourceSize() const;
+
 private:
     QString mUserPrincipal;
     QString mUserMailtoHref;
@@ -67,8 +79,12 @@ private:
     QString mOAuthToken;
     QString mUsername;
     QString mPassword;
+    QString mCacheDirectory;
+    qint64 mReceiveBufferSize;
+    qint64 mLowDataMaxResourceSize;
     quint32 mAccountId;
     bool mIgnoreSSLErrors;
+    bool mLowDataMode;
 };
 
 #endif // SETTINGS_H
@@ -1,10 +1,10 @@
 QT -= gui
-QT += network dbus
+QT += network dbus concurrent
 
 CONFIG += link_pkgconfig console
 
 PKGCONFIG += buteosyncfw5 libsignon-qt5 accounts-qt5 libsailfishkeyprovider
-PKGCONFIG += signon-oauth2plugin KF5CalendarCore libmkcal-qt5
+PKGCONFIG += signon-oauth2plugin KF5CalendarCore libmkcal-qt5 connman-qt5
 
 INCLUDEPATH += $$PWD
 
@@ -15,11 +15,19 @@ SOURCES += \
         $$PWD/delete.cpp \
         $$PWD/propfind.cpp \
         $$PWD/reader.cpp \
+        $$PWD/receivespool.cpp \
         $$PWD/settings.cpp \
         $$PWD/request.cpp \
+        $$PWD/requestscheduler.cpp \
+        $$PWD/httptrace.cpp \
+        $$PWD/syncmetrics.cpp \
+        $$PWD/tracer.cpp \
         $$PWD/authhandler.cpp \
         $$PWD/incidencehandler.cpp \
-        $$PWD/notebooksyncagent.cpp
+        $$PWD/notebooksyncagent.cpp \
+        $$PWD/tombstoneindex.cpp \
+        $$PWD/calendarhomecache.cpp \
+        $$PWD/upsyncjournal.cpp
 
 HEADERS += \
         $$PWD/caldavclient.h \
@@ -29,11 +37,19 @@ HEADERS += \
         $$PWD/delete.h \
         $$PWD/propfind.h \
         $$PWD/reader.h \
+        $$PWD/receivespool.h \
         $$PWD/settings.h \
         $$PWD/request.h \
+        $$PWD/requestscheduler.h \
+        $$PWD/httptrace.h \
+        $$PWD/syncmetrics.h \
+        $$PWD/tracer.h \
         $$PWD/authhandler.h \
         $$PWD/incidencehandler.h \
-        $$PWD/notebooksyncagent.h
+        $$PWD/notebooksyncagent.h \
+        $$PWD/tombstoneindex.h \
+        $$PWD/calendarhomecache.h \
+        $$PWD/upsyncjournal.h
 
 OTHER_FILES += \
         $$PWD/xmls/client/caldav.xml \
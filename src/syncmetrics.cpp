@@ -0,0 +1,237 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "syncmetrics.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QSaveFile>
+
+#include <LogMacros.h>
+
+namespace {
+    // Records kept in the metrics file, older ones are dropped.
+    const int MAX_RECORDS = 32;
+}
+
+SyncMetrics::Phase::Phase()
+    : start(-1)
+    , end(-1)
+    , requests(0)
+    , bytesSent(0)
+    , bytesReceived(0)
+{
+}
+
+SyncMetrics::SyncMetrics(const QString &name)
+    : mName(name)
+    , mParsedResources(0)
+    , mWrittenIncidences(0)
+    , mStorageTime(0)
+    , mDeferredResources(0)
+{
+    mClock.start();
+}
+
+SyncMetrics::Phase &SyncMetrics::phase(const QString &name)
+{
+    if (!mPhases.contains(name)) {
+        mOrder.append(name);
+    }
+    return mPhases[name];
+}
+
+void SyncMetrics::start(const QString &name)
+{
+    Phase &state = phase(name);
+    if (state.start < 0) {
+        state.start = mClock.elapsed();
+    }
+}
+
+void SyncMetrics::stop(const QString &name)
+{
+    Phase &state = phase(name);
+    state.end = mClock.elapsed();
+    if (state.start < 0) {
+        state.start = state.end;
+    }
+}
+
+void SyncMetrics::addRequest(const QString &name, qint64 bytesSent, qint64 bytesReceived)
+{
+    Phase &state = phase(name);
+    state.requests += 1;
+    state.bytesSent += bytesSent;
+    state.bytesReceived += bytesReceived;
+}
+
+void SyncMetrics::addParsedResources(int count)
+{
+    mParsedResources += count;
+}
+
+void SyncMetrics::addWrittenIncidences(int count)
+{
+    mWrittenIncidences += count;
+}
+
+void SyncMetrics::addStorageTime(qint64 msecs)
+{
+    mStorageTime += msecs;
+}
+
+// Resources left for a later sync, in low data mode.
+void SyncMetrics::addDeferredResources(int count)
+{
+    mDeferredResources += count;
+}
+
+// Adds the phases and counters of other, its spans
+// being shifted to this clock.
+void SyncMetrics::merge(const SyncMetrics &other)
+{
+    const qint64 shift = mClock.msecsTo(other.mClock);
+    for (const QString &name : other.mOrder) {
+        const Phase &source = other.mPhases[name];
+        Phase &state = phase(name);
+        if (source.start >= 0 && (state.start < 0 || source.start + shift < state.start)) {
+            state.start = source.start + shift;
+        }
+        if (source.end >= 0 && source.end + shift > state.end) {
+            state.end = source.end + shift;
+        }
+        state.requests += source.requests;
+        state.bytesSent += source.bytesSent;
+        state.bytesReceived += source.bytesReceived;
+    }
+    mParsedResources += other.mParsedResources;
+    mWrittenIncidences += other.mWrittenIncidences;
+    mStorageTime += other.mStorageTime;
+    mDeferredResources += other.mDeferredResources;
+}
+
+qint64 SyncMetrics::duration(const QString &name) const
+{
+    const Phase state = mPhases.value(name);
+    return state.end >= state.start ? state.end - state.start : 0;
+}
+
+qint64 SyncMetrics::bytesSent() const
+{
+    qint64 bytes = 0;
+    for (const Phase &state : mPhases) {
+        bytes += state.bytesSent;
+    }
+    return bytes;
+}
+
+qint64 SyncMetrics::bytesReceived() const
+{
+    qint64 bytes = 0;
+    for (const Phase &state : mPhases) {
+        bytes += state.bytesReceived;
+    }
+    return bytes;
+}
+
+QJsonObject SyncMetrics::toJson() const
+{
+    QJsonArray phases;
+    for (const QString &name : mOrder) {
+        const Phase &state = mPhases[name];
+        QJsonObject object;
+        object.insert(QStringLiteral("name"), name);
+        object.insert(QStringLiteral("start"), double(state.start));
+        object.insert(QStringLiteral("duration"), double(duration(name)));
+        object.insert(QStringLiteral("requests"), state.requests);
+        object.insert(QStringLiteral("bytesSent"), double(state.bytesSent));
+        object.insert(QStringLiteral("bytesReceived"), double(state.bytesReceived));
+        phases.append(object);
+    }
+
+    QJsonObject record;
+    record.insert(QStringLiteral("name"), mName);
+    record.insert(QStringLiteral("duration"), double(mClock.elapsed()));
+    record.insert(QStringLiteral("phases"), phases);
+    record.insert(QStringLiteral("bytesSent"), double(bytesSent()));
+    record.insert(QStringLiteral("bytesReceived"), double(bytesReceived()));
+    record.insert(QStringLiteral("parsedResources"), mParsedResources);
+    record.insert(QStringLiteral("writtenIncidences"), mWrittenIncidences);
+    record.insert(QStringLiteral("storageTime"), double(mStorageTime));
+    record.insert(QStringLiteral("deferredResources"), mDeferredResources);
+    return record;
+}
+
+// A single line like "discovery 120ms (3 req), etags 80ms (1 req)".
+QString SyncMetrics::summary() const
+{
+    QStringList parts;
+    for (const QString &name : mOrder) {
+        const Phase &state = mPhases[name];
+        QString part = QStringLiteral("%1 %2ms").arg(name).arg(duration(name));
+        if (state.requests) {
+            part += QStringLiteral(" (%1 req, %2/%3 B)").arg(state.requests)
+                .arg(state.bytesSent).arg(state.bytesReceived);
+        }
+        parts.append(part);
+    }
+    if (mParsedResources) {
+        parts.append(QStringLiteral("%1 parsed").arg(mParsedResources));
+    }
+    if (mWrittenIncidences || mStorageTime) {
+        parts.append(QStringLiteral("%1 written, storage %2ms").arg(mWrittenIncidences).arg(mStorageTime));
+    }
+    if (mDeferredResources) {
+        parts.append(QStringLiteral("%1 deferred").arg(mDeferredResources));
+    }
+    if (bytesSent() || bytesReceived()) {
+        parts.append(QStringLiteral("total %1/%2 B").arg(bytesSent()).arg(bytesReceived()));
+    }
+    return parts.join(QStringLiteral(", "));
+}
+
+// Appends the record to the JSON array stored in fileName.
+bool SyncMetrics::save(const QString &fileName, const QJsonObject &record)
+{
+    QJsonArray records;
+    QFile previous(fileName);
+    if (previous.open(QIODevice::ReadOnly)) {
+        records = QJsonDocument::fromJson(previous.readAll()).array();
+        previous.close();
+    }
+    records.append(record);
+    while (records.count() > MAX_RECORDS) {
+        records.removeFirst();
+    }
+
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot write sync metrics" << fileName << ":" << file.errorString());
+        return false;
+    }
+    file.write(QJsonDocument(records).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
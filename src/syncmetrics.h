@@ -0,0 +1,80 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef SYNCMETRICS_H
+#define SYNCMETRICS_H
+
+#include <QString>
+#include <QStringList>
+#include <QHash>
+#include <QElapsedTimer>
+#include <QJsonObject>
+
+// Timings and counters of a sync, per phase. Network phases
+// overlap, so a phase duration is the span from its first start to
+// its last stop, measured on a monotonic clock.
+class SyncMetrics
+{
+public:
+    explicit SyncMetrics(const QString &name = QString());
+
+    void start(const QString &phase);
+    void stop(const QString &phase);
+    void addRequest(const QString &phase, qint64 bytesSent, qint64 bytesReceived);
+
+    void addParsedResources(int count);
+    void addWrittenIncidences(int count);
+    void addStorageTime(qint64 msecs);
+    void addDeferredResources(int count);
+    void merge(const SyncMetrics &other);
+
+    qint64 duration(const QString &phase) const;
+    qint64 bytesSent() const;
+    qint64 bytesReceived() const;
+    QJsonObject toJson() const;
+    QString summary() const;
+
+    static bool save(const QString &fileName, const QJsonObject &record);
+
+private:
+    struct Phase {
+        Phase();
+        qint64 start;
+        qint64 end;
+        int requests;
+        qint64 bytesSent;
+        qint64 bytesReceived;
+    };
+    Phase &phase(const QString &name);
+
+    QString mName;
+    QElapsedTimer mClock;
+    QStringList mOrder;
+    QHash<QString, Phase> mPhases;
+    int mParsedResources;
+    int mWrittenIncidences;
+    qint64 mStorageTime;
+    int mDeferredResources;
+
+    friend class tst_SyncMetrics;
+};
+
+#endif // SYNCMETRICS_H
@@ -0,0 +1,119 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "tombstoneindex.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QUrl>
+
+#include <LogMacros.h>
+
+TombstoneIndex::TombstoneIndex(const QString &fileName)
+    : mFileName(fileName)
+    , mExists(false)
+{
+}
+
+bool TombstoneIndex::load()
+{
+    mTombstones.clear();
+
+    QFile file(mFileName);
+    mExists = file.exists();
+    if (!mExists) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        LOG_WARNING("Cannot read tombstone index" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    while (!file.atEnd()) {
+        const QByteArrayList fields = file.readLine().trimmed().split('\t');
+        if (fields.count() == 3) {
+            insert(QUrl::fromPercentEncoding(fields[0]),
+                   QUrl::fromPercentEncoding(fields[1]),
+                   QUrl::fromPercentEncoding(fields[2]));
+        }
+    }
+    LOG_DEBUG("Tombstone index" << mFileName << "has" << mTombstones.count() << "pending deletions");
+
+    return true;
+}
+
+bool TombstoneIndex::save() const
+{
+    // An empty file is kept, to distinguish a notebook
+    // without pending deletions from a missing index.
+    QDir().mkpath(QFileInfo(mFileName).absolutePath());
+    QSaveFile file(mFileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot write tombstone index" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    for (const Tombstone &tombstone : mTombstones) {
+        file.write(QUrl::toPercentEncoding(tombstone.href) + '\t'
+                   + QUrl::toPercentEncoding(tombstone.uid) + '\t'
+                   + QUrl::toPercentEncoding(tombstone.etag) + '\n');
+    }
+    return file.commit();
+}
+
+bool TombstoneIndex::exists() const
+{
+    return mExists;
+}
+
+void TombstoneIndex::insert(const QString &href, const QString &uid, const QString &etag)
+{
+    Tombstone tombstone;
+    tombstone.href = href;
+    tombstone.uid = uid;
+    tombstone.etag = etag;
+    mTombstones.insert(href, tombstone);
+}
+
+void TombstoneIndex::remove(const QString &href)
+{
+    mTombstones.remove(href);
+}
+
+void TombstoneIndex::clear()
+{
+    mTombstones.clear();
+}
+
+bool TombstoneIndex::contains(const QString &href) const
+{
+    return mTombstones.contains(href);
+}
+
+QList<TombstoneIndex::Tombstone> TombstoneIndex::tombstones() const
+{
+    return mTombstones.values();
+}
+
+const QString& TombstoneIndex::fileName() const
+{
+    return mFileName;
+}
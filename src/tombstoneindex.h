@@ -0,0 +1,62 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef TOMBSTONEINDEX_H
+#define TOMBSTONEINDEX_H
+
+#include <QString>
+#include <QHash>
+#include <QList>
+
+// Local deletions waiting for the server to confirm them,
+// indexed by the href of the deleted resource. It replaces
+// loading every deleted incidence ever stored for a notebook
+// when looking for deletions to upsync.
+class TombstoneIndex
+{
+public:
+    struct Tombstone {
+        QString href;
+        QString uid;
+        QString etag;
+    };
+
+    explicit TombstoneIndex(const QString &fileName);
+
+    bool load();
+    bool save() const;
+    bool exists() const;
+
+    void insert(const QString &href, const QString &uid, const QString &etag);
+    void remove(const QString &href);
+    void clear();
+
+    bool contains(const QString &href) const;
+    QList<Tombstone> tombstones() const;
+    const QString& fileName() const;
+
+private:
+    QString mFileName;
+    QHash<QString, Tombstone> mTombstones;
+    bool mExists;
+};
+
+#endif // TOMBSTONEINDEX_H
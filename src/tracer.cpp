@@ -0,0 +1,158 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "tracer.h"
+
+#include <QAtomicInt>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QSaveFile>
+#include <QThread>
+#include <QVector>
+
+#include <LogMacros.h>
+
+namespace {
+    // Later spans are dropped, to bound the memory use.
+    const int MAX_SPANS = 100000;
+
+    struct Span {
+        const char *category;
+        QString name;
+        qint64 start;
+        qint64 duration;
+        qint64 thread;
+        QVariantMap args;
+    };
+
+    struct TraceBuffer {
+        TraceBuffer()
+        {
+            clock.start();
+        }
+        QAtomicInt enabled;
+        QElapsedTimer clock;
+        QMutex mutex;
+        QVector<Span> spans;
+    };
+    Q_GLOBAL_STATIC(TraceBuffer, traceBuffer)
+}
+
+void Tracer::setEnabled(bool enabled)
+{
+    traceBuffer()->enabled.storeRelease(enabled ? 1 : 0);
+}
+
+bool Tracer::isEnabled()
+{
+    return traceBuffer()->enabled.loadAcquire();
+}
+
+qint64 Tracer::now()
+{
+    return traceBuffer()->clock.nsecsElapsed() / 1000;
+}
+
+// An end of -1 means now.
+void Tracer::addSpan(const char *category, const QString &name,
+                     qint64 start, qint64 end, const QVariantMap &args)
+{
+    if (!isEnabled()) {
+        return;
+    }
+    Span span;
+    span.category = category;
+    span.name = name;
+    span.start = start;
+    span.duration = (end < 0 ? now() : end) - start;
+    span.thread = qint64(quintptr(QThread::currentThreadId()));
+    span.args = args;
+
+    TraceBuffer *buffer = traceBuffer();
+    QMutexLocker lock(&buffer->mutex);
+    if (buffer->spans.count() < MAX_SPANS) {
+        buffer->spans.append(span);
+    }
+}
+
+bool Tracer::save(const QString &fileName)
+{
+    TraceBuffer *buffer = traceBuffer();
+    QJsonArray events;
+    {
+        QMutexLocker lock(&buffer->mutex);
+        for (const Span &span : buffer->spans) {
+            QJsonObject event;
+            event.insert(QStringLiteral("name"), span.name);
+            event.insert(QStringLiteral("cat"), QString::fromLatin1(span.category));
+            event.insert(QStringLiteral("ph"), QStringLiteral("X"));
+            event.insert(QStringLiteral("ts"), double(span.start));
+            event.insert(QStringLiteral("dur"), double(span.duration));
+            event.insert(QStringLiteral("pid"), double(QCoreApplication::applicationPid()));
+            event.insert(QStringLiteral("tid"), double(span.thread));
+            if (!span.args.isEmpty()) {
+                event.insert(QStringLiteral("args"), QJsonObject::fromVariantMap(span.args));
+            }
+            events.append(event);
+        }
+    }
+    QJsonObject trace;
+    trace.insert(QStringLiteral("traceEvents"), events);
+    trace.insert(QStringLiteral("displayTimeUnit"), QStringLiteral("ms"));
+
+    QDir().mkpath(QFileInfo(fileName).absolutePath());
+    QSaveFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot write trace events" << fileName << ":" << file.errorString());
+        return false;
+    }
+    file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact));
+    return file.commit();
+}
+
+void Tracer::clear()
+{
+    TraceBuffer *buffer = traceBuffer();
+    QMutexLocker lock(&buffer->mutex);
+    buffer->spans.clear();
+}
+
+TraceSpan::TraceSpan(const char *category, const QString &name, const QVariantMap &args)
+    : mCategory(category)
+    , mName(name)
+    , mArgs(args)
+    , mStart(Tracer::isEnabled() ? Tracer::now() : -1)
+{
+}
+
+TraceSpan::~TraceSpan()
+{
+    if (mStart >= 0) {
+        Tracer::addSpan(mCategory, mName, mStart, -1, mArgs);
+    }
+}
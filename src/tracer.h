@@ -0,0 +1,62 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef TRACER_H
+#define TRACER_H
+
+#include <QString>
+#include <QVariantMap>
+
+// Records spans of a sync run, from any thread, to be saved in
+// the trace event format read by chrome://tracing and Perfetto.
+// Recording is off by default and costs a single test then.
+class Tracer
+{
+public:
+    static void setEnabled(bool enabled);
+    static bool isEnabled();
+
+    // Monotonic time, in microseconds.
+    static qint64 now();
+    static void addSpan(const char *category, const QString &name,
+                        qint64 start, qint64 end = -1,
+                        const QVariantMap &args = QVariantMap());
+
+    static bool save(const QString &fileName);
+    static void clear();
+};
+
+// Records a span from its construction to its destruction.
+class TraceSpan
+{
+public:
+    TraceSpan(const char *category, const QString &name,
+              const QVariantMap &args = QVariantMap());
+    ~TraceSpan();
+
+private:
+    const char *mCategory;
+    QString mName;
+    QVariantMap mArgs;
+    qint64 mStart;
+};
+
+#endif // TRACER_H
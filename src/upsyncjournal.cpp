@@ -0,0 +1,206 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include "upsyncjournal.h"
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSaveFile>
+#include <QUrl>
+
+#include <LogMacros.h>
+
+#include <unistd.h>
+
+namespace {
+    const QByteArray PUT_OPERATION = QByteArrayLiteral("PUT");
+    const QByteArray DELETE_OPERATION = QByteArrayLiteral("DELETE");
+    const QByteArray DONE_OPERATION = QByteArrayLiteral("DONE");
+
+    QByteArray entryLine(const UpsyncJournal::Entry &entry)
+    {
+        QByteArrayList fields;
+        fields << (entry.operation == UpsyncJournal::Upload ? PUT_OPERATION : DELETE_OPERATION)
+               << entry.dateTime.toString(Qt::ISODateWithMs).toLatin1()
+               << QUrl::toPercentEncoding(entry.href)
+               << QUrl::toPercentEncoding(entry.uid)
+               << QUrl::toPercentEncoding(entry.etag);
+        return fields.join('\t') + '\n';
+    }
+
+    QByteArray doneLine(const QString &href)
+    {
+        return DONE_OPERATION + '\t' + QUrl::toPercentEncoding(href) + '\n';
+    }
+}
+
+UpsyncJournal::UpsyncJournal(const QString &fileName)
+    : mFileName(fileName)
+    , mBatching(false)
+{
+}
+
+bool UpsyncJournal::load()
+{
+    mPending.clear();
+
+    QFile file(mFileName);
+    if (!file.exists()) {
+        return true;
+    }
+    if (!file.open(QIODevice::ReadOnly)) {
+        LOG_WARNING("Cannot read upsync journal" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    while (!file.atEnd()) {
+        const QByteArrayList fields = file.readLine().trimmed().split('\t');
+        if (fields.count() == 2 && fields[0] == DONE_OPERATION) {
+            mPending.remove(QUrl::fromPercentEncoding(fields[1]));
+        } else if (fields.count() == 5
+                   && (fields[0] == PUT_OPERATION || fields[0] == DELETE_OPERATION)) {
+            Entry entry;
+            entry.operation = fields[0] == PUT_OPERATION ? Upload : Removal;
+            entry.dateTime = QDateTime::fromString(QString::fromLatin1(fields[1]), Qt::ISODateWithMs);
+            entry.href = QUrl::fromPercentEncoding(fields[2]);
+            entry.uid = QUrl::fromPercentEncoding(fields[3]);
+            entry.etag = QUrl::fromPercentEncoding(fields[4]);
+            mPending.insert(entry.href, entry);
+        } else if (!file.atEnd()) {
+            // A truncated last line is expected after a crash,
+            // the request was then never sent.
+            LOG_WARNING("Ignoring malformed line in upsync journal" << mFileName);
+        }
+    }
+    LOG_DEBUG("Upsync journal" << mFileName << "has" << mPending.count() << "pending operations");
+
+    return true;
+}
+
+bool UpsyncJournal::begin(Operation operation, const QString &href,
+                          const QString &uid, const QString &etag)
+{
+    Entry entry;
+    entry.operation = operation;
+    entry.href = href;
+    entry.uid = uid;
+    entry.etag = etag;
+    entry.dateTime = QDateTime::currentDateTimeUtc();
+    mPending.insert(href, entry);
+
+    return write(entryLine(entry));
+}
+
+bool UpsyncJournal::complete(const QSet<QString> &hrefs)
+{
+    QByteArray lines;
+    for (const QString &href : hrefs) {
+        if (mPending.remove(href)) {
+            lines += doneLine(href);
+        }
+    }
+
+    return lines.isEmpty() || write(lines);
+}
+
+// Hold the written lines until flush() is called, so a set of
+// operations costs a single fsync. The held operations must not be
+// sent before flush() returns.
+void UpsyncJournal::startBatch()
+{
+    mBatching = true;
+}
+
+bool UpsyncJournal::flush()
+{
+    mBatching = false;
+    if (mBatch.isEmpty()) {
+        return true;
+    }
+    const QByteArray lines = mBatch;
+    mBatch.clear();
+    return write(lines);
+}
+
+bool UpsyncJournal::compact()
+{
+    mBatch.clear();
+    if (mPending.isEmpty()) {
+        return !QFile::exists(mFileName) || QFile::remove(mFileName);
+    }
+
+    QSaveFile file(mFileName);
+    if (!file.open(QIODevice::WriteOnly)) {
+        LOG_WARNING("Cannot compact upsync journal" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    for (const Entry &entry : mPending) {
+        file.write(entryLine(entry));
+    }
+    return file.commit();
+}
+
+bool UpsyncJournal::isEmpty() const
+{
+    return mPending.isEmpty();
+}
+
+bool UpsyncJournal::contains(const QString &href) const
+{
+    return mPending.contains(href);
+}
+
+UpsyncJournal::Entry UpsyncJournal::entry(const QString &href) const
+{
+    return mPending.value(href);
+}
+
+QList<UpsyncJournal::Entry> UpsyncJournal::entries() const
+{
+    return mPending.values();
+}
+
+const QString& UpsyncJournal::fileName() const
+{
+    return mFileName;
+}
+
+bool UpsyncJournal::write(const QByteArray &lines)
+{
+    if (mBatching) {
+        mBatch += lines;
+        return true;
+    }
+    QDir().mkpath(QFileInfo(mFileName).absolutePath());
+    QFile file(mFileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Append)) {
+        LOG_WARNING("Cannot open upsync journal" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    if (file.write(lines) != lines.size() || !file.flush()) {
+        LOG_WARNING("Cannot write upsync journal" << mFileName << ":" << file.errorString());
+        return false;
+    }
+    // The entry must be on disk before the request leaves.
+    ::fsync(file.handle());
+
+    return true;
+}
@@ -0,0 +1,79 @@
+/*
+ * This file is part of buteo-sync-plugin-caldav package
+ *
+ * Copyright (C) 2020 Jolla Ltd. and/or its subsidiary(-ies).
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef UPSYNCJOURNAL_H
+#define UPSYNCJOURNAL_H
+
+#include <QString>
+#include <QDateTime>
+#include <QHash>
+#include <QSet>
+
+// Write-ahead log of the PUT and DELETE requests sent to the server.
+// An entry is written before the request is dispatched and marked as
+// done once its outcome has been saved locally. Entries still pending
+// when a sync starts correspond to operations interrupted by a crash
+// or a connectivity loss, and their outcome can be resolved from the
+// etag the resource had before the operation. Entries begun between
+// startBatch() and flush() are written to disk at once.
+class UpsyncJournal
+{
+public:
+    enum Operation {
+        Upload,
+        Removal
+    };
+
+    struct Entry {
+        Entry() : operation(Upload) {}
+        Operation operation;
+        QString href;
+        QString uid;
+        QString etag; // etag of the resource before the operation.
+        QDateTime dateTime;
+    };
+
+    explicit UpsyncJournal(const QString &fileName);
+
+    bool load();
+    bool begin(Operation operation, const QString &href,
+               const QString &uid, const QString &etag);
+    bool complete(const QSet<QString> &hrefs);
+    void startBatch();
+    bool flush();
+    bool compact();
+
+    bool isEmpty() const;
+    bool contains(const QString &href) const;
+    Entry entry(const QString &href) const;
+    QList<Entry> entries() const;
+    const QString& fileName() const;
+
+private:
+    bool write(const QByteArray &lines);
+
+    QString mFileName;
+    QHash<QString, Entry> mPending;
+    bool mBatching;
+    QByteArray mBatch;
+};
+
+#endif // UPSYNCJOURNAL_H
@@ -45,6 +45,7 @@ private slots:
     void loadAccountCalendars();
     void mergeAccountCalendars();
     void removeAccountCalendar();
+    void accountSynced();
 
 private:
     Accounts::Manager* mManager;
@@ -192,5 +193,42 @@ void tst_CalDavClient::removeAccountCalendar()
     QVERIFY(!names.contains(QLatin1String("Bar")));
 }
 
+void tst_CalDavClient::accountSynced()
+{
+    CalDavClient client(QLatin1String("caldav"), mProfile, nullptr);
+    client.mManager = mManager; // So we can share the same Account pointers.
+    QVERIFY(client.init());
+    QSignalSpy success(&client, SIGNAL(success(QString, QString)));
+
+    // Without account changes, results are reported at once.
+    client.syncFinished(Buteo::SyncResults::NO_ERROR);
+    QCOMPARE(success.count(), 1);
+    QVERIFY(!client.mResultsPending);
+    QVERIFY(!client.mAccountSyncTimer.isActive());
+
+    // Account changes are stored first, results come with synced().
+    client.removeAccountCalendars(QStringList() << QLatin1String("/toto%40tutu/"));
+    QVERIFY(client.mAccountModified);
+    client.syncFinished(Buteo::SyncResults::NO_ERROR);
+    QVERIFY(!client.mAccountModified);
+    QVERIFY(client.mResultsPending);
+    QVERIFY(client.mAccountSyncTimer.isActive());
+    QTRY_COMPARE(success.count(), 2);
+    QVERIFY(!client.mResultsPending);
+    QVERIFY(!client.mAccountSyncTimer.isActive());
+
+    // Without acknowledgement, the timer reports the results.
+    client.mAccountModified = true;
+    client.syncFinished(Buteo::SyncResults::NO_ERROR);
+    QVERIFY(client.mResultsPending);
+    mAccount->disconnect(&client);
+    client.mAccountSyncTimer.start(10);
+    QTRY_COMPARE(success.count(), 3);
+    QVERIFY(!client.mResultsPending);
+    // A late acknowledgement reports nothing more.
+    client.accountSynced();
+    QCOMPARE(success.count(), 3);
+}
+
 #include "tst_caldavclient.moc"
 QTEST_MAIN(tst_CalDavClient)
@@ -0,0 +1,15 @@
+TEMPLATE = app
+TARGET = tst_httptrace
+
+QT += testlib
+QT -= gui
+
+CONFIG += debug
+
+include($$PWD/../../src/src.pri)
+
+SOURCES += tst_httptrace.cpp
+
+target.path = /opt/tests/buteo/plugins/caldav/
+
+INSTALLS += target
@@ -24,6 +24,7 @@
 #include <KCalendarCore/Alarm>
 #include <KCalendarCore/Attachment>
 #include <incidencehandler.h>
+#include <reader.h>
 
 using namespace KCalendarCore;
 
@@ -67,6 +68,11 @@ private slots:
     void changedTodoDueDateMakesDifferent();
     void changedTodoRecurrenceDueDateMakesDifferent();
     void changedTodoPercentCompletedMakesDifferent();
+
+    // Export
+    void exportSeriesWithTimeZone();
+    void exportSeriesWithExceptions_data();
+    void exportSeriesWithExceptions();
 };
 
 void tst_IncidenceHandler::changedEventDurationMakesDifferent()
@@ -431,5 +437,84 @@ void tst_IncidenceHandler::changedTodoPercentCompletedMakesDifferent()
     QVERIFY(*todo1 != *todo2);
 }
 
+void tst_IncidenceHandler::exportSeriesWithTimeZone()
+{
+    const QDateTime start(QDate(2020, 3, 2), QTime(9, 0), QTimeZone("Europe/Helsinki"));
+    Event::Ptr series = Event::Ptr(new Event);
+    series->setUid(QStringLiteral("NBUID:notebook:weekly"));
+    series->setSummary(QStringLiteral("Weekly meeting"));
+    series->setDtStart(start);
+    series->setDtEnd(start.addSecs(60 * 60));
+    series->recurrence()->setWeekly(1);
+
+    Incidence::List instances;
+    for (int i = 1; i < 3; ++i) {
+        const QDateTime recurrenceId = start.addDays(7 * i);
+        series->recurrence()->addExDateTime(recurrenceId);
+        Event::Ptr instance = Event::Ptr(series->clone());
+        instance->clearRecurrence();
+        instance->setRecurrenceId(recurrenceId);
+        instance->setSummary(QStringLiteral("Moved weekly meeting"));
+        instance->setDtStart(recurrenceId.addSecs(60 * 60));
+        instance->setDtEnd(recurrenceId.addSecs(2 * 60 * 60));
+        instances << instance;
+    }
+
+    const QByteArray ics = IncidenceHandler::toIcs(series, instances);
+    QVERIFY(ics.startsWith("BEGIN:VCALENDAR\r\n"));
+    QVERIFY(ics.endsWith("END:VCALENDAR\r\n"));
+    QCOMPARE(ics.count("BEGIN:VTIMEZONE"), 1);
+    QCOMPARE(ics.count("BEGIN:VEVENT"), 3);
+
+    const Incidence::List incidences = Reader::readICalData(QString::fromUtf8(ics));
+    QCOMPARE(incidences.count(), 3);
+    for (const Incidence::Ptr &incidence : incidences) {
+        QCOMPARE(incidence->uid(), QStringLiteral("weekly"));
+        QCOMPARE(incidence->dtStart().timeZone(), start.timeZone());
+    }
+}
+
+void tst_IncidenceHandler::exportSeriesWithExceptions_data()
+{
+    QTest::addColumn<int>("exceptionCount");
+
+    QTest::newRow("1000 exceptions") << 1000;
+    QTest::newRow("2500 exceptions") << 2500;
+    QTest::newRow("5000 exceptions") << 5000;
+}
+
+void tst_IncidenceHandler::exportSeriesWithExceptions()
+{
+    QFETCH(int, exceptionCount);
+
+    const QDateTime start(QDate(2005, 1, 3), QTime(9, 0), Qt::UTC);
+    Event::Ptr series = Event::Ptr(new Event);
+    series->setUid(QStringLiteral("NBUID:notebook:daily-standup"));
+    series->setSummary(QStringLiteral("Daily stand-up"));
+    series->setDtStart(start);
+    series->setDtEnd(start.addSecs(15 * 60));
+    series->recurrence()->setDaily(1);
+
+    Incidence::List instances;
+    for (int i = 0; i < exceptionCount; ++i) {
+        const QDateTime recurrenceId = start.addDays(i);
+        series->recurrence()->addExDateTime(recurrenceId);
+        Event::Ptr instance = Event::Ptr(series->clone());
+        instance->clearRecurrence();
+        instance->setRecurrenceId(recurrenceId);
+        instance->setDtStart(recurrenceId.addSecs(10 * 60));
+        instance->setDtEnd(recurrenceId.addSecs(25 * 60));
+        instances << instance;
+    }
+
+    QByteArray ics;
+    QBENCHMARK {
+        ics = IncidenceHandler::toIcs(series, instances);
+    }
+    QCOMPARE(ics.count("RECURRENCE-ID"), exceptionCount);
+    QVERIFY(!ics.contains("EXDATE"));
+    QVERIFY(!ics.contains("NBUID:"));
+}
+
 QTEST_MAIN(tst_IncidenceHandler)
 #include "tst_incidencehandler.moc"
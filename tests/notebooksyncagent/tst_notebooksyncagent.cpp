@@ -30,6 +30,9 @@
 #include <KCalendarCore/Incidence>
 #include <KCalendarCore/Event>
 #include <notebooksyncagent.h>
+#include <receivespool.h>
+#include <upsyncjournal.h>
+#include <tombstoneindex.h>
 #include <extendedcalendar.h>
 #include <settings.h>
 #include <QNetworkAccessManager>
@@ -60,6 +63,9 @@ private slots:
     void updateEvent();
     void updateHrefETag();
     void calculateDelta();
+    void calculateLocalDelta();
+    void upsyncJournal();
+    void tombstones();
 
     void oneDownSyncCycle_data();
     void oneDownSyncCycle();
@@ -71,9 +77,26 @@ private slots:
     void updateIncidence();
 
     void requestFinished();
+    void resolveConflict();
+    void resolveConflictPreferLocal();
 
     void result();
 
+    void receiveSpool();
+
+    void preferFullFetch_data();
+    void preferFullFetch();
+
+    void isCold_data();
+    void isCold();
+
+    void slowSyncSlices();
+    void deferredResources();
+    void upsyncOnlyTrigger();
+    void isSameContent();
+    void updateSeriesWithExceptions_data();
+    void updateSeriesWithExceptions();
+
 private:
     Settings m_settings;
     NotebookSyncAgent *m_agent;
@@ -126,6 +149,8 @@ void tst_NotebookSyncAgent::cleanup()
 
     delete m_agent->mNetworkManager;
     delete m_agent;
+
+    m_settings = Settings();
 }
 
 void tst_NotebookSyncAgent::insertEvent_data()
@@ -545,6 +570,180 @@ void tst_NotebookSyncAgent::calculateDelta()
     QCOMPARE(nNotFound, uint(0));
 }
 
+void tst_NotebookSyncAgent::calculateLocalDelta()
+{
+    KCalendarCore::Incidence::Ptr evMod = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evMod->setSummary("local modification");
+    evMod->addComment(QStringLiteral("buteo:caldav:uri:%1mod.ics").arg(m_agent->mRemoteCalendarPath));
+    evMod->addComment(QStringLiteral("buteo:caldav:etag:\"etagMod\""));
+    m_agent->mCalendar->addEvent(evMod.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    KCalendarCore::Incidence::Ptr evDel = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evDel->setSummary("local deletion");
+    evDel->addComment(QStringLiteral("buteo:caldav:uri:%1del.ics").arg(m_agent->mRemoteCalendarPath));
+    evDel->addComment(QStringLiteral("buteo:caldav:etag:\"etagDel\""));
+    m_agent->mCalendar->addEvent(evDel.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    KCalendarCore::Incidence::Ptr evSynced = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evSynced->setSummary("unchanged synced incidence");
+    evSynced->addComment(QStringLiteral("buteo:caldav:uri:%1synced.ics").arg(m_agent->mRemoteCalendarPath));
+    evSynced->addComment(QStringLiteral("buteo:caldav:etag:\"etagSynced\""));
+    m_agent->mCalendar->addEvent(evSynced.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc().addSecs(1));
+
+    // See calculateDelta().
+    QThread::sleep(3);
+
+    KCalendarCore::Incidence::Ptr evAdd = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evAdd->setSummary("local addition");
+    m_agent->mCalendar->addEvent(evAdd.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    evMod->setDescription(QStringLiteral("Modified summary."));
+    m_agent->mCalendar->deleteIncidence(evDel);
+    m_agent->mStorage->save();
+
+    QVERIFY(m_agent->calculateLocalDelta(&m_agent->mLocalAdditions,
+                                         &m_agent->mLocalModifications,
+                                         &m_agent->mLocalDeletions));
+    QCOMPARE(m_agent->mLocalAdditions.count(), 1);
+    QVERIFY(incidenceListContains(m_agent->mLocalAdditions, evAdd));
+    QCOMPARE(m_agent->mLocalModifications.count(), 1);
+    QVERIFY(incidenceListContains(m_agent->mLocalModifications, evMod));
+    QCOMPARE(m_agent->mLocalDeletions.count(), 1);
+    QCOMPARE(m_agent->mLocalDeletions.first()->uid(), evDel->uid());
+    QVERIFY(m_agent->mLocalDeletions.first()->comments().contains(QStringLiteral("buteo:caldav:etag:\"etagDel\"")));
+    // Nothing is known about remote changes.
+    QVERIFY(m_agent->mRemoteChanges.isEmpty());
+    QVERIFY(m_agent->mRemoteDeletions.isEmpty());
+}
+
+void tst_NotebookSyncAgent::upsyncJournal()
+{
+    const QString journalFile = QStringLiteral("./journal-test");
+    QFile::remove(journalFile);
+
+    KCalendarCore::Incidence::Ptr evAdd = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evAdd->setSummary("uploaded local addition, without uri");
+    m_agent->mCalendar->addEvent(evAdd.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    KCalendarCore::Incidence::Ptr evMod = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    evMod->setSummary("interrupted local modification");
+    evMod->addComment(QStringLiteral("buteo:caldav:uri:%1mod.ics").arg(m_agent->mRemoteCalendarPath));
+    evMod->addComment(QStringLiteral("buteo:caldav:etag:\"etagMod\""));
+    m_agent->mCalendar->addEvent(evMod.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    m_agent->mStorage->save();
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc().addSecs(1));
+
+    const QString hrefAdd = QStringLiteral("%1%2.ics").arg(m_agent->mRemoteCalendarPath).arg(evAdd->uid());
+    const QString hrefMod = QStringLiteral("%1mod.ics").arg(m_agent->mRemoteCalendarPath);
+    const QString hrefDel = QStringLiteral("%1del.ics").arg(m_agent->mRemoteCalendarPath);
+    {
+        UpsyncJournal journal(journalFile);
+        QVERIFY(journal.load());
+        QVERIFY(journal.isEmpty());
+        journal.startBatch();
+        QVERIFY(journal.begin(UpsyncJournal::Upload, hrefAdd, evAdd->uid(), QString()));
+        QVERIFY(journal.begin(UpsyncJournal::Upload, hrefMod, evMod->uid(), QStringLiteral("\"etagMod\"")));
+        // Batched entries are only written on flush.
+        QVERIFY(!QFile::exists(journalFile));
+        QVERIFY(journal.flush());
+        QVERIFY(QFile::exists(journalFile));
+        QVERIFY(journal.begin(UpsyncJournal::Removal, hrefDel, QStringLiteral("del"), QStringLiteral("\"etagDel\"")));
+        QVERIFY(journal.complete(QSet<QString>() << hrefDel));
+    }
+
+    m_agent->mJournal.reset(new UpsyncJournal(journalFile));
+    QVERIFY(m_agent->mJournal->load());
+    QCOMPARE(m_agent->mJournal->entries().count(), 2);
+    QVERIFY(m_agent->mJournal->contains(hrefAdd));
+    QVERIFY(m_agent->mJournal->contains(hrefMod));
+    QCOMPARE(m_agent->mJournal->entry(hrefMod).etag, QStringLiteral("\"etagMod\""));
+
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(hrefAdd, QStringLiteral("\"etagAdd\""));
+    remoteUriEtags.insert(hrefMod, QStringLiteral("\"etagMod\""));
+    QVERIFY(m_agent->calculateDelta(remoteUriEtags,
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    // The addition reached the server, its etag is adopted without download.
+    QVERIFY(m_agent->mLocalAdditions.isEmpty());
+    QVERIFY(m_agent->mRemoteChanges.isEmpty());
+    KCalendarCore::Incidence::Ptr uploaded = m_agent->mCalendar->incidence(evAdd->uid());
+    QVERIFY(uploaded);
+    QVERIFY(uploaded->comments().contains(QStringLiteral("buteo:caldav:uri:%1").arg(hrefAdd)));
+    QVERIFY(uploaded->comments().contains(QStringLiteral("buteo:caldav:etag:\"etagAdd\"")));
+    // The modification did not reach the server, it is uploaded again.
+    QCOMPARE(m_agent->mLocalModifications.count(), 1);
+    QCOMPARE(m_agent->mLocalModifications.first()->uid(), evMod->uid());
+
+    QCOMPARE(m_agent->mSettledHrefs, QSet<QString>() << hrefAdd << hrefMod);
+    QVERIFY(m_agent->mJournal->complete(m_agent->mSettledHrefs));
+    QVERIFY(m_agent->mJournal->compact());
+    QVERIFY(!QFile::exists(journalFile));
+}
+
+void tst_NotebookSyncAgent::tombstones()
+{
+    const QString indexFile = QStringLiteral("./tombstones-test");
+    QFile::remove(indexFile);
+
+    // A deletion that failed to be sent during a previous sync.
+    KCalendarCore::Incidence::Ptr ev = KCalendarCore::Incidence::Ptr(new KCalendarCore::Event);
+    ev->setSummary("pending local deletion");
+    ev->addComment(QStringLiteral("buteo:caldav:uri:%1pending.ics").arg(m_agent->mRemoteCalendarPath));
+    ev->addComment(QStringLiteral("buteo:caldav:etag:\"etagPending\""));
+    m_agent->mCalendar->addEvent(ev.staticCast<KCalendarCore::Event>(),
+                                 m_agent->mNotebook->uid());
+    m_agent->mStorage->save();
+    m_agent->mCalendar->deleteIncidence(ev);
+    m_agent->mStorage->save();
+    QThread::sleep(1);
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc().addSecs(1));
+
+    const QString hrefPending = QStringLiteral("%1pending.ics").arg(m_agent->mRemoteCalendarPath);
+    const QString hrefGone = QStringLiteral("%1gone.ics").arg(m_agent->mRemoteCalendarPath);
+    {
+        TombstoneIndex index(indexFile);
+        QVERIFY(index.load());
+        QVERIFY(!index.exists());
+        index.insert(hrefPending, ev->uid(), QStringLiteral("\"etagPending\""));
+        index.insert(hrefGone, QStringLiteral("gone"), QStringLiteral("\"etagGone\""));
+        QVERIFY(index.save());
+    }
+
+    m_agent->mTombstones.reset(new TombstoneIndex(indexFile));
+    QVERIFY(m_agent->mTombstones->load());
+    QVERIFY(m_agent->mTombstones->exists());
+    QCOMPARE(m_agent->mTombstones->tombstones().count(), 2);
+
+    QHash<QString, QString> remoteUriEtags;
+    remoteUriEtags.insert(hrefPending, QStringLiteral("\"etagPending\""));
+    QVERIFY(m_agent->calculateDelta(remoteUriEtags,
+                                    &m_agent->mLocalAdditions,
+                                    &m_agent->mLocalModifications,
+                                    &m_agent->mLocalDeletions,
+                                    &m_agent->mRemoteChanges,
+                                    &m_agent->mRemoteDeletions));
+    QCOMPARE(m_agent->mLocalDeletions.count(), 1);
+    QCOMPARE(m_agent->mLocalDeletions.first()->uid(), ev->uid());
+    QVERIFY(m_agent->mRemoteChanges.isEmpty());
+
+    // The tombstone of a resource missing remotely has expired.
+    QVERIFY(m_agent->mTombstones->contains(hrefPending));
+    QVERIFY(!m_agent->mTombstones->contains(hrefGone));
+    QCOMPARE(m_agent->mPurgeList.count(), 1);
+    QCOMPARE(m_agent->mPurgeList.first()->uid(), QStringLiteral("gone"));
+
+    QVERIFY(m_agent->mTombstones->save());
+    QFile::remove(indexFile);
+}
+
 Q_DECLARE_METATYPE(KCalendarCore::Incidence::Ptr)
 void tst_NotebookSyncAgent::oneDownSyncCycle_data()
 {
@@ -883,6 +1082,89 @@ void tst_NotebookSyncAgent::requestFinished()
     QCOMPARE(finished.count(), 1);
 }
 
+void tst_NotebookSyncAgent::resolveConflict()
+{
+    const QString href = QStringLiteral("%1conflict.ics").arg(m_agent->mRemoteCalendarPath);
+    Put *put = new Put(m_agent->mNetworkManager, m_agent->mSettings);
+    m_agent->mRequests.insert(put);
+    m_agent->mSentUids.insert(href, QStringLiteral("conflict"));
+    m_agent->mPendingPayloads.insert(href, QByteArrayLiteral("BEGIN:VCALENDAR"));
+
+    // Without download, the remote version cannot replace the local one.
+    m_agent->setConflictResolutionPolicy(Buteo::SyncProfile::CR_POLICY_PREFER_REMOTE_CHANGES);
+    m_agent->mEnableDownsync = false;
+    QVERIFY(!m_agent->resolveConflict(put, href));
+    QVERIFY(m_agent->mPreconditionFailures.isEmpty());
+
+    m_agent->mEnableDownsync = true;
+    QVERIFY(m_agent->resolveConflict(put, href));
+    QCOMPARE(m_agent->mPreconditionFailures, QSet<QString>() << href);
+    QVERIFY(m_agent->mPendingConflicts.isEmpty());
+    QVERIFY(!m_agent->mSentUids.contains(href));
+    QVERIFY(!m_agent->mPendingPayloads.contains(href));
+    QVERIFY(m_agent->mSettledHrefs.contains(href));
+
+    m_agent->requestFinished(put);
+}
+
+void tst_NotebookSyncAgent::resolveConflictPreferLocal()
+{
+    const QString href = QStringLiteral("%1conflict.ics").arg(m_agent->mRemoteCalendarPath);
+    KCalendarCore::Event::Ptr event = KCalendarCore::Event::Ptr(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("conflict"));
+    event->setSummary(QStringLiteral("local summary"));
+    event->setDtStart(QDateTime(QDate(2020, 4, 1), QTime(10, 0), Qt::UTC));
+    const QByteArray localIcs = IncidenceHandler::toIcs(event);
+
+    Put *put = new Put(m_agent->mNetworkManager, m_agent->mSettings);
+    m_agent->mRequests.insert(put);
+    m_agent->mSentUids.insert(href, QStringLiteral("conflict"));
+    m_agent->mPendingPayloads.insert(href, localIcs);
+
+    // The remote resource is fetched before overwriting it.
+    m_agent->setConflictResolutionPolicy(Buteo::SyncProfile::CR_POLICY_PREFER_LOCAL_CHANGES);
+    QVERIFY(m_agent->resolveConflict(put, href));
+    QCOMPARE(m_agent->mPendingConflicts, QSet<QString>() << href);
+    QVERIFY(m_agent->mPendingPayloads.contains(href));
+    m_agent->clearRequests();
+
+    Reader::CalendarResource resource;
+    resource.href = href;
+    resource.etag = QStringLiteral("\"remote\"");
+    resource.incidences = Reader::readICalData(QString::fromUtf8(localIcs));
+    resource.contentLength = -1;
+
+    // The remote content matches the local changes: the etag is adopted.
+    Report *report = new Report(m_agent->mNetworkManager, m_agent->mSettings);
+    report->mFetchedUris << href;
+    report->mReceivedResources << resource;
+    m_agent->mRequests.insert(report);
+    connect(report, &Report::finished, m_agent, &NotebookSyncAgent::processConflicts);
+    emit report->finished(href);
+    QVERIFY(m_agent->mPendingConflicts.isEmpty());
+    QVERIFY(!m_agent->mPendingPayloads.contains(href));
+    QVERIFY(!m_agent->mSentUids.contains(href));
+    QVERIFY(m_agent->mSettledHrefs.contains(href));
+    QVERIFY(m_agent->mRequests.isEmpty());
+
+    // The remote content differs: the local changes are sent again.
+    event->setSummary(QStringLiteral("remote summary"));
+    resource.incidences = Reader::readICalData(QString::fromUtf8(IncidenceHandler::toIcs(event)));
+    m_agent->mSentUids.insert(href, QStringLiteral("conflict"));
+    m_agent->mPendingPayloads.insert(href, localIcs);
+    m_agent->mPendingConflicts.insert(href);
+    report = new Report(m_agent->mNetworkManager, m_agent->mSettings);
+    report->mFetchedUris << href;
+    report->mReceivedResources << resource;
+    m_agent->mRequests.insert(report);
+    connect(report, &Report::finished, m_agent, &NotebookSyncAgent::processConflicts);
+    emit report->finished(href);
+    QVERIFY(m_agent->mPendingConflicts.isEmpty());
+    QCOMPARE(m_agent->mRequests.count(), 1);
+    QVERIFY(qobject_cast<Put*>(*m_agent->mRequests.constBegin()));
+    m_agent->clearRequests();
+}
+
 void tst_NotebookSyncAgent::result()
 {
     m_agent->mSyncMode = NotebookSyncAgent::QuickSync;
@@ -980,5 +1262,271 @@ void tst_NotebookSyncAgent::result()
 
 }
 
+void tst_NotebookSyncAgent::receiveSpool()
+{
+    m_settings.setCacheDirectory(QStringLiteral("./cache"));
+    m_settings.setReceiveBufferSize(1);
+
+    const QString notebookId = QStringLiteral("26b24ae3-ab05-4892-ac36-632183113e2d");
+    mKCal::Notebook::Ptr notebook = m_agent->mStorage->notebook(notebookId);
+    if (!notebook) {
+        notebook = mKCal::Notebook::Ptr(new mKCal::Notebook(notebookId, "test1", "test 1", "red", true, false, false, false, false));
+        m_agent->mStorage->addNotebook(notebook);
+    }
+    m_agent->mNotebook = notebook;
+    m_agent->mSyncMode = NotebookSyncAgent::SlowSync;
+
+    QList<Reader::CalendarResource> resources;
+    for (int i = 0; i < 2; ++i) {
+        KCalendarCore::Event::Ptr event(new KCalendarCore::Event);
+        event->setUid(QStringLiteral("spooled-%1").arg(i));
+        event->setSummary(QStringLiteral("spooled event %1").arg(i));
+        event->setDtStart(QDateTime(QDate(2020, 1, 10 + i), QTime(10, 0), Qt::UTC));
+        KCalendarCore::MemoryCalendar::Ptr cal(new KCalendarCore::MemoryCalendar(QTimeZone::utc()));
+        cal->addEvent(event);
+        KCalendarCore::ICalFormat format;
+
+        Reader::CalendarResource resource;
+        resource.href = QStringLiteral("/testCal/spooled-%1.ics").arg(i);
+        resource.etag = QStringLiteral("\"etag-%1\"").arg(i);
+        resource.iCalData = format.toString(cal, QString());
+        resource.incidences = Reader::readICalData(resource.iCalData);
+        QCOMPARE(resource.incidences.count(), 1);
+        resources << resource;
+    }
+    m_agent->storeReceivedResources(resources);
+
+    QVERIFY(m_agent->mReceivedCalendarResources.isEmpty());
+    QVERIFY(m_agent->mReceiveSpool);
+    QCOMPARE(m_agent->mReceiveSpool->count(), 2);
+    QVERIFY(QFile::exists(m_agent->mReceiveSpool->fileName()));
+
+    Reader::CalendarResource spooled;
+    QVERIFY(m_agent->mReceiveSpool->resource(1, &spooled));
+    QCOMPARE(spooled.href, resources[1].href);
+    QCOMPARE(spooled.etag, resources[1].etag);
+    QCOMPARE(spooled.iCalData, resources[1].iCalData);
+    QCOMPARE(spooled.incidences.count(), 1);
+    QCOMPARE(spooled.incidences.first()->uid(), QStringLiteral("spooled-1"));
+
+    QVERIFY(m_agent->mReceiveSpool->entries()[0].hasBaseIncidence);
+    QCOMPARE(m_agent->mReceiveSpool->entries()[0].incidenceCount, 1);
+
+    // A retried request spools the same resource again.
+    QVERIFY(m_agent->mReceiveSpool->append(resources[0]));
+    QCOMPARE(m_agent->mReceiveSpool->count(), 3);
+    QCOMPARE(m_agent->mReceiveSpool->latestEntries(), QList<int>() << 1 << 2);
+
+    Buteo::TargetResults results = m_agent->result();
+    QCOMPARE(results.localItems().added, unsigned(2));
+
+    QVERIFY(m_agent->updateSpooledIncidences());
+    QVERIFY(m_agent->mCalendar->incidence(QStringLiteral("NBUID:%1:spooled-0").arg(notebookId)));
+    QVERIFY(m_agent->mCalendar->incidence(QStringLiteral("NBUID:%1:spooled-1").arg(notebookId)));
+
+    const QString fileName = m_agent->mReceiveSpool->fileName();
+    m_agent->mReceiveSpool->clear();
+    QVERIFY(!QFile::exists(fileName));
+}
+
+void tst_NotebookSyncAgent::preferFullFetch_data()
+{
+    QTest::addColumn<int>("collectionSize");
+    QTest::addColumn<double>("changeRatio");
+    QTest::addColumn<bool>("fullFetch");
+
+    QTest::newRow("small collection, mostly changed") << 10 << 0.8 << true;
+    QTest::newRow("small collection, half changed") << 10 << 0.5 << false;
+    QTest::newRow("tiny collection, one change") << 3 << 0.34 << true;
+    QTest::newRow("large collection, few changes") << 2000 << 0.01 << false;
+    QTest::newRow("large collection, all changed") << 2000 << 1. << true;
+    QTest::newRow("no change") << 10 << 0. << false;
+}
+
+void tst_NotebookSyncAgent::preferFullFetch()
+{
+    QFETCH(int, collectionSize);
+    QFETCH(double, changeRatio);
+    QFETCH(bool, fullFetch);
+
+    qint64 fetchCost = 0;
+    qint64 etagsCost = 0;
+    QCOMPARE(NotebookSyncAgent::preferFullFetch(collectionSize, changeRatio, 2000,
+                                                &fetchCost, &etagsCost), fullFetch);
+    QVERIFY(fetchCost > 0);
+    QVERIFY(etagsCost > 0);
+}
+
+void tst_NotebookSyncAgent::isCold_data()
+{
+    QTest::addColumn<int>("idleSyncs");
+    QTest::addColumn<int>("elapsed"); // since the last listing, in minutes.
+    QTest::addColumn<bool>("cold");
+
+    QTest::newRow("recently changed") << 0 << 5 << false;
+    QTest::newRow("few idle syncs") << 2 << 5 << false;
+    QTest::newRow("idle, checked recently") << 3 << 30 << true;
+    QTest::newRow("idle, due for a check") << 3 << 61 << false;
+    QTest::newRow("longer idle, longer interval") << 5 << 200 << true;
+    QTest::newRow("staleness bound") << 50 << 24 * 60 + 1 << false;
+    QTest::newRow("clock moved backwards") << 5 << -10 << false;
+}
+
+void tst_NotebookSyncAgent::isCold()
+{
+    QFETCH(int, idleSyncs);
+    QFETCH(int, elapsed);
+    QFETCH(bool, cold);
+
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+    QCOMPARE(NotebookSyncAgent::isCold(idleSyncs, now.addSecs(-60 * elapsed), now), cold);
+    QVERIFY(!NotebookSyncAgent::isCold(idleSyncs, QDateTime(), now));
+}
+
+void tst_NotebookSyncAgent::slowSyncSlices()
+{
+    const QDateTime now(QDate(2020, 6, 15), QTime(13, 30), Qt::UTC);
+    const QDateTime today(QDate(2020, 6, 15), QTime(0, 0), Qt::UTC);
+    const QDateTime from = now.addMonths(-6);
+    const QDateTime to = now.addMonths(12);
+
+    QList<QPair<QDateTime, QDateTime> > slices = NotebookSyncAgent::slowSyncSlices(from, to, now);
+    QCOMPARE(slices.count(), 3);
+    QCOMPARE(slices[0].first, today);
+    QCOMPARE(slices[0].second, today.addDays(14));
+    QCOMPARE(slices[1].first, today.addDays(14));
+    QCOMPARE(slices[1].second, to);
+    QCOMPARE(slices[2].first, from);
+    QCOMPARE(slices[2].second, today);
+
+    // Windows not covering the coming weeks are downloaded at once.
+    slices = NotebookSyncAgent::slowSyncSlices(from, now.addDays(7), now);
+    QCOMPARE(slices.count(), 1);
+    QCOMPARE(slices[0].first, from);
+    QCOMPARE(slices[0].second, now.addDays(7));
+    slices = NotebookSyncAgent::slowSyncSlices(QDateTime(), QDateTime(), now);
+    QCOMPARE(slices.count(), 1);
+}
+
+void tst_NotebookSyncAgent::deferredResources()
+{
+    QList<Reader::CalendarResource> resources;
+    const QStringList hrefs = {QStringLiteral("/calendars/small.ics"),
+                               QStringLiteral("/calendars/large.ics"),
+                               QStringLiteral("/calendars/unknown.ics"),
+                               QStringLiteral("/calendars/unchanged.ics")};
+    const QList<qint64> lengths = {1000, 200000, -1, 200000};
+    for (int i = 0; i < hrefs.count(); i++) {
+        Reader::CalendarResource resource;
+        resource.href = hrefs[i];
+        resource.contentLength = lengths[i];
+        resources.append(resource);
+    }
+    const QSet<QString> changes = {hrefs[0], hrefs[1], hrefs[2]};
+
+    // Only changed resources announced above the limit are deferred.
+    const QSet<QString> deferred = NotebookSyncAgent::deferredResources(resources, changes, 64 * 1024);
+    QCOMPARE(deferred.count(), 1);
+    QVERIFY(deferred.contains(hrefs[1]));
+    QVERIFY(NotebookSyncAgent::deferredResources(resources, QSet<QString>(), 64 * 1024).isEmpty());
+}
+
+void tst_NotebookSyncAgent::upsyncOnlyTrigger()
+{
+    m_agent->mNotebook->setSyncDate(QDateTime::currentDateTimeUtc().addSecs(1));
+    m_agent->mEnableUpsync = true;
+    m_agent->mEnableDownsync = true;
+
+    // Without local change, a sync triggered by a local change
+    // lists the remote collection as a quick sync.
+    m_agent->sendLocalChangesOnly(true);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::QuickSync);
+    QVERIFY(!m_agent->mRequests.isEmpty());
+    m_agent->clearRequests();
+
+    // A cold collection is not listed.
+    m_agent->sendLocalChangesOnly(false);
+    QCOMPARE(m_agent->mSyncMode, NotebookSyncAgent::UpsyncOnly);
+    QVERIFY(m_agent->mRequests.isEmpty());
+}
+
+void tst_NotebookSyncAgent::isSameContent()
+{
+    KCalendarCore::Event::Ptr event = KCalendarCore::Event::Ptr(new KCalendarCore::Event);
+    event->setUid(QStringLiteral("conflict"));
+    event->setSummary(QStringLiteral("local summary"));
+    event->setDtStart(QDateTime(QDate(2020, 4, 1), QTime(10, 0), Qt::UTC));
+    event->setDtEnd(QDateTime(QDate(2020, 4, 1), QTime(11, 0), Qt::UTC));
+    const QByteArray localIcs = IncidenceHandler::toIcs(event);
+
+    // The server stored the same content at another time.
+    KCalendarCore::Event::Ptr remote = KCalendarCore::Event::Ptr(event->clone());
+    remote->setLastModified(QDateTime(QDate(2020, 4, 2), QTime(8, 0), Qt::UTC));
+    KCalendarCore::Incidence::List remoteIncidences
+        = Reader::readICalData(QString::fromUtf8(IncidenceHandler::toIcs(remote)));
+    QCOMPARE(remoteIncidences.count(), 1);
+    QVERIFY(NotebookSyncAgent::isSameContent(localIcs, remoteIncidences));
+
+    // The remote content differs, local changes are sent.
+    remote->setSummary(QStringLiteral("remote summary"));
+    remoteIncidences = Reader::readICalData(QString::fromUtf8(IncidenceHandler::toIcs(remote)));
+    QVERIFY(!NotebookSyncAgent::isSameContent(localIcs, remoteIncidences));
+    QVERIFY(!NotebookSyncAgent::isSameContent(localIcs, KCalendarCore::Incidence::List()));
+}
+
+void tst_NotebookSyncAgent::updateSeriesWithExceptions_data()
+{
+    QTest::addColumn<int>("exceptionCount");
+
+    QTest::newRow("1000 exceptions") << 1000;
+    QTest::newRow("5000 exceptions") << 5000;
+}
+
+void tst_NotebookSyncAgent::updateSeriesWithExceptions()
+{
+    QFETCH(int, exceptionCount);
+
+    const QDateTime start(QDate(2005, 1, 3), QTime(9, 0), Qt::UTC);
+    KCalendarCore::Event::Ptr series(new KCalendarCore::Event);
+    series->setUid(QStringLiteral("daily-standup"));
+    series->setSummary(QStringLiteral("Daily stand-up"));
+    series->setDtStart(start);
+    series->setDtEnd(start.addSecs(15 * 60));
+    series->recurrence()->setDaily(1);
+    KCalendarCore::Incidence::List remote;
+    remote << series;
+    for (int i = 0; i < exceptionCount; ++i) {
+        const QDateTime recurrenceId = start.addDays(i);
+        KCalendarCore::Event::Ptr instance(series->clone());
+        instance->clearRecurrence();
+        instance->setRecurrenceId(recurrenceId);
+        instance->setDtStart(recurrenceId.addSecs(10 * 60));
+        instance->setDtEnd(recurrenceId.addSecs(25 * 60));
+        remote << instance;
+    }
+    // The received incidences are given the local uid when stored,
+    // each update works on a new copy, as read from a response.
+    auto received = [remote] {
+        Reader::CalendarResource resource;
+        resource.href = QStringLiteral("/testCal/daily-standup.ics");
+        resource.etag = QStringLiteral("\"etag\"");
+        for (const KCalendarCore::Incidence::Ptr &incidence : remote) {
+            resource.incidences << KCalendarCore::Incidence::Ptr(incidence->clone());
+        }
+        return QList<Reader::CalendarResource>() << resource;
+    };
+    QVERIFY(m_agent->updateIncidences(received()));
+
+    // Received again, every local exception is matched with a remote one.
+    QBENCHMARK {
+        QVERIFY(m_agent->updateIncidences(received()));
+    }
+    QVERIFY(m_agent->mRemoteDeletions.isEmpty());
+    KCalendarCore::Incidence::Ptr stored =
+        m_agent->mCalendar->incidence(QStringLiteral("NBUID:123456789:daily-standup"));
+    QVERIFY(stored);
+    QCOMPARE(m_agent->mCalendar->instances(stored).count(), exceptionCount);
+}
+
 #include "tst_notebooksyncagent.moc"
 QTEST_MAIN(tst_NotebookSyncAgent)
@@ -48,6 +48,12 @@ private slots:
     void parseCalendarResponse_data();
     void parseCalendarResponse();
 
+    void parseDiscoveryResponse_data();
+    void parseDiscoveryResponse();
+
+    void parseHomeTagResponse_data();
+    void parseHomeTagResponse();
+
 private:
     QNetworkAccessManager *mNAManager;
     Settings mSettings;
@@ -266,5 +272,93 @@ void tst_Propfind::parseCalendarResponse()
     QCOMPARE(response, calendars);
 }
 
+void tst_Propfind::parseDiscoveryResponse_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("success");
+    QTest::addColumn<QString>("userPrincipal");
+    QTest::addColumn<QString>("userMailtoHref");
+    QTest::addColumn<QString>("userHomeHref");
+
+    QTest::newRow("empty response")
+        << QByteArray()
+        << false
+        << QString()
+        << QString()
+        << QString();
+
+    QTest::newRow("forbidden access")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:c='urn:ietf:params:xml:ns:caldav'><D:response><D:href>/</D:href><D:propstat><D:prop><D:current-user-principal /><c:calendar-home-set /><c:calendar-user-address-set /></D:prop><D:status>HTTP/1.1 403</D:status></D:propstat></D:response></D:multistatus>")
+        << false
+        << QString()
+        << QString()
+        << QString();
+
+    QTest::newRow("principal only")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:c='urn:ietf:params:xml:ns:caldav'><D:response><D:href>/</D:href><D:propstat><D:prop><D:current-user-principal><D:href>/principals/users/username%40server.tld/</D:href></D:current-user-principal></D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat><D:propstat><D:prop><c:calendar-home-set /><c:calendar-user-address-set /></D:prop><D:status>HTTP/1.1 404 Not Found</D:status></D:propstat></D:response></D:multistatus>")
+        << true
+        << QString::fromLatin1("/principals/users/username%40server.tld/")
+        << QString()
+        << QString();
+
+    QTest::newRow("all properties")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:c='urn:ietf:params:xml:ns:caldav'><D:response><D:href>/</D:href><D:propstat><D:prop><D:current-user-principal><D:href>/principals/users/username%40server.tld/</D:href></D:current-user-principal><c:calendar-home-set><D:href>/caldav/</D:href></c:calendar-home-set><c:calendar-user-address-set><D:href>/principals/users/username%40server.tld/</D:href><D:href>mailto:username@server.tld</D:href></c:calendar-user-address-set></D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response></D:multistatus>")
+        << true
+        << QString::fromLatin1("/principals/users/username%40server.tld/")
+        << QString::fromLatin1("username@server.tld")
+        << QString::fromLatin1("/caldav/");
+}
+
+void tst_Propfind::parseDiscoveryResponse()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, success);
+    QFETCH(QString, userPrincipal);
+    QFETCH(QString, userMailtoHref);
+    QFETCH(QString, userHomeHref);
+
+    QCOMPARE(mRequest->parseDiscoveryResponse(data), success);
+    QCOMPARE(mRequest->userPrincipal(), userPrincipal);
+    QCOMPARE(mRequest->userMailtoHref(), userMailtoHref);
+    QCOMPARE(mRequest->userHomeHref(), userHomeHref);
+}
+
+void tst_Propfind::parseHomeTagResponse_data()
+{
+    QTest::addColumn<QByteArray>("data");
+    QTest::addColumn<bool>("success");
+    QTest::addColumn<QString>("homeTag");
+
+    QTest::newRow("empty response")
+        << QByteArray()
+        << false
+        << QString();
+
+    QTest::newRow("no tag")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:cs='http://calendarserver.org/ns/'><D:response><D:href>/caldav/</D:href><D:propstat><D:prop><D:sync-token /><cs:getctag /></D:prop><D:status>HTTP/1.1 404 Not Found</D:status></D:propstat></D:response></D:multistatus>")
+        << true
+        << QString();
+
+    QTest::newRow("ctag only")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:cs='http://calendarserver.org/ns/'><D:response><D:href>/caldav/</D:href><D:propstat><D:prop><cs:getctag>1234</cs:getctag></D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat><D:propstat><D:prop><D:sync-token /></D:prop><D:status>HTTP/1.1 404 Not Found</D:status></D:propstat></D:response></D:multistatus>")
+        << true
+        << QString::fromLatin1("1234");
+
+    QTest::newRow("sync-token preferred")
+        << QByteArray("<?xml version='1.0' encoding='utf-8'?><D:multistatus xmlns:D='DAV:' xmlns:cs='http://calendarserver.org/ns/'><D:response><D:href>/caldav/</D:href><D:propstat><D:prop><D:sync-token>http://server.tld/ns/sync/42</D:sync-token><cs:getctag>1234</cs:getctag></D:prop><D:status>HTTP/1.1 200 OK</D:status></D:propstat></D:response></D:multistatus>")
+        << true
+        << QString::fromLatin1("http://server.tld/ns/sync/42");
+}
+
+void tst_Propfind::parseHomeTagResponse()
+{
+    QFETCH(QByteArray, data);
+    QFETCH(bool, success);
+    QFETCH(QString, homeTag);
+
+    QCOMPARE(mRequest->parseHomeTagResponse(data), success);
+    QCOMPARE(mRequest->homeTag(), homeTag);
+}
+
 #include "tst_propfind.moc"
 QTEST_MAIN(tst_Propfind)
@@ -48,6 +48,9 @@ private slots:
 
     void readAlarm_data();
     void readAlarm();
+
+    void readChunks_data();
+    void readChunks();
 };
 
 tst_Reader::tst_Reader()
@@ -389,5 +392,63 @@ void tst_Reader::readAlarm()
     QCOMPARE(alarm->time(), QDateTime::fromString(expectedTime, Qt::ISODate));
 }
 
+void tst_Reader::readChunks_data()
+{
+    QTest::addColumn<QString>("xmlFilename");
+    QTest::addColumn<int>("chunkSize");
+
+    QTest::newRow("byte by byte")
+        << QStringLiteral("data/reader_base.xml") << 1;
+    QTest::newRow("unexpected elements")
+        << QStringLiteral("data/reader_unexpected_elements.xml") << 7;
+    QTest::newRow("escaped xml tag within ics")
+        << QStringLiteral("data/reader_xmltag.xml") << 5;
+    QTest::newRow("xml tags and entities within cdata")
+        << QStringLiteral("data/reader_cdata.xml") << 3;
+    QTest::newRow("UTF8 split in chunks")
+        << QStringLiteral("data/reader_UTF8_description.xml") << 2;
+    QTest::newRow("not a multistatus")
+        << QStringLiteral("data/reader_nodav.xml") << 64;
+}
+
+void tst_Reader::readChunks()
+{
+    QFETCH(QString, xmlFilename);
+    QFETCH(int, chunkSize);
+
+    QFile f(QStringLiteral("%1/%2").arg(QCoreApplication::applicationDirPath(), xmlFilename));
+    if (!f.exists() || !f.open(QIODevice::ReadOnly)) {
+        QFAIL("Data file does not exist or cannot be opened for reading!");
+    }
+    const QByteArray data = f.readAll();
+
+    Reader whole;
+    whole.read(data);
+
+    // Responses read in chunks, as received from the network,
+    // give the same resources without parsing their data.
+    Reader chunks;
+    chunks.setParseICalData(false);
+    QList<Reader::CalendarResource> resources;
+    for (int i = 0; i < data.size(); i += chunkSize) {
+        chunks.addData(data.mid(i, chunkSize));
+        resources += chunks.takeResults();
+    }
+    chunks.finish();
+    resources += chunks.takeResults();
+
+    QCOMPARE(chunks.hasError(), whole.hasError());
+    QCOMPARE(resources.count(), whole.results().count());
+    for (int i = 0; i < resources.count(); ++i) {
+        QCOMPARE(resources[i].href, whole.results()[i].href);
+        QCOMPARE(resources[i].etag, whole.results()[i].etag);
+        QCOMPARE(resources[i].iCalData, whole.results()[i].iCalData);
+        QVERIFY(resources[i].incidences.isEmpty());
+        QCOMPARE(Reader::readICalData(resources[i].iCalData).count(),
+                 whole.results()[i].incidences.count());
+    }
+    QVERIFY(chunks.results().isEmpty());
+}
+
 #include "tst_reader.moc"
 QTEST_MAIN(tst_Reader)
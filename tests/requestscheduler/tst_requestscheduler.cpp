@@ -0,0 +1,425 @@
+/* -*- c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <QtTest>
+#include <QObject>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
+
+#include <requestscheduler.h>
+#include <request.h>
+#include <settings.h>
+
+namespace {
+    const QString HOST = QStringLiteral("caldav.example.com");
+
+    // A finished reply, as received from the server.
+    class FakeReply : public QNetworkReply
+    {
+    public:
+        FakeReply(int status, NetworkError error, const QByteArray &retryAfter = QByteArray())
+        {
+            setAttribute(QNetworkRequest::HttpStatusCodeAttribute, status);
+            setError(error, QString());
+            if (!retryAfter.isEmpty()) {
+                setRawHeader("Retry-After", retryAfter);
+            }
+            open(QIODevice::ReadOnly);
+            setFinished(true);
+        }
+
+        void abort() override
+        {
+        }
+
+    protected:
+        qint64 readData(char *data, qint64 maxSize) override
+        {
+            Q_UNUSED(data);
+            Q_UNUSED(maxSize);
+            return -1;
+        }
+    };
+
+    class TestRequest : public Request
+    {
+    public:
+        TestRequest(QNetworkAccessManager *manager, Settings *settings, const QString &command)
+            : Request(manager, settings, command)
+            , mHandled(nullptr)
+        {
+        }
+
+        QNetworkReply *mHandled;
+
+    protected:
+        void handleReply(QNetworkReply *reply) override
+        {
+            mHandled = reply;
+        }
+    };
+}
+
+class tst_RequestScheduler : public QObject
+{
+    Q_OBJECT
+
+public:
+    tst_RequestScheduler();
+    virtual ~tst_RequestScheduler();
+
+public slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void init();
+    void cleanup();
+
+private slots:
+    void retryBackoff_data();
+    void retryBackoff();
+    void retryAfter_data();
+    void retryAfter();
+    void window();
+    void deadlines();
+    void tokenReplay();
+    void tokenRefreshFailed();
+    void parseBacklog();
+
+private:
+    TestRequest* newRequest(const QString &command = QStringLiteral("REPORT"));
+    qint64 queuedDelay() const;
+
+    QNetworkAccessManager *mNAManager;
+    RequestScheduler *mScheduler;
+    Settings mSettings;
+};
+
+tst_RequestScheduler::tst_RequestScheduler()
+    : mNAManager(nullptr)
+    , mScheduler(nullptr)
+{
+}
+
+tst_RequestScheduler::~tst_RequestScheduler()
+{
+}
+
+void tst_RequestScheduler::initTestCase()
+{
+    qputenv("MSYNCD_LOGGING_LEVEL", "8");
+}
+
+void tst_RequestScheduler::cleanupTestCase()
+{
+}
+
+void tst_RequestScheduler::init()
+{
+    // A new scheduler for each test, without any host state.
+    mNAManager = new QNetworkAccessManager;
+    mScheduler = RequestScheduler::instance(mNAManager);
+}
+
+void tst_RequestScheduler::cleanup()
+{
+    delete mNAManager;
+    mNAManager = nullptr;
+    mScheduler = nullptr;
+    mSettings.setAuthToken(QString());
+}
+
+TestRequest* tst_RequestScheduler::newRequest(const QString &command)
+{
+    TestRequest *request = new TestRequest(mNAManager, &mSettings, command);
+    request->mRequest.setUrl(QUrl(QStringLiteral("https://%1/calendars/user/").arg(HOST)));
+    return request;
+}
+
+// Delay before the first queued request to HOST is ready.
+qint64 tst_RequestScheduler::queuedDelay() const
+{
+    const RequestScheduler::Host host = mScheduler->mHosts.value(HOST);
+    if (host.queue.isEmpty()) {
+        return -1;
+    }
+    return qMax(host.queue.first().readyTime, host.resumeTime) - RequestScheduler::monotonicTime();
+}
+
+void tst_RequestScheduler::retryBackoff_data()
+{
+    QTest::addColumn<int>("attempts");
+    QTest::addColumn<int>("status");
+    QTest::addColumn<qint64>("minDelay");
+    QTest::addColumn<qint64>("maxDelay");
+
+    QTest::newRow("first retry") << 1 << 502 << qint64(500) << qint64(1000);
+    QTest::newRow("third retry") << 3 << 504 << qint64(2000) << qint64(4000);
+    QTest::newRow("too many attempts") << 4 << 502 << qint64(-1) << qint64(-1);
+    QTest::newRow("not transient") << 1 << 404 << qint64(-1) << qint64(-1);
+}
+
+void tst_RequestScheduler::retryBackoff()
+{
+    QFETCH(int, attempts);
+    QFETCH(int, status);
+    QFETCH(qint64, minDelay);
+    QFETCH(qint64, maxDelay);
+
+    QScopedPointer<Request> request(newRequest());
+    request->mAttempts = attempts;
+    FakeReply reply(status, status == 404 ? QNetworkReply::ContentNotFoundError
+                    : QNetworkReply::UnknownServerError);
+    QCOMPARE(request->retry(&reply), minDelay >= 0);
+    if (minDelay < 0) {
+        QCOMPARE(queuedDelay(), qint64(-1));
+        return;
+    }
+    // Jittered within the second half of the backoff.
+    const qint64 delay = queuedDelay();
+    QVERIFY2(delay <= maxDelay && delay >= minDelay - 100, qPrintable(QString::number(delay)));
+    // Gateway errors do not pause the host.
+    QCOMPARE(mScheduler->mHosts.value(HOST).resumeTime, qint64(0));
+}
+
+void tst_RequestScheduler::retryAfter_data()
+{
+    QTest::addColumn<int>("status");
+    QTest::addColumn<QByteArray>("retryAfter");
+    QTest::addColumn<qint64>("delay");
+    QTest::addColumn<bool>("paused");
+
+    QTest::newRow("too many requests") << 429 << QByteArray("7") << qint64(7000) << true;
+    QTest::newRow("unavailable") << 503 << QByteArray("2") << qint64(2000) << true;
+    QTest::newRow("gateway timeout") << 504 << QByteArray("3") << qint64(3000) << false;
+    QTest::newRow("http date") << 503
+        << QLocale::c().toString(QDateTime::currentDateTimeUtc().addSecs(10),
+                                 QStringLiteral("ddd, dd MMM yyyy hh:mm:ss 'GMT'")).toLatin1()
+        << qint64(10000) << true;
+    QTest::newRow("too long") << 503 << QByteArray("3600") << qint64(-1) << false;
+}
+
+void tst_RequestScheduler::retryAfter()
+{
+    QFETCH(int, status);
+    QFETCH(QByteArray, retryAfter);
+    QFETCH(qint64, delay);
+    QFETCH(bool, paused);
+
+    QScopedPointer<Request> request(newRequest());
+    request->mAttempts = 1;
+    FakeReply reply(status, QNetworkReply::ServiceUnavailableError, retryAfter);
+    QCOMPARE(request->retry(&reply), delay >= 0);
+    if (delay < 0) {
+        QCOMPARE(queuedDelay(), qint64(-1));
+        return;
+    }
+    const qint64 queued = queuedDelay();
+    QVERIFY2(queued <= delay && queued >= delay - 1100, qPrintable(QString::number(queued)));
+
+    // An overloaded server is not sent any other request meanwhile.
+    const RequestScheduler::Host host = mScheduler->mHosts.value(HOST);
+    QCOMPARE(host.resumeTime > RequestScheduler::monotonicTime(), paused);
+    QScopedPointer<Request> other(newRequest(QStringLiteral("PROPFIND")));
+    mScheduler->schedule(other.data());
+    const RequestScheduler::Pending pending = mScheduler->mHosts.value(HOST).queue.last();
+    QCOMPARE(pending.request.data(), other.data());
+    QCOMPARE(pending.readyTime > RequestScheduler::monotonicTime(), paused);
+}
+
+void tst_RequestScheduler::window()
+{
+    QCOMPARE(mScheduler->window(HOST), 4);
+
+    // Grows by about one per window of replies at a flat latency.
+    for (int i = 0; i < 5; i++) {
+        mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 100, 1000, false, false);
+    }
+    QCOMPARE(mScheduler->window(HOST), 5);
+    // A slower reply does not grow it.
+    const double grown = mScheduler->mHosts.value(HOST).window;
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 1000, 1000, false, false);
+    QCOMPARE(mScheduler->mHosts.value(HOST).window, grown);
+
+    // Halved on congestion, once per burst of replies.
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 100, 0, true, true);
+    QCOMPARE(mScheduler->mHosts.value(HOST).window, grown / 2.);
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 100, 0, true, true);
+    QCOMPARE(mScheduler->mHosts.value(HOST).window, grown / 2.);
+    QTest::qWait(150);
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 100, 0, true, true);
+    QCOMPARE(mScheduler->mHosts.value(HOST).window, grown / 4.);
+    QTest::qWait(150);
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 100, 0, true, true);
+    QCOMPARE(mScheduler->window(HOST), 1);
+
+    // Other hosts are not affected.
+    QCOMPARE(mScheduler->window(QStringLiteral("other.example.com")), 4);
+}
+
+void tst_RequestScheduler::deadlines()
+{
+    // Nothing known yet about the host.
+    QCOMPARE(mScheduler->inactivityTimeout(HOST, QStringLiteral("REPORT")), qint64(30000));
+    QCOMPARE(mScheduler->totalTimeout(HOST, QStringLiteral("REPORT"), 0), qint64(300000));
+
+    // 20 s replies at 100 bytes per ms.
+    mScheduler->replyFinished(HOST, QStringLiteral("REPORT"), 20000, 2000000, false, false);
+    QCOMPARE(mScheduler->inactivityTimeout(HOST, QStringLiteral("REPORT")), qint64(60000));
+    QCOMPARE(mScheduler->totalTimeout(HOST, QStringLiteral("REPORT"), 0), qint64(80000));
+    // Large uploads are given the time to be sent.
+    QCOMPARE(mScheduler->totalTimeout(HOST, QStringLiteral("REPORT"), 5000000), qint64(200000));
+
+    QScopedPointer<Request> request(newRequest());
+    request->mInactivityTimeout = 15000;
+    request->mTotalTimeout = 60000;
+    request->mReplyTimer.start();
+    QVERIFY(request->stallDelay() <= 15000);
+    QVERIFY(request->stallDelay() > 14000);
+
+    // Past the total deadline without any byte received.
+    request->mTotalTimeout = 0;
+    QCOMPARE(request->stallDelay(), qint64(0));
+
+    // A response still being received is only bounded by inactivity.
+    request->mReplyBytes = 1024;
+    QCOMPARE(request->stallDelay(), qint64(15000));
+}
+
+void tst_RequestScheduler::tokenReplay()
+{
+    int expired = 0;
+    connect(mScheduler, &RequestScheduler::tokenExpired,
+            [&expired] (const Settings *settings) {
+                Q_UNUSED(settings);
+                expired += 1;
+            });
+    // Keep the replayed requests queued, instead of sending them.
+    mScheduler->pause(HOST, 60000);
+
+    mSettings.setAuthToken(QStringLiteral("expired"));
+    QScopedPointer<TestRequest> first(newRequest());
+    QScopedPointer<TestRequest> second(newRequest(QStringLiteral("PROPFIND")));
+    first->mRequest.setRawHeader("Authorization", "Bearer expired");
+    second->mRequest.setRawHeader("Authorization", "Bearer expired");
+    FakeReply *firstReply = new FakeReply(401, QNetworkReply::AuthenticationRequiredError);
+    firstReply->setParent(first.data());
+    FakeReply *secondReply = new FakeReply(401, QNetworkReply::AuthenticationRequiredError);
+    secondReply->setParent(second.data());
+
+    // Both are held, for a single refresh.
+    QVERIFY(first->authorizationExpired(firstReply));
+    QVERIFY(second->authorizationExpired(secondReply));
+    QCOMPARE(expired, 1);
+    QCOMPARE(first->mRejectedReply.data(), static_cast<QNetworkReply*>(firstReply));
+    QCOMPARE(mScheduler->mHosts.value(HOST).queue.count(), 0);
+
+    // Sent again once refreshed, without handling the rejected reply.
+    mSettings.setAuthToken(QStringLiteral("refreshed"));
+    mScheduler->tokenRefreshed(&mSettings, true);
+    QVERIFY(!first->mRejectedReply);
+    QVERIFY(!second->mRejectedReply);
+    QVERIFY(!first->mHandled);
+    QVERIFY(!second->mHandled);
+    QCOMPARE(mScheduler->mHosts.value(HOST).queue.count(), 2);
+
+    // Sent with the previous token, it is replayed without a refresh.
+    QScopedPointer<TestRequest> late(newRequest());
+    late->mRequest.setRawHeader("Authorization", "Bearer expired");
+    FakeReply *lateReply = new FakeReply(401, QNetworkReply::AuthenticationRequiredError);
+    lateReply->setParent(late.data());
+    QVERIFY(late->authorizationExpired(lateReply));
+    QCOMPARE(expired, 1);
+    QCOMPARE(mScheduler->mHosts.value(HOST).queue.count(), 3);
+
+    // The new token is rejected too, the sync fails as before.
+    first->mRequest.setRawHeader("Authorization", "Bearer refreshed");
+    FakeReply *again = new FakeReply(401, QNetworkReply::AuthenticationRequiredError);
+    again->setParent(first.data());
+    QVERIFY(!first->authorizationExpired(again));
+    QCOMPARE(expired, 1);
+
+    // The next sync may refresh again.
+    mScheduler->forgetToken(&mSettings);
+    QVERIFY(first->authorizationExpired(again));
+    QCOMPARE(expired, 2);
+
+    // Other failures are not held.
+    FakeReply *forbidden = new FakeReply(403, QNetworkReply::ContentAccessDenied);
+    forbidden->setParent(second.data());
+    QVERIFY(!second->authorizationExpired(forbidden));
+}
+
+void tst_RequestScheduler::tokenRefreshFailed()
+{
+    mScheduler->pause(HOST, 60000);
+
+    mSettings.setAuthToken(QStringLiteral("expired"));
+    QScopedPointer<TestRequest> request(newRequest());
+    request->mRequest.setRawHeader("Authorization", "Bearer expired");
+    FakeReply *reply = new FakeReply(401, QNetworkReply::AuthenticationRequiredError);
+    reply->setParent(request.data());
+    QVERIFY(request->authorizationExpired(reply));
+
+    // The kept reply is handled as a usual failure.
+    mScheduler->tokenRefreshed(&mSettings, false);
+    QCOMPARE(request->mHandled, static_cast<QNetworkReply*>(reply));
+    QVERIFY(!request->mRejectedReply);
+    QCOMPARE(mScheduler->mHosts.value(HOST).queue.count(), 0);
+}
+
+void tst_RequestScheduler::parseBacklog()
+{
+    QScopedPointer<TestRequest> report(newRequest());
+    QScopedPointer<TestRequest> put(newRequest(QStringLiteral("PUT")));
+
+    // Up to four responses parsed or waiting for a parser.
+    for (int i = 0; i < 3; i++) {
+        mScheduler->parseStarted();
+    }
+    QVERIFY(!mScheduler->isHeld(report.data()));
+    mScheduler->parseStarted();
+    QVERIFY(mScheduler->isHeld(report.data()));
+    // Uploads do not bring anything to parse.
+    QVERIFY(!mScheduler->isHeld(put.data()));
+
+    // Queued, without waking up the scheduler.
+    mScheduler->schedule(report.data());
+    QCOMPARE(mScheduler->mHosts.value(HOST).queue.count(), 1);
+    QCOMPARE(mScheduler->mHosts.value(HOST).inFlight, 0);
+    QVERIFY(!mScheduler->mTimer->isActive());
+
+    // Dispatched as soon as a parse finishes.
+    mScheduler->parseFinished();
+    QVERIFY(!mScheduler->isHeld(report.data()));
+    QVERIFY(mScheduler->mTimer->isActive());
+    mScheduler->mTimer->stop();
+    mScheduler->mHosts[HOST].queue.clear();
+
+    // Never below zero.
+    for (int i = 0; i < 5; i++) {
+        mScheduler->parseFinished();
+    }
+    QCOMPARE(mScheduler->mParsing, 0);
+    mScheduler->parseStarted();
+    QVERIFY(!mScheduler->isHeld(report.data()));
+    mScheduler->parseFinished();
+}
+
+#include "tst_requestscheduler.moc"
+QTEST_MAIN(tst_RequestScheduler)
@@ -0,0 +1,199 @@
+/* -*- c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <QtTest>
+#include <QObject>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+
+#include <syncmetrics.h>
+
+class tst_SyncMetrics : public QObject
+{
+    Q_OBJECT
+
+public:
+    tst_SyncMetrics();
+    virtual ~tst_SyncMetrics();
+
+public slots:
+    void initTestCase();
+    void cleanupTestCase();
+
+private slots:
+    void accumulate();
+    void merge();
+    void toJson();
+    void save();
+};
+
+tst_SyncMetrics::tst_SyncMetrics()
+{
+}
+
+tst_SyncMetrics::~tst_SyncMetrics()
+{
+}
+
+void tst_SyncMetrics::initTestCase()
+{
+    qputenv("MSYNCD_LOGGING_LEVEL", "8");
+}
+
+void tst_SyncMetrics::cleanupTestCase()
+{
+    QFile::remove(QStringLiteral("./metrics-test.json"));
+}
+
+void tst_SyncMetrics::accumulate()
+{
+    SyncMetrics metrics(QStringLiteral("account"));
+    metrics.start(QStringLiteral("etags"));
+    metrics.addRequest(QStringLiteral("etags"), 100, 2000);
+    metrics.addRequest(QStringLiteral("etags"), 150, 3000);
+    QTest::qWait(20);
+    metrics.start(QStringLiteral("etags"));
+    metrics.stop(QStringLiteral("etags"));
+    // Phases overlap, the span goes from the first start to the last stop.
+    QVERIFY(metrics.duration(QStringLiteral("etags")) >= 20);
+
+    // A phase stopped without being started has no duration.
+    metrics.stop(QStringLiteral("write"));
+    QCOMPARE(metrics.duration(QStringLiteral("write")), qint64(0));
+    QCOMPARE(metrics.duration(QStringLiteral("unknown")), qint64(0));
+
+    metrics.addRequest(QStringLiteral("upload"), 500, 50);
+    QCOMPARE(metrics.bytesSent(), qint64(750));
+    QCOMPARE(metrics.bytesReceived(), qint64(5050));
+
+    metrics.addParsedResources(3);
+    metrics.addParsedResources(4);
+    metrics.addWrittenIncidences(5);
+    metrics.addStorageTime(12);
+    metrics.addDeferredResources(1);
+    QCOMPARE(metrics.mParsedResources, 7);
+    QCOMPARE(metrics.mWrittenIncidences, 5);
+    QCOMPARE(metrics.mStorageTime, qint64(12));
+    QCOMPARE(metrics.mDeferredResources, 1);
+
+    const QString summary = metrics.summary();
+    QVERIFY(summary.startsWith(QStringLiteral("etags ")));
+    QVERIFY(summary.contains(QStringLiteral("(2 req, 250/5000 B)")));
+    QVERIFY(summary.contains(QStringLiteral("7 parsed")));
+    QVERIFY(summary.contains(QStringLiteral("5 written, storage 12ms")));
+    QVERIFY(summary.contains(QStringLiteral("1 deferred")));
+    QVERIFY(summary.endsWith(QStringLiteral("total 750/5050 B")));
+}
+
+void tst_SyncMetrics::merge()
+{
+    SyncMetrics total(QStringLiteral("account"));
+    total.start(QStringLiteral("discovery"));
+    total.stop(QStringLiteral("discovery"));
+    QTest::qWait(50);
+
+    SyncMetrics notebook(QStringLiteral("notebook"));
+    notebook.start(QStringLiteral("etags"));
+    notebook.addRequest(QStringLiteral("etags"), 10, 20);
+    QTest::qWait(20);
+    notebook.stop(QStringLiteral("etags"));
+    notebook.addParsedResources(2);
+    notebook.addWrittenIncidences(2);
+
+    // The notebook spans are shifted to the clock of the account.
+    const qint64 shift = total.mClock.msecsTo(notebook.mClock);
+    QVERIFY(shift >= 50);
+    total.merge(notebook);
+    QCOMPARE(total.mOrder, QStringList() << QStringLiteral("discovery") << QStringLiteral("etags"));
+    const SyncMetrics::Phase etags = total.mPhases.value(QStringLiteral("etags"));
+    QCOMPARE(etags.start, notebook.mPhases.value(QStringLiteral("etags")).start + shift);
+    QCOMPARE(etags.end, notebook.mPhases.value(QStringLiteral("etags")).end + shift);
+    QCOMPARE(total.duration(QStringLiteral("etags")), notebook.duration(QStringLiteral("etags")));
+    QCOMPARE(etags.requests, 1);
+
+    // A same phase in another notebook widens the span and adds up.
+    SyncMetrics other(QStringLiteral("other"));
+    other.start(QStringLiteral("etags"));
+    other.addRequest(QStringLiteral("etags"), 5, 5);
+    QTest::qWait(40);
+    other.stop(QStringLiteral("etags"));
+    total.merge(other);
+    const SyncMetrics::Phase merged = total.mPhases.value(QStringLiteral("etags"));
+    QCOMPARE(merged.start, etags.start);
+    QVERIFY(merged.end > etags.end);
+    QCOMPARE(merged.requests, 2);
+    QCOMPARE(total.bytesSent(), qint64(15));
+    QCOMPARE(total.bytesReceived(), qint64(25));
+    QCOMPARE(total.mParsedResources, 2);
+    QCOMPARE(total.mWrittenIncidences, 2);
+}
+
+void tst_SyncMetrics::toJson()
+{
+    SyncMetrics metrics(QStringLiteral("account"));
+    metrics.start(QStringLiteral("report"));
+    metrics.addRequest(QStringLiteral("report"), 300, 9000);
+    metrics.stop(QStringLiteral("report"));
+    metrics.start(QStringLiteral("write"));
+    metrics.stop(QStringLiteral("write"));
+    metrics.addParsedResources(12);
+    metrics.addDeferredResources(2);
+
+    const QJsonObject record = metrics.toJson();
+    QCOMPARE(record.value(QStringLiteral("name")).toString(), QStringLiteral("account"));
+    QCOMPARE(record.value(QStringLiteral("bytesSent")).toDouble(), 300.);
+    QCOMPARE(record.value(QStringLiteral("bytesReceived")).toDouble(), 9000.);
+    QCOMPARE(record.value(QStringLiteral("parsedResources")).toInt(), 12);
+    QCOMPARE(record.value(QStringLiteral("writtenIncidences")).toInt(), 0);
+    QCOMPARE(record.value(QStringLiteral("deferredResources")).toInt(), 2);
+    QVERIFY(record.value(QStringLiteral("duration")).toDouble() >= 0.);
+
+    // Phases are listed in their order of appearance.
+    const QJsonArray phases = record.value(QStringLiteral("phases")).toArray();
+    QCOMPARE(phases.count(), 2);
+    const QJsonObject report = phases[0].toObject();
+    QCOMPARE(report.value(QStringLiteral("name")).toString(), QStringLiteral("report"));
+    QCOMPARE(report.value(QStringLiteral("requests")).toInt(), 1);
+    QCOMPARE(report.value(QStringLiteral("bytesSent")).toDouble(), 300.);
+    QCOMPARE(report.value(QStringLiteral("bytesReceived")).toDouble(), 9000.);
+    QCOMPARE(phases[1].toObject().value(QStringLiteral("name")).toString(), QStringLiteral("write"));
+}
+
+void tst_SyncMetrics::save()
+{
+    const QString fileName = QStringLiteral("./metrics-test.json");
+    QFile::remove(fileName);
+
+    // Records are appended, only the last ones are kept.
+    for (int i = 0; i < 40; i++) {
+        QJsonObject record;
+        record.insert(QStringLiteral("name"), QString::number(i));
+        QVERIFY(SyncMetrics::save(fileName, record));
+    }
+    QFile file(fileName);
+    QVERIFY(file.open(QIODevice::ReadOnly));
+    const QJsonArray records = QJsonDocument::fromJson(file.readAll()).array();
+    QCOMPARE(records.count(), 32);
+    QCOMPARE(records.first().toObject().value(QStringLiteral("name")).toString(), QStringLiteral("8"));
+    QCOMPARE(records.last().toObject().value(QStringLiteral("name")).toString(), QStringLiteral("39"));
+}
+
+#include "tst_syncmetrics.moc"
+QTEST_MAIN(tst_SyncMetrics)
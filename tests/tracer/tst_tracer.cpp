@@ -0,0 +1,189 @@
+/* -*- c-basic-offset: 4 -*- */
+/*
+ * Copyright (C) 2020 Jolla Ltd.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <QtTest>
+#include <QObject>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QThread>
+
+#include <tracer.h>
+
+class tst_Tracer : public QObject
+{
+    Q_OBJECT
+
+public:
+    tst_Tracer();
+    virtual ~tst_Tracer();
+
+public slots:
+    void initTestCase();
+    void cleanupTestCase();
+    void init();
+    void cleanup();
+
+private slots:
+    void disabled();
+    void addSpan();
+    void traceSpan();
+    void threads();
+
+private:
+    QJsonArray savedEvents();
+};
+
+tst_Tracer::tst_Tracer()
+{
+}
+
+tst_Tracer::~tst_Tracer()
+{
+}
+
+void tst_Tracer::initTestCase()
+{
+    qputenv("MSYNCD_LOGGING_LEVEL", "8");
+}
+
+void tst_Tracer::cleanupTestCase()
+{
+    QFile::remove(QStringLiteral("./trace-test.json"));
+}
+
+void tst_Tracer::init()
+{
+    Tracer::clear();
+}
+
+void tst_Tracer::cleanup()
+{
+    Tracer::setEnabled(false);
+    Tracer::clear();
+}
+
+QJsonArray tst_Tracer::savedEvents()
+{
+    const QString fileName = QStringLiteral("./trace-test.json");
+    if (!Tracer::save(fileName)) {
+        return QJsonArray();
+    }
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly)) {
+        return QJsonArray();
+    }
+    const QJsonObject trace = QJsonDocument::fromJson(file.readAll()).object();
+    if (trace.value(QStringLiteral("displayTimeUnit")).toString() != QStringLiteral("ms")) {
+        return QJsonArray();
+    }
+    return trace.value(QStringLiteral("traceEvents")).toArray();
+}
+
+void tst_Tracer::disabled()
+{
+    QVERIFY(!Tracer::isEnabled());
+    Tracer::addSpan("sync", QStringLiteral("ignored"), Tracer::now());
+    {
+        TraceSpan span("sync", QStringLiteral("ignored span"));
+    }
+    QCOMPARE(savedEvents().count(), 0);
+}
+
+void tst_Tracer::addSpan()
+{
+    Tracer::setEnabled(true);
+    QVERIFY(Tracer::isEnabled());
+
+    const qint64 start = Tracer::now();
+    QTest::qWait(10);
+    QVERIFY(Tracer::now() - start >= 10000);
+    QVariantMap args;
+    args.insert(QStringLiteral("uri"), QStringLiteral("/calendars/alice/"));
+    args.insert(QStringLiteral("attempt"), 2);
+    Tracer::addSpan("request", QStringLiteral("REPORT"), start, start + 1500, args);
+    Tracer::addSpan("sync", QStringLiteral("notebook sync"), start);
+
+    const QJsonArray events = savedEvents();
+    QCOMPARE(events.count(), 2);
+    const QJsonObject report = events[0].toObject();
+    QCOMPARE(report.value(QStringLiteral("name")).toString(), QStringLiteral("REPORT"));
+    QCOMPARE(report.value(QStringLiteral("cat")).toString(), QStringLiteral("request"));
+    QCOMPARE(report.value(QStringLiteral("ph")).toString(), QStringLiteral("X"));
+    QCOMPARE(report.value(QStringLiteral("ts")).toDouble(), double(start));
+    QCOMPARE(report.value(QStringLiteral("dur")).toDouble(), 1500.);
+    QCOMPARE(report.value(QStringLiteral("pid")).toDouble(), double(QCoreApplication::applicationPid()));
+    const QJsonObject reportArgs = report.value(QStringLiteral("args")).toObject();
+    QCOMPARE(reportArgs.value(QStringLiteral("uri")).toString(), QStringLiteral("/calendars/alice/"));
+    QCOMPARE(reportArgs.value(QStringLiteral("attempt")).toInt(), 2);
+
+    // Without an end, the span ends when recorded.
+    const QJsonObject sync = events[1].toObject();
+    QVERIFY(sync.value(QStringLiteral("dur")).toDouble() >= 10000.);
+    QVERIFY(!sync.contains(QStringLiteral("args")));
+
+    Tracer::clear();
+    QCOMPARE(savedEvents().count(), 0);
+}
+
+void tst_Tracer::traceSpan()
+{
+    Tracer::setEnabled(true);
+    {
+        TraceSpan span("parse", QStringLiteral("REPORT response"));
+        QTest::qWait(5);
+        // Spans are only recorded once they end.
+        QCOMPARE(savedEvents().count(), 0);
+    }
+    const QJsonArray events = savedEvents();
+    QCOMPARE(events.count(), 1);
+    const QJsonObject event = events.first().toObject();
+    QCOMPARE(event.value(QStringLiteral("name")).toString(), QStringLiteral("REPORT response"));
+    QCOMPARE(event.value(QStringLiteral("cat")).toString(), QStringLiteral("parse"));
+    QVERIFY(event.value(QStringLiteral("dur")).toDouble() >= 5000.);
+
+    // A span started while disabled is not recorded.
+    Tracer::setEnabled(false);
+    TraceSpan *late = new TraceSpan("parse", QStringLiteral("late"));
+    Tracer::setEnabled(true);
+    delete late;
+    QCOMPARE(savedEvents().count(), 1);
+}
+
+void tst_Tracer::threads()
+{
+    Tracer::setEnabled(true);
+    Tracer::addSpan("sync", QStringLiteral("main"), Tracer::now());
+    QThread *thread = QThread::create([] {
+        TraceSpan span("parse", QStringLiteral("worker"));
+    });
+    thread->start();
+    QVERIFY(thread->wait(5000));
+    delete thread;
+
+    const QJsonArray events = savedEvents();
+    QCOMPARE(events.count(), 2);
+    QVERIFY(events[0].toObject().value(QStringLiteral("tid")).toDouble()
+            != events[1].toObject().value(QStringLiteral("tid")).toDouble());
+    QCOMPARE(events[1].toObject().value(QStringLiteral("name")).toString(), QStringLiteral("worker"));
+}
+
+#include "tst_tracer.moc"
+QTEST_MAIN(tst_Tracer)